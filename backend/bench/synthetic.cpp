@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+#include "synthetic.hpp"
+
+using namespace std;
+using Eigen::MatrixXd;
+
+model_shape parse_model_shape(const string& name) {
+  if(name == "hierarchy") return model_shape::hierarchy;
+  if(name == "deep") return model_shape::deep;
+  if(name == "wide") return model_shape::wide;
+  if(name == "giant_lik") return model_shape::giant_lik;
+  throw invalid_argument("Unknown model shape \"" + name + "\": use hierarchy, deep, wide or giant_lik.");
+}
+
+string model_shape_name(model_shape shape) {
+  switch(shape) {
+    case model_shape::hierarchy: return "hierarchy";
+    case model_shape::deep: return "deep";
+    case model_shape::wide: return "wide";
+    case model_shape::giant_lik: return "giant_lik";
+  }
+  return "";
+}
+
+static int add_param(synthetic_model& model, string name, vector<int> parents) {
+  model.params.push_back(std::move(name));
+  model.parents.push_back(std::move(parents));
+  return model.params.size() - 1;
+}
+
+// Adds parameters level by level, each level a vector a<level>, until
+// there are num_params. children_of gives the number of children of a
+// parameter on the level before.
+template<class ChildCount>
+static void add_levels(synthetic_model& model, int num_params, ChildCount&& children_of) {
+  int level_start = 0;
+  int level = 0;
+  while((int) model.params.size() < num_params) {
+    int level_end = model.params.size();
+    ++level;
+    int level_index = 0;
+    for(int parent = level_start; parent < level_end && (int) model.params.size() < num_params; ++parent) {
+      int num_children = children_of(level, parent);
+      for(int ci = 0; ci < num_children && (int) model.params.size() < num_params; ++ci) {
+        string name = "a";
+        name += to_string(level);
+        name += '[';
+        name += to_string(++level_index);
+        name += ']';
+        add_param(model, name, { parent });
+      }
+    }
+    level_start = level_end;
+  }
+}
+
+synthetic_model make_model(model_shape shape, int num_params, int branching) {
+  synthetic_model model;
+  model.root = "mu";
+  add_param(model, model.root, {});
+  num_params = max(num_params, 2);
+  branching = max(branching, 1);
+
+  switch(shape) {
+    case model_shape::hierarchy:
+    case model_shape::giant_lik:
+      add_levels(model, num_params, [&](int, int) { return branching; });
+      break;
+    case model_shape::deep:
+      add_levels(model, num_params, [&](int level, int) { return level == 1 ? branching : 1; });
+      break;
+    case model_shape::wide: {
+      int tau = add_param(model, "tau", { 0 });
+      for(int ti = 1; (int) model.params.size() < num_params; ++ti) {
+        add_param(model, "theta[" + to_string(ti) + "]", { 0, tau });
+      }
+      break;
+    }
+  }
+
+  vector<bool> has_children(model.params.size(), false);
+  for(const auto& parents: model.parents) {
+    for(int parent: parents) {
+      has_children[parent] = true;
+    }
+  }
+
+  model.factors.push_back({ model.root + "_prior", { 0 } });
+  for(size_t pi = 1; pi < model.params.size(); ++pi) {
+    vector<int> factor_params = { (int) pi };
+    factor_params.insert(factor_params.end(), model.parents[pi].begin(), model.parents[pi].end());
+    model.factors.push_back({ model.params[pi] + "_prior", factor_params });
+  }
+  vector<int> childless;
+  for(size_t pi = 0; pi < model.params.size(); ++pi) {
+    if(!has_children[pi]) {
+      childless.push_back(pi);
+    }
+  }
+  if(shape == model_shape::giant_lik) {
+    model.factors.push_back({ "y_lik", childless });
+  } else {
+    for(size_t ci = 0; ci < childless.size(); ++ci) {
+      string name = "y";
+      name += to_string(ci + 1);
+      name += "_lik";
+      model.factors.push_back({ name, { childless[ci] } });
+    }
+  }
+
+  map<int, set<string>> leaves_by_parent;
+  for(int pi: childless) {
+    if(!model.parents[pi].empty()) {
+      leaves_by_parent[model.parents[pi].front()].insert(model.params[pi]);
+    }
+  }
+  for(auto& [parent, leaf_set]: leaves_by_parent) {
+    model.leaves.push_back(std::move(leaf_set));
+  }
+  return model;
+}
+
+string factor_graph_text(const synthetic_model& model) {
+  ostringstream fg_text;
+  for(const auto& [factor_name, factor_params]: model.factors) {
+    fg_text << factor_name << "\n";
+    for(int pi: factor_params) {
+      fg_text << model.params[pi] << "\n";
+    }
+    fg_text << "-\n";
+  }
+  return fg_text.str();
+}
+
+string tree_data_text(const synthetic_model& model) {
+  ostringstream tree_text;
+  tree_text << model.root;
+  for(const auto& leaf_set: model.leaves) {
+    tree_text << "\n";
+    for(auto leaf = leaf_set.begin(); leaf != leaf_set.end(); ++leaf) {
+      tree_text << (leaf == leaf_set.begin() ? "" : ", ") << *leaf;
+    }
+  }
+  return tree_text.str();
+}
+
+MatrixXd make_draws(const synthetic_model& model, long num_draws, mt19937_64& rng) {
+  normal_distribution<double> noise(0.0, 1.0);
+  MatrixXd draws(num_draws, model.params.size());
+  for(size_t pi = 0; pi < model.params.size(); ++pi) {
+    const auto& parents = model.parents[pi];
+    for(long di = 0; di < num_draws; ++di) {
+      double parent_mean = 0;
+      for(int parent: parents) {
+        parent_mean += draws(di, parent) / parents.size();
+      }
+      draws(di, pi) = (parents.empty() ? 0.0 : 0.7 * parent_mean) + (parents.empty() ? 1.0 : 0.5) * noise(rng);
+    }
+  }
+  return draws;
+}
+
+void write_chains(const synthetic_model& model, const MatrixXd& draws, const string& prefix, int num_chains) {
+  long chain_draws = draws.rows() / num_chains;
+  for(int ci = 0; ci < num_chains; ++ci) {
+    string path = prefix + to_string(ci + 1) + ".csv";
+    ofstream chain(path);
+    if(!chain) {
+      throw runtime_error("Could not write " + path + ".");
+    }
+    chain << "# Synthetic draws\n";
+    chain << "lp__,accept_stat__";
+    for(string name: model.params) {
+      replace(name.begin(), name.end(), '[', '.');
+      name.erase(remove(name.begin(), name.end(), ']'), name.end());
+      chain << "," << name;
+    }
+    chain << "\n" << setprecision(6);
+    for(long di = ci * chain_draws; di < (ci + 1) * chain_draws; ++di) {
+      chain << "0,1";
+      for(Eigen::Index pi = 0; pi < draws.cols(); ++pi) {
+        chain << "," << draws(di, pi);
+      }
+      chain << "\n";
+    }
+  }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include <Eigen/Dense>
+
+#include <read_tree_data.hpp>
+
+// Synthetic models and posteriors with the shapes that stress the backend,
+// for benchmarks and scaling tests that cannot use real data.
+//
+//   hierarchy  every parameter has up to branching children under "mu"
+//   deep       branching chains under "mu", each as long as the size allows
+//   wide       one vector theta under "mu" and "tau"
+//   giant_lik  a hierarchy whose childless parameters share one likelihood
+//
+// Parameters other than mu and tau are Stan vectors, a<level>[i] or
+// theta[i]. Except in giant_lik, every childless parameter has its own
+// likelihood factor.
+enum class model_shape { hierarchy, deep, wide, giant_lik };
+
+// Throws std::invalid_argument for unknown names.
+model_shape parse_model_shape(const std::string& name);
+std::string model_shape_name(model_shape shape);
+
+struct synthetic_model {
+  std::vector<std::string> params;  // Parents before children, root first
+  std::vector<std::vector<int>> parents;  // Indices into params
+  std::vector<std::pair<std::string, std::vector<int>>> factors;
+  std::string root;
+  leaves_t leaves;  // Childless parameters, grouped by their first parent
+};
+
+synthetic_model make_model(model_shape shape, int num_params, int branching);
+
+// The factor graph in the format read_fg consumes, and the root and leaves
+// in the format read_tree_data consumes. Together, separated by "--", they
+// are the text output of the model parser.
+std::string factor_graph_text(const synthetic_model& model);
+std::string tree_data_text(const synthetic_model& model);
+
+// Draws in which every parameter is the mean of its parents' values,
+// shrunk, plus noise, so that fits find the dependence the model describes.
+Eigen::MatrixXd make_draws(const synthetic_model& model, long num_draws, std::mt19937_64& rng);
+
+// Writes the draws as Stan CSV chains <prefix>1.csv, ..., with Stan's
+// column names ("a1.2" for a1[2]) and sampler columns before them.
+void write_chains(const synthetic_model& model, const Eigen::MatrixXd& draws, const std::string& prefix, int num_chains);
@@ -0,0 +1,396 @@
+// Times the backend's hot paths on synthetic inputs and writes the results
+// as JSON, so that runs on different commits can be compared:
+//
+//   vd_bench --sizes 1000,10000 --label $(git rev-parse --short HEAD) --out new.json
+//   vd_bench --compare old.json new.json
+//
+// Every input is generated from a seeded synthetic model of the chosen
+// shape (see synthetic.hpp), so results depend only on the sizes and
+// options given. Benchmarks that fit random
+// forests need the ranger executable next to vd_bench, and only run up to
+// --max_fit_size.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/dll/runtime_symbol_info.hpp>
+#include <boost/program_options.hpp>
+#include <boost/uuid/uuid_generators.hpp>
+#include <boost/uuid/uuid_io.hpp>
+#include <nlohmann/json.hpp>
+
+#include <compression.hpp>
+#include <lik_complexity.hpp>
+#include <logging.hpp>
+#include <markov.hpp>
+#include <read_lik.hpp>
+#include <read_mrf.hpp>
+#include <read_stan.hpp>
+#include <regression_rf.hpp>
+#include <save_state.hpp>
+#include <serialize_tree.hpp>
+
+#include "synthetic.hpp"
+
+namespace options = boost::program_options;
+using namespace std;
+using json = nlohmann::json;
+using Eigen::MatrixXd;
+
+// A tree of num_nodes nodes, shaped like the ones the frontend edits: each
+// node hangs off one of the few nodes added before it, and holds a handful
+// of the model's parameters.
+static pair<unique_ptr<MTree>, Node> make_synthetic_tree(const synthetic_model& model, int num_nodes, mt19937_64& rng) {
+  uniform_real_distribution<double> ered(0.0, 1.0);
+  uniform_int_distribution<size_t> param(0, model.params.size() - 1);
+  auto tree = make_unique<MTree>(0);
+  vector<Node> nodes;
+  nodes.push_back(add_vertex({ .parameters = { model.root }, .ered = 0, .depth = 0, .chain_nums = { 0 }, .name = 0 }, *tree));
+  for(int ni = 1; ni < num_nodes; ++ni) {
+    uniform_int_distribution<int> recent(max(0, ni - 8), ni - 1);
+    Node parent = nodes[recent(rng)];
+    vertex_names parameters;
+    for(int pi = 0; pi < 3; ++pi) {
+      parameters.insert(model.params[param(rng)]);
+    }
+    nodes.push_back(add_vertex({
+      .parameters = parameters,
+      .ered = ered(rng),
+      .depth = (*tree)[parent].depth + 1,
+      .chain_nums = { ni % 16 },
+      .name = ni
+    }, *tree));
+    add_edge(parent, nodes.back(), *tree);
+  }
+  return { std::move(tree), nodes.front() };
+}
+
+// Runs body repeats times and summarizes the wall-clock times.
+static json time_runs(int repeats, const function<void()>& body) {
+  vector<double> seconds;
+  for(int ri = 0; ri < repeats; ++ri) {
+    auto start = chrono::steady_clock::now();
+    body();
+    seconds.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+  }
+  sort(seconds.begin(), seconds.end());
+  return {
+    {"repeats", repeats},
+    {"min_s", seconds.front()},
+    {"median_s", seconds[seconds.size() / 2]},
+    {"mean_s", accumulate(seconds.begin(), seconds.end(), 0.0) / seconds.size()},
+    {"max_s", seconds.back()}
+  };
+}
+
+static vector<int> parse_sizes(const string& spec) {
+  vector<int> sizes;
+  stringstream spec_stream(spec);
+  string size;
+  while(getline(spec_stream, size, ',')) {
+    sizes.push_back(stoi(size));
+  }
+  return sizes;
+}
+
+static json read_results(const string& path) {
+  ifstream file(path);
+  if(!file) {
+    throw runtime_error("Could not open " + path + ".");
+  }
+  return json::parse(file);
+}
+
+// Prints the median time of every benchmark in both runs and their ratio.
+static void compare_results(const string& old_path, const string& new_path) {
+  json old_run = read_results(old_path);
+  json new_run = read_results(new_path);
+  map<pair<string, int>, double> old_medians;
+  for(const auto& result: old_run["results"]) {
+    if(result.contains("median_s")) {
+      old_medians[{ result["benchmark"], result["size"] }] = result["median_s"];
+    }
+  }
+
+  cout << setprecision(4) << left << setw(20) << "benchmark" << right << setw(10) << "size"
+       << setw(14) << "old (s)" << setw(14) << "new (s)" << setw(10) << "new/old" << "\n";
+  for(const auto& result: new_run["results"]) {
+    if(!result.contains("median_s")) {
+      continue;
+    }
+    auto old_median = old_medians.find({ result["benchmark"], result["size"] });
+    if(old_median == old_medians.end()) {
+      continue;
+    }
+    double new_median = result["median_s"];
+    cout << left << setw(20) << result["benchmark"].get<string>() << right << setw(10) << result["size"].get<int>()
+         << setw(14) << old_median->second << setw(14) << new_median
+         << setw(10) << fixed << setprecision(2) << new_median / old_median->second << defaultfloat << setprecision(4) << "\n";
+  }
+}
+
+int main(int argc, char* argv[]) {
+  options::options_description ops_desc("vd_bench options");
+  ops_desc.add_options()
+    ("help", "print this help message")
+    ("sizes", options::value<string>()->default_value("1000,10000,100000"), "comma-separated numbers of model parameters and tree nodes to run each benchmark at")
+    ("draws", options::value<long>()->default_value(4000), "number of posterior draws, split across the chains")
+    ("chains", options::value<int>()->default_value(4), "number of Stan CSV chains to write and read")
+    ("shape", options::value<string>()->default_value("hierarchy"), "shape of the synthetic model: hierarchy, deep, wide or giant_lik")
+    ("branching", options::value<int>()->default_value(10), "number of children of each parameter in the synthetic model")
+    ("repeat", options::value<int>()->default_value(5), "number of timed runs of each benchmark")
+    ("max_fit_size", options::value<int>()->default_value(1000), "largest size at which to run benchmarks that fit random forests (rf_oob_mse, make_tree)")
+    ("only", options::value<string>(), "comma-separated benchmarks to run (default: all)")
+    ("seed", options::value<unsigned long>()->default_value(1), "seed for the synthetic inputs")
+    ("label", options::value<string>()->default_value(""), "label stored with the results, e.g. a commit hash")
+    ("out", options::value<string>(), "write results to this file instead of stdout")
+    ("compare", options::value<vector<string>>()->multitoken(), "compare two result files, OLD NEW, instead of running")
+    ("log", options::value<string>()->default_value("warn"), "log levels, as for the backend");
+
+  options::variables_map user_input;
+  try {
+    options::store(options::parse_command_line(argc, argv, ops_desc), user_input);
+    options::notify(user_input);
+    vdlog::configure(user_input["log"].as<string>());
+  } catch (const exception& err) {
+    cerr << err.what() << endl << "Run with --help for details." << endl;
+    return 1;
+  }
+  if(user_input.count("help")) {
+    cout << ops_desc << endl;
+    return 0;
+  }
+  if(user_input.count("compare")) {
+    auto paths = user_input["compare"].as<vector<string>>();
+    if(paths.size() != 2) {
+      cerr << "--compare takes two result files." << endl;
+      return 1;
+    }
+    compare_results(paths[0], paths[1]);
+    return 0;
+  }
+
+  const vector<int> sizes = parse_sizes(user_input["sizes"].as<string>());
+  const long num_draws = user_input["draws"].as<long>();
+  const int num_chains = user_input["chains"].as<int>();
+  const int branching = user_input["branching"].as<int>();
+  model_shape shape;
+  try {
+    shape = parse_model_shape(user_input["shape"].as<string>());
+  } catch (const invalid_argument& err) {
+    cerr << err.what() << endl;
+    return 1;
+  }
+  const int repeats = user_input["repeat"].as<int>();
+  const int max_fit_size = user_input["max_fit_size"].as<int>();
+  const unsigned long seed = user_input["seed"].as<unsigned long>();
+  set<string> only;
+  if(user_input.count("only")) {
+    stringstream only_stream(user_input["only"].as<string>());
+    string name;
+    while(getline(only_stream, name, ',')) {
+      only.insert(name);
+    }
+  }
+
+  // rf_oob_mse runs the ranger executable found next to this one.
+  auto ranger_path = boost::dll::program_location().parent_path() / "ranger";
+#ifdef _WIN32
+  ranger_path += ".exe";
+#endif
+  const bool have_ranger = boost::filesystem::exists(ranger_path);
+
+  auto scratch_dir = filesystem::temp_directory_path() / ("vd_bench_" + boost::uuids::to_string(boost::uuids::random_generator()()));
+  filesystem::create_directories(scratch_dir);
+
+  json results = json::array();
+  auto run = [&](const string& name, int size, const function<json()> bench) {
+    if(!only.empty() && only.count(name) == 0) {
+      return;
+    }
+    cerr << name << " @ " << size << "..." << endl;
+    json result = { {"benchmark", name}, {"size", size} };
+    try {
+      result.update(bench());
+    } catch (const exception& err) {
+      result["error"] = err.what();
+    }
+    results.push_back(result);
+  };
+
+  for(int size: sizes) {
+    mt19937_64 rng(seed);
+    synthetic_model model = make_model(shape, size, branching);
+    FG fg;
+    FG_Map fg_params, fg_facs;
+    std::tie(fg, fg_params, fg_facs) = read_fg(factor_graph_text(model));
+    MRF mrf;
+    VertexMap param_vertices;
+    std::tie(mrf, param_vertices) = mrf_from_fg(fg, fg_params, fg_facs);
+    complexity_index complexity = index_complexity(fg, fg_params, fg_facs);
+    auto LC = get_complexity(complexity);
+
+    MatrixXd draws = make_draws(model, num_draws, rng);
+    dense_sample_matrix samples(draws.data(), draws.rows(), draws.cols());
+    stan_var_map sample_vars;
+    for(size_t pi = 0; pi < model.params.size(); ++pi) {
+      sample_vars.emplace(model.params[pi], pi);
+    }
+    const vertex_names& leaf = model.leaves.front();
+    string chain_prefix = (scratch_dir / ("chain_" + to_string(size) + "_")).string();
+    write_chains(model, draws, chain_prefix, num_chains);
+
+    run("read_stan_file", size, [&]() {
+      json timing = time_runs(repeats, [&]() { read_stan_file(chain_prefix, num_chains); });
+      timing["draws"] = num_draws;
+      return timing;
+    });
+
+    run("read_stan_file_f32", size, [&]() {
+      return time_runs(repeats, [&]() { read_stan_file(chain_prefix, num_chains, nullopt, sample_precision::f32); });
+    });
+
+    run("mrf_from_fg", size, [&]() {
+      json timing = time_runs(repeats, [&]() { mrf_from_fg(fg, fg_params, fg_facs); });
+      timing["mrf_edges"] = num_edges(mrf);
+      return timing;
+    });
+
+    run("minimal_separator", size, [&]() {
+      return time_runs(repeats, [&]() { minimal_separator(mrf, { model.root }, leaf, param_vertices, LC); });
+    });
+
+    run("make_chain", size, [&]() {
+      size_t links = 0;
+      json timing = time_runs(repeats, [&]() {
+        links = markov::make_chain(mrf, { model.root }, leaf, {}, param_vertices, LC, 1.01).size();
+      });
+      timing["links"] = links;
+      return timing;
+    });
+
+    auto fit_skip_reason = [&]() -> json {
+      if(!have_ranger) {
+        return { {"skipped", "ranger not found at " + ranger_path.string()} };
+      }
+      if(size > max_fit_size) {
+        return { {"skipped", "size exceeds --max_fit_size"} };
+      }
+      return json::object();
+    };
+
+    run("rf_oob_mse", size, [&]() {
+      json skip = fit_skip_reason();
+      if(!skip.empty()) {
+        return skip;
+      }
+      json timing = time_runs(repeats, [&]() { rf_oob_mse(leaf, model.root, samples, sample_vars); });
+      timing["predictors"] = leaf.size();
+      return timing;
+    });
+
+    // Fits to a zero sample fingerprint are never cached, so every run
+    // refits every node.
+    run("make_tree", size, [&]() {
+      json skip = fit_skip_reason();
+      if(!skip.empty()) {
+        return skip;
+      }
+      size_t num_nodes = 0;
+      json timing = time_runs(repeats, [&]() {
+        auto [tree, root] = markov::make_tree(mrf, model.root, model.leaves, {}, param_vertices, samples, sample_vars, LC, 1.01);
+        num_nodes = num_vertices(*tree);
+      });
+      timing["nodes"] = num_nodes;
+      return timing;
+    });
+
+    // The remaining benchmarks take a tree with size nodes.
+    unique_ptr<MTree> tree;
+    Node root;
+    std::tie(tree, root) = make_synthetic_tree(model, size, rng);
+    string tree_json;
+
+    run("serialize_tree", size, [&]() {
+      json timing = time_runs(repeats, [&]() { tree_json = serialize_tree(root, *tree, {}, 0.5, nullopt); });
+      timing["bytes"] = tree_json.size();
+      return timing;
+    });
+
+    // The cost and benefit of --compress_threshold for a tree update of
+    // this size: the time to compress on the backend and to inflate on the
+    // receiving side, and the bytes saved.
+    run("ws_compress", size, [&]() {
+      if(tree_json.empty()) {
+        tree_json = serialize_tree(root, *tree, {}, 0.5, nullopt);
+      }
+      string compressed;
+      json timing = time_runs(repeats, [&]() { compressed = zlib_compress(tree_json); });
+      json inflate = time_runs(repeats, [&]() { zlib_decompress(compressed, tree_json.size()); });
+      timing["bytes"] = tree_json.size();
+      timing["compressed_bytes"] = compressed.size();
+      timing["ratio"] = static_cast<double>(compressed.size()) / tree_json.size();
+      timing["decompress_median_s"] = inflate["median_s"];
+      return timing;
+    });
+
+    derived_state derived{
+      .mrf = mrf,
+      .param_vertices = param_vertices,
+      .complexity = complexity,
+      .root_name = model.root,
+      .leaves = model.leaves,
+      .global_adj_r = 0.5,
+      .sample_fingerprint = 0
+    };
+    string archive_path = (scratch_dir / ("state_" + to_string(size) + ".vds")).string();
+
+    run("save_state", size, [&]() {
+      json timing = time_runs(repeats, [&]() {
+        save_state(*tree, root, fg, fg_params, fg_facs, derived, "bench", archive_path);
+      });
+      timing["bytes"] = filesystem::file_size(archive_path);
+      return timing;
+    });
+
+    run("load_state", size, [&]() {
+      if(!filesystem::exists(archive_path)) {
+        save_state(*tree, root, fg, fg_params, fg_facs, derived, "bench", archive_path);
+      }
+      return time_runs(repeats, [&]() { load_state(archive_path); });
+    });
+  }
+
+  filesystem::remove_all(scratch_dir);
+
+  json report = {
+    {"vd_bench", 1},
+    {"label", user_input["label"].as<string>()},
+    {"threads", thread::hardware_concurrency()},
+    {"draws", num_draws},
+    {"chains", num_chains},
+    {"shape", model_shape_name(shape)},
+    {"branching", branching},
+    {"seed", seed},
+    {"results", results}
+  };
+  if(user_input.count("out")) {
+    ofstream(user_input["out"].as<string>()) << report.dump(2) << endl;
+  } else {
+    cout << report.dump(2) << endl;
+  }
+  vdlog::flush();
+  return 0;
+}
@@ -0,0 +1,79 @@
+// Writes a synthetic model and posterior, for scaling tests on model shapes
+// that would otherwise need customer data:
+//
+//   vd_synth --shape deep --params 10000 --out /tmp/deep
+//
+// writes /tmp/deep.fg (the factor graph, as read_fg consumes it),
+// /tmp/deep.tree (root and leaves, as read_tree_data consumes them) and
+// the chains /tmp/deep_1.csv, ..., for -S /tmp/deep_ -N <chains>.
+
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include <boost/program_options.hpp>
+
+#include "synthetic.hpp"
+
+namespace options = boost::program_options;
+using namespace std;
+
+static void write_file(const string& path, const string& contents) {
+  ofstream file(path, ios::binary);
+  if(!file) {
+    throw runtime_error("Could not write " + path + ".");
+  }
+  file << contents;
+}
+
+int main(int argc, char* argv[]) {
+  options::options_description ops_desc("vd_synth options");
+  ops_desc.add_options()
+    ("help", "print this help message")
+    ("out", options::value<string>()->required(), "prefix of the files to write")
+    ("shape", options::value<string>()->default_value("hierarchy"), "shape of the model: hierarchy, deep, wide or giant_lik")
+    ("params", options::value<int>()->default_value(1000), "number of model parameters, i.e. the width of the chains")
+    ("branching", options::value<int>()->default_value(10), "number of children of each parameter (hierarchy, giant_lik) or number of chains of parameters (deep)")
+    ("draws", options::value<long>()->default_value(4000), "number of posterior draws, split across the chains")
+    ("chains", options::value<int>()->default_value(4), "number of Stan CSV chains")
+    ("seed", options::value<unsigned long>()->default_value(1), "seed for the draws");
+
+  options::variables_map user_input;
+  model_shape shape;
+  try {
+    options::store(options::parse_command_line(argc, argv, ops_desc), user_input);
+    if(user_input.count("help")) {
+      cout << ops_desc << endl;
+      return 0;
+    }
+    options::notify(user_input);
+    shape = parse_model_shape(user_input["shape"].as<string>());
+  } catch (const exception& err) {
+    cerr << err.what() << endl << "Run with --help for details." << endl;
+    return 1;
+  }
+
+  const string prefix = user_input["out"].as<string>();
+  const int num_chains = user_input["chains"].as<int>();
+  mt19937_64 rng(user_input["seed"].as<unsigned long>());
+
+  synthetic_model model = make_model(shape, user_input["params"].as<int>(), user_input["branching"].as<int>());
+  string fg_text = factor_graph_text(model);
+  string tree_text = tree_data_text(model);
+  Eigen::MatrixXd draws = make_draws(model, user_input["draws"].as<long>(), rng);
+
+  try {
+    write_file(prefix + ".fg", fg_text);
+    write_file(prefix + ".tree", tree_text + "\n");
+    write_chains(model, draws, prefix + "_", num_chains);
+  } catch (const exception& err) {
+    cerr << err.what() << endl;
+    return 1;
+  }
+
+  cout << "Wrote a " << model_shape_name(shape) << " model with " << model.params.size() << " parameters, "
+       << model.factors.size() << " factors and " << model.leaves.size() << " leaf sets, and "
+       << num_chains << " chains of " << draws.rows() / num_chains << " draws." << endl;
+  return 0;
+}
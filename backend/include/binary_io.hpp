@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Helpers for the backend's own binary files (sample cache, archives).
+// Values are written in native byte order: these files are not meant to
+// move between machines of different endianness.
+
+// Appends values to an in-memory buffer.
+class binary_writer {
+public:
+  template<class T> void write(const T& value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    _data.append(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  void write_string(std::string_view str) {
+    write<std::uint32_t>(str.size());
+    _data.append(str);
+  }
+
+  const std::string& data() const { return _data; }
+  std::string& data() { return _data; }
+
+private:
+  std::string _data;
+};
+
+// Bounds-checked reads from a buffer. Reading past the end throws, naming
+// the file being read.
+class binary_reader {
+public:
+  binary_reader(const char* data, std::size_t size, std::string what)
+    : _data(data), _size(size), _what(std::move(what)) {}
+
+  template<class T> T read() {
+    static_assert(std::is_trivially_copyable_v<T>);
+    T value;
+    std::memcpy(&value, take(sizeof(T)), sizeof(T));
+    return value;
+  }
+
+  std::string read_string() {
+    std::uint32_t len = read<std::uint32_t>();
+    return std::string(take(len), len);
+  }
+
+  std::vector<std::string> read_strings() {
+    std::uint64_t count = read<std::uint64_t>();
+    std::vector<std::string> strings;
+    strings.reserve(count);
+    for(std::uint64_t si = 0; si < count; ++si) {
+      strings.push_back(read_string());
+    }
+    return strings;
+  }
+
+  const char* take(std::size_t len) {
+    if(len > _size - _pos) {
+      throw std::runtime_error(_what + " is truncated.");
+    }
+    const char* at = _data + _pos;
+    _pos += len;
+    return at;
+  }
+
+  std::size_t pos() const { return _pos; }
+  bool at_end() const { return _pos == _size; }
+
+private:
+  const char* _data;
+  std::size_t _size;
+  std::size_t _pos = 0;
+  std::string _what;
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include <read_stan.hpp>
+
+// A bootstrap replicate of a sample matrix: row i is row rows[i] of the
+// base matrix. The base must outlive the replicate. Its fingerprint is
+// zero, so that replicate fits are neither cached, where they would evict
+// the eReds of the tree, nor journaled.
+class resampled_sample_matrix final : public sample_matrix {
+public:
+  resampled_sample_matrix(const sample_matrix& base, std::vector<Eigen::Index> rows);
+
+  Eigen::Index rows() const override { return _rows.size(); }
+  Eigen::Index cols() const override { return _base.cols(); }
+  sample_precision precision() const override { return _base.precision(); }
+  Eigen::MatrixXd columns(const std::vector<int>& cols) const override;
+
+private:
+  const sample_matrix& _base;
+  std::vector<Eigen::Index> _rows;
+};
+
+// Draws the rows of one bootstrap replicate. rf_oob_mse trains on the first
+// half of the draws and tests on the second, so each half is resampled
+// from itself and no draw can land on both sides of the split.
+std::vector<Eigen::Index> bootstrap_rows(Eigen::Index num_rows, std::uint64_t seed);
+
+// Fits every parameter set to num_replicates bootstrap replicates of the
+// samples, all in parallel, and returns the central interval holding the
+// given fraction of each set's replicate eReds. Every set sees the same
+// replicates, so intervals of different sets are paired. Replicate r is
+// drawn with seed + r, so results are reproducible.
+std::vector<std::pair<double, double>> bootstrap_ereds(
+  const std::vector<std::set<std::string>>& parameter_sets, const std::string& response_name,
+  const sample_matrix& stan_matrix, const stan_var_map& stan_vars,
+  int num_replicates, double level, std::uint64_t seed);
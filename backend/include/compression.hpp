@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+// Compresses data into a zlib (RFC 1950) stream, the format decoded by
+// DecompressionStream("deflate") in Deno and the browser.
+std::string zlib_compress(const std::string& data, int level = 6);
+
+// Inverts zlib_compress, given the size of the original data.
+std::string zlib_decompress(std::string_view compressed, std::size_t original_size);
+
+// CRC-32 of data, as computed by zlib. Given the checksum of what came
+// before data, continues it, so that data can be checksummed in pieces.
+std::uint32_t crc32_checksum(std::string_view data, std::uint32_t preceding = 0);
+
+// Decompresses a gzip file in chunks of at most chunk_size bytes, passing
+// each to on_chunk. The uncompressed contents are never held at once.
+void read_gzip_chunks(const std::string& path, const std::function<void(std::string_view)>& on_chunk,
+                      std::size_t chunk_size = std::size_t(1) << 20);
@@ -1,9 +1,19 @@
 #pragma once
 
 #include <functional>
+#include <map>
 #include <set>
 #include <string>
 #include <factor_graph.hpp>
 
+// The likelihood factors closest to each parameter. The complexity of any
+// set of parameters follows from it without searching the factor graph.
+struct complexity_index {
+  std::map<std::string, std::set<std::string>> closest_facs;
+  int num_lik = 0;
+};
+
+complexity_index index_complexity(const FG& factor_graph, const FG_Map& fg_params, const FG_Map& fg_facs);
+std::function<float(std::set<std::string>)> get_complexity(complexity_index index);
 std::function<float(std::set<std::string>)> get_complexity(FG factor_graph, FG_Map fg_params, FG_Map fg_facs);
-std::set<std::string> closest_factors(FG_Vertex param_vertex, FG factor_graph);
\ No newline at end of file
+std::set<std::string> closest_factors(FG_Vertex param_vertex, const FG& factor_graph);
\ No newline at end of file
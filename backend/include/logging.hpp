@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <sstream>
+#include <string>
+
+// Leveled, categorized logging. Messages are formatted only when their level
+// is enabled for their category, and are written to stdout/stderr by a
+// background thread so callers never wait on a flush.
+//
+//   VD_LOG(debug, rf) << "SSR: " << ssr;
+
+namespace vdlog {
+
+  enum class level { trace, debug, info, warn, error, off };
+
+  enum class category { startup, ws, tree, chain, rf, samples, parser, io, num_categories };
+
+  extern std::atomic<int> thresholds[static_cast<int>(category::num_categories)];
+
+  inline bool enabled(level lvl, category cat) {
+    return static_cast<int>(lvl) >= thresholds[static_cast<int>(cat)].load(std::memory_order_relaxed);
+  }
+
+  // Sets levels from a spec such as "info" or "warn,rf=debug,ws=trace": a
+  // bare level applies to every category, and category=level overrides it.
+  // Throws std::invalid_argument on unknown names.
+  void configure(const std::string& spec);
+
+  // Queues a finished message for the sink thread.
+  void write(level lvl, category cat, std::string message);
+
+  // Blocks until every queued message has been written.
+  void flush();
+
+  class line {
+  public:
+    line(level lvl, category cat): _level(lvl), _category(cat) {}
+    ~line() { write(_level, _category, _stream.str()); }
+    std::ostringstream& stream() { return _stream; }
+
+  private:
+    level _level;
+    category _category;
+    std::ostringstream _stream;
+  };
+
+}
+
+#define VD_LOG(lvl, cat) \
+  if(!vdlog::enabled(vdlog::level::lvl, vdlog::category::cat)) {} \
+  else vdlog::line(vdlog::level::lvl, vdlog::category::cat).stream()
@@ -10,6 +10,13 @@
 #include <read_stan.hpp>
 #include <Eigen/Dense>
 
+// Finds a minimal set of parameters separating u from v in the MRF, as
+// close to u or to v as gives the lower likelihood complexity. The flag is
+// set if the separator found is the one closer to v.
+std::pair<vertex_names, bool> minimal_separator(
+  MRF mrf, vertex_names u, vertex_names v, const std::map<std::string, Vertex>& param_vertices,
+  std::function<float(std::set<std::string>)> LC);
+
 namespace markov {
 
   typedef std::list<vertex_names> markov_chain;
@@ -26,45 +33,52 @@ namespace markov {
   std::pair<std::unique_ptr<MTree>, Node> make_tree(
     MRF mrf, const std::string& root, const std::vector<vertex_names> leaves,
     const vertex_names& globals, VertexMap& param_vertices,
-    const Eigen::MatrixXd& stan_matrix, const std::map<std::string, int>& stan_vars,
+    const sample_matrix& stan_matrix, const stan_var_map& stan_vars,
     std::function<float(std::set<std::string>)> LC, double y_cut);
 
 
+  // Operations that add nodes take a defer_ered flag. When it is set, new
+  // nodes are added with an empty ered, to be computed later in a single
+  // parallel pass by fill_missing_ereds.
+
   void divide_branch(
     MTree& tree, const Node& root,
     int node_name, vertex_names params_kept, 
-    const Eigen::MatrixXd& stan_matrix, const std::map<std::string, int>& stan_vars);
+    const sample_matrix& stan_matrix, const stan_var_map& stan_vars,
+    bool defer_ered = false);
 
   void auto_divide(
     MTree& tree, const Node& root, 
     int node_name,
-    const Eigen::MatrixXd& stan_matrix, const std::map<std::string, int>& stan_vars);
+    const sample_matrix& stan_matrix, const stan_var_map& stan_vars);
 
   void extrude_branch(
     MTree& tree, const Node& root, 
     int node_name, vertex_names params_kept, 
-    const Eigen::MatrixXd& stan_matrix, const std::map<std::string, int>& stan_vars);
+    const sample_matrix& stan_matrix, const stan_var_map& stan_vars,
+    bool defer_ered = false);
 
   void merge_nodes(
     MRF mrf, const vertex_names& globals, VertexMap& param_vertices,
     MTree& tree, const Node& root, 
     int node_name, int alt_node_name,
-    const Eigen::MatrixXd& stan_matrix, const std::map<std::string, int>& stan_vars,
-    std::function<float(std::set<std::string>)> LC
+    const sample_matrix& stan_matrix, const stan_var_map& stan_vars,
+    std::function<float(std::set<std::string>)> LC, bool defer_ered = false
   );
 
   void auto_merge(
     MRF mrf, const vertex_names& globals, VertexMap& param_vertices,
     MTree& tree, const Node& root, 
-    const Eigen::MatrixXd& stan_matrix, const std::map<std::string, int>& stan_vars,
+    const sample_matrix& stan_matrix, const stan_var_map& stan_vars,
     int merge_depth, std::function<float(std::set<std::string>)> LC
   );
 
+  // Requires every node in the tree to have an ered.
   void auto_merge2(
     MRF mrf, const vertex_names& globals, VertexMap& param_vertices,
     MTree& tree, const Node& root, 
-    const Eigen::MatrixXd& stan_matrix, const std::map<std::string, int>& stan_vars,
-    int merge_depth, std::function<float(std::set<std::string>)> LC
+    const sample_matrix& stan_matrix, const stan_var_map& stan_vars,
+    int merge_depth, std::function<float(std::set<std::string>)> LC, bool defer_ered = false
   );
 
   void delete_node(
@@ -72,4 +86,11 @@ namespace markov {
     int node_name
   );
 
+  // Computes the ered of every node that does not have one, running the
+  // fits concurrently. Returns the number of fits performed.
+  int fill_missing_ereds(
+    MTree& tree, const Node& root,
+    const sample_matrix& stan_matrix, const stan_var_map& stan_vars
+  );
+
 }
\ No newline at end of file
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+#include <factor_graph.hpp>
+#include <parameter_graph.hpp>
+#include <read_stan.hpp>
+
+// Where the backend's memory goes: bytes held by each of its large
+// structures, and the process' resident and peak resident set size.
+//
+//   memory::report report;
+//   memory::add_samples(report, *stan_data);
+//   memory::add_mrf(report, mrf, param_vertices);
+//   report.log();
+//
+// Sizes are estimates from element counts and the sizes of the standard
+// containers' nodes. They include heap allocations of strings and sets
+// but not the allocator's own overhead or unused vector capacity.
+
+namespace memory {
+
+  // Bytes a string occupies, including its heap buffer if it outgrew the
+  // small-string buffer.
+  std::size_t string_bytes(const std::string& s);
+
+  // Bytes a set of names occupies, including its nodes and their strings.
+  std::size_t names_bytes(const vertex_names& names);
+
+  // Resident set size of the process, now and at its peak, or 0 where the
+  // platform does not say.
+  std::size_t resident_bytes();
+  std::size_t peak_resident_bytes();
+
+  // The part of the resident set not backed by files, which memory limits
+  // apply to: pages of the mapped sample cache and chain files can be
+  // dropped by the OS at any time. On Linux only; elsewhere this is the
+  // whole resident set.
+  std::size_t anonymous_resident_bytes();
+
+  // "1.5 GiB" and the like.
+  std::string format_bytes(std::size_t bytes);
+
+  // Parses a size such as "8G", "512M", "64k" or a number of bytes.
+  // Suffixes are binary. Throws std::invalid_argument if malformed.
+  std::size_t parse_bytes(const std::string& text);
+
+  class report {
+  public:
+    // Adds a structure, with counts of what it holds (rows, edges,
+    // nodes, ...) as details.
+    void add(std::string name, std::size_t bytes, nlohmann::json details = nlohmann::json::object());
+
+    std::size_t total() const;
+
+    // The structures, their total and the resident and peak resident set
+    // sizes at the time of the call.
+    nlohmann::json to_json() const;
+
+    // Logs a line per structure, largest first, and the totals, at info
+    // level in the startup category.
+    void log() const;
+
+  private:
+    struct entry {
+      std::string name;
+      std::size_t bytes;
+      nlohmann::json details;
+    };
+    std::vector<entry> _entries;
+  };
+
+  // The sample matrix and its column map. Mapped samples only count
+  // towards the resident set once their pages are read.
+  void add_samples(report& r, const standata& data);
+
+  // The MRF and its name map. Parameters sharing several factors are
+  // joined by an edge per factor; the duplicates are counted separately.
+  void add_mrf(report& r, const MRF& mrf, const VertexMap& param_vertices);
+
+  void add_fg(report& r, const FG& fg, const FG_Map& fg_params, const FG_Map& fg_facs);
+
+  // The tree's nodes, with their parameter sets counted separately.
+  void add_tree(report& r, const MTree& tree);
+
+  // The bytes make_tree is expected to allocate on top of what is already
+  // resident: its copies of the MRF (make_tree's, and make_chain's and
+  // minimal_separator's for each chain searched at once). Fits are not
+  // counted, since ranger runs them in processes of its own.
+  std::size_t make_tree_bytes(const MRF& mrf, const std::vector<vertex_names>& leaves);
+
+  // Throws std::runtime_error if the anonymous resident set size, plus
+  // the bytes the next stage is projected to need, exceeds limit.
+  void check_limit(std::size_t limit, const std::string& stage, std::size_t projected = 0);
+
+  // Polls the anonymous resident set size until destroyed, and calls
+  // on_exceeded once, from its own thread, if it passes limit. This catches what
+  // check_limit's projections miss, before the OS kills the process.
+  class limit_watch {
+  public:
+    limit_watch(std::size_t limit, std::function<void(std::size_t)> on_exceeded,
+                std::chrono::milliseconds interval = std::chrono::milliseconds(200));
+    ~limit_watch();
+    limit_watch(const limit_watch&) = delete;
+    limit_watch& operator=(const limit_watch&) = delete;
+
+  private:
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    bool _stopping = false;
+    std::thread _thread;
+  };
+
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+// Counters and histograms of where time goes in a session. Every value is
+// recorded against the operation the recording thread is working on,
+// usually the websocket method being handled, so that e.g. the fits a
+// merge_nodes caused can be told apart from those of a divide_branch.
+//
+//   static metrics::histogram fit_seconds("vd_ered_fit_seconds", "Time spent fitting eReds.");
+//   metrics::scoped_timer timer(fit_seconds);
+//
+// Metrics are defined once, as statics, and live for the whole process.
+
+namespace metrics {
+
+  // The operation the calling thread is working on, or "" if none.
+  const std::string& current_operation();
+
+  // Sets the calling thread's operation until destroyed. Tasks and
+  // parallel_for bodies run in the operation of the thread that started
+  // them.
+  class operation_scope {
+  public:
+    explicit operation_scope(std::string operation);
+    ~operation_scope();
+    operation_scope(const operation_scope&) = delete;
+    operation_scope& operator=(const operation_scope&) = delete;
+
+  private:
+    std::string _previous;
+  };
+
+  class metric {
+  public:
+    metric(std::string name, std::string help);
+    virtual ~metric() = default;
+
+    const std::string& name() const { return _name; }
+    const std::string& help() const { return _help; }
+
+    virtual nlohmann::json to_json() const = 0;
+    virtual void write_prometheus(std::string& out) const = 0;
+
+  protected:
+    std::string _name;
+    std::string _help;
+    mutable std::mutex _mutex;
+  };
+
+  class counter final : public metric {
+  public:
+    using metric::metric;
+    void add(double amount = 1);
+
+    nlohmann::json to_json() const override;
+    void write_prometheus(std::string& out) const override;
+
+  private:
+    std::map<std::string, double> _values;  // By operation
+  };
+
+  // Upper bounds, in seconds, of the buckets latency histograms use
+  // unless given others.
+  const std::vector<double>& latency_bounds();
+
+  class histogram final : public metric {
+  public:
+    histogram(std::string name, std::string help, std::vector<double> bounds = latency_bounds());
+    void observe(double value);
+
+    nlohmann::json to_json() const override;
+    void write_prometheus(std::string& out) const override;
+
+  private:
+    struct series {
+      std::vector<std::uint64_t> buckets;  // Not cumulative; the last is +Inf
+      std::uint64_t count = 0;
+      double sum = 0;
+    };
+
+    std::vector<double> _bounds;
+    std::map<std::string, series> _series;  // By operation
+  };
+
+  // Observes the seconds from construction to destruction.
+  class scoped_timer {
+  public:
+    explicit scoped_timer(histogram& target): _target(target), _start(std::chrono::steady_clock::now()) {}
+    ~scoped_timer() { _target.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count()); }
+    scoped_timer(const scoped_timer&) = delete;
+    scoped_timer& operator=(const scoped_timer&) = delete;
+
+  private:
+    histogram& _target;
+    std::chrono::steady_clock::time_point _start;
+  };
+
+  // Every metric, keyed by name. Histograms include estimated p50, p95 and
+  // p99 per operation.
+  nlohmann::json snapshot();
+
+  // Every metric in the Prometheus text exposition format, with the
+  // operation as the "method" label.
+  std::string prometheus_text();
+
+  // Replaces the file at path with prometheus_text() every interval, and
+  // once more when stopped, until stop_file_writer is called.
+  void start_file_writer(const std::string& path, std::chrono::seconds interval = std::chrono::seconds(10));
+  void stop_file_writer();
+
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// The hardware threads the calling thread may use: all of them, or inside
+// a parallel_for, its share of those the parallel_for was given.
+unsigned available_threads();
+
+// Calls body(i) for every i in [0, n) on up to max_threads threads (all
+// available threads if 0). If any call throws, the first exception is
+// rethrown once every thread has finished.
+void parallel_for(std::size_t n, const std::function<void(std::size_t)>& body, unsigned max_threads = 0);
+
+// Named tasks that run concurrently, each on its own thread as soon as the
+// tasks it depends on have finished. A task whose dependency failed is
+// skipped.
+class task_graph {
+public:
+  enum class task_state { waiting, running, done, failed, skipped };
+
+  struct task_status {
+    std::string name;
+    task_state state = task_state::waiting;
+    double seconds = 0;  // Time spent running, once done
+  };
+
+  // Dependencies are named, and must have been added first.
+  void add(std::string name, std::vector<std::string> dependencies, std::function<void()> task);
+
+  // Called with the status of every task whenever one changes state. Calls
+  // are serialized, so each sees a later status than the one before.
+  void on_change(std::function<void(const std::vector<task_status>&)> callback);
+
+  // Runs every task and waits for all of them. If any failed, the
+  // exception of the first one added is rethrown.
+  void run();
+
+private:
+  void set_state(std::size_t ti, task_state state, double seconds = 0);
+
+  struct task {
+    std::vector<std::size_t> dependencies;
+    std::function<void()> run;
+  };
+  std::vector<task> _tasks;
+  std::vector<task_status> _statuses;
+  std::mutex _mutex;
+  std::function<void(const std::vector<task_status>&)> _on_change;
+};
+
+const char* task_state_name(task_graph::task_state state);
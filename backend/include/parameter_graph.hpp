@@ -5,7 +5,9 @@
 #include <set>
 #include <string>
 #include <vector>
+#include <utility>
 #include <boost/graph/adjacency_list.hpp>
+#include <boost/serialization/version.hpp>
 
 typedef std::set<std::string> vertex_names;
 typedef std::vector<std::string> vertex_names_v;
@@ -25,12 +27,18 @@ struct MarkovNode {
   int depth;
   std::set<int> chain_nums;
   int name;
+  bool stale = false;  // ered was fit to samples since reloaded; not archived
+  std::optional<std::pair<double, double>> ered_interval = std::nullopt;  // Bootstrap interval, if computed
 
   template<class Archive>
   void serialize(Archive& ar, const unsigned int version) {
     ar & parameters & ered & depth & chain_nums & name;
+    if(version > 0) {
+      ar & ered_interval;
+    }
   }
 };
+BOOST_CLASS_VERSION(MarkovNode, 1)
 
 typedef boost::adjacency_list<boost::listS, boost::listS, boost::directedS, MarkovNode> MTree;
 typedef boost::graph_traits<MTree>::vertex_descriptor Node;
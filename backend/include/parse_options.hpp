@@ -1,8 +1,15 @@
 #pragma once
 
+#include <cstddef>
 #include <string>
 #include <optional>
 
+struct BatchConfig {
+  std::string out_prefix;                  // Writes <out_prefix>.json and <out_prefix>.vds
+  std::optional<std::string> ops_file;     // Methods to call once the tree is built
+  std::optional<std::string> replay_file;  // Session log of methods to call and time, instead of ops_file
+};
+
 struct Config {
   std::optional<std::string> model_file;   // Required unless archive_file is set
   std::optional<std::string> data_file;    // Required unless archive_file is set
@@ -10,6 +17,18 @@ struct Config {
   int num_chains;                          // Always required
   int ws_port;
   std::optional<std::string> archive_file; // If set, load state from archive
+  std::optional<std::size_t> compress_threshold; // If set, compress larger outgoing messages
+  std::string log_spec;                    // Log levels, e.g. "info" or "warn,rf=debug"
+  bool sample_cache;                       // Read and write <stan_file_prefix>.vdcache
+  bool parser_cache;                       // Reuse model parser output for unchanged inputs
+  bool single_precision;                   // Store draws as floats rather than doubles
+  bool out_of_core;                        // Keep draws on disk, reading columns as fits need them
+  std::optional<std::string> journal;      // If set, journal changes to <journal>.vdj and snapshot to <journal>.vds
+  std::optional<std::string> metrics_file; // If set, periodically write metrics there in the Prometheus text format
+  std::optional<std::string> trace_file;   // If set, record spans and write them there as a Chrome trace on exit
+  std::optional<std::size_t> memory_limit; // If set, fail startup rather than let the resident set grow past this many bytes
+  std::optional<std::string> record_file;  // If set, log every method message received there
+  std::optional<BatchConfig> batch;        // If set, build the tree without a client, write it and exit
 };
 
 struct ParseResult {
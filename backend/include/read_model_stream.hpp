@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <factor_graph.hpp>
+#include <read_tree_data.hpp>
+
+// The factor graph and tree specification produced by vd-model-parser.
+struct ParserOutput {
+  FG fg;
+  FG_Map fg_params;
+  FG_Map fg_factors;
+  std::string root_name;
+  leaves_t leaves;
+};
+
+// Builds ParserOutput from vd-model-parser's output as it arrives, so that
+// the graph is built while the parser is still writing and the output is
+// never held whole. Output in the binary format (written with -b) is
+// decoded record by record; text output, e.g. from an older parser or an
+// error message, is collected and parsed once complete.
+class model_stream_reader {
+public:
+  void feed(std::string_view bytes);
+
+  // Returns the parsed output, or nullopt if the parser did not produce
+  // any, e.g. because it reported an error, which is logged.
+  std::optional<ParserOutput> finish();
+
+private:
+  bool decode_record();
+  std::optional<std::uint32_t> peek_u32(std::size_t offset) const;
+  const std::string& name(std::uint32_t id) const;
+  FG_Vertex param_vertex(std::uint32_t id);
+
+  std::optional<bool> _binary;  // Known once the magic has been read
+  std::string _pending;         // Input not yet decoded
+  std::size_t _pos = 0;         // Decoded prefix of _pending
+  bool _ended = false;
+  std::string _trailing;        // Anything after the records, e.g. an error
+
+  std::vector<std::string> _names;
+  std::vector<std::optional<FG_Vertex>> _param_vertices;  // By name id
+  ParserOutput _output;
+};
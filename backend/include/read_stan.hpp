@@ -1,13 +1,121 @@
 #pragma once
 
-#include <map>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <optional>
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <variant>
+#include <vector>
 #include <Eigen/Dense>
 
-struct standata { 
-  std::unique_ptr<Eigen::MatrixXd> samples;
-  std::map<std::string, int> vars;
+// Maps parameter names (with Stan's "a.1.2" columns renamed to "a[1,2]")
+// to columns of the sample matrix.
+typedef std::unordered_map<std::string, int> stan_var_map;
+
+enum class sample_precision { f64, f32 };
+
+// Read access to the draws, one column per parameter. Implementations
+// store them in double or single precision, in memory or on disk; every
+// accessor returns copies widened to double, so callers always compute
+// and accumulate in double. Accessors may be called from several threads.
+class sample_matrix {
+public:
+  virtual ~sample_matrix() = default;
+
+  virtual Eigen::Index rows() const = 0;
+  virtual Eigen::Index cols() const = 0;
+  virtual sample_precision precision() const = 0;
+
+  virtual Eigen::MatrixXd columns(const std::vector<int>& cols) const = 0;
+
+  Eigen::VectorXd col(Eigen::Index col) const {
+    return columns({ static_cast<int>(col) }).col(0);
+  }
+
+  // Identifies the draws, so that fits to equal fingerprints can be
+  // reused. 0 means unknown.
+  std::uint64_t fingerprint() const { return _fingerprint; }
+  void set_fingerprint(std::uint64_t fingerprint) { _fingerprint = fingerprint; }
+
+private:
+  std::uint64_t _fingerprint = 0;
+};
+
+// Draws held contiguously in column-major order, either in an owned
+// matrix or in a memory-mapped sample cache.
+class dense_sample_matrix final : public sample_matrix {
+public:
+  dense_sample_matrix(const double* data, Eigen::Index rows, Eigen::Index cols)
+    : _values(Eigen::Map<const Eigen::MatrixXd>(data, rows, cols)) {}
+  dense_sample_matrix(const float* data, Eigen::Index rows, Eigen::Index cols)
+    : _values(Eigen::Map<const Eigen::MatrixXf>(data, rows, cols)) {}
+
+  Eigen::Index rows() const override { return std::visit([](const auto& m) { return m.rows(); }, _values); }
+  Eigen::Index cols() const override { return std::visit([](const auto& m) { return m.cols(); }, _values); }
+
+  sample_precision precision() const override {
+    return std::holds_alternative<Eigen::Map<const Eigen::MatrixXd>>(_values) ? sample_precision::f64 : sample_precision::f32;
+  }
+
+  Eigen::MatrixXd columns(const std::vector<int>& cols) const override {
+    return std::visit([&](const auto& m) -> Eigen::MatrixXd { return m(Eigen::all, cols).template cast<double>(); }, _values);
+  }
+
+private:
+  std::variant<Eigen::Map<const Eigen::MatrixXd>, Eigen::Map<const Eigen::MatrixXf>> _values;
+};
+
+struct standata {
+  std::unique_ptr<sample_matrix> samples;  // May view memory owned by storage
+  stan_var_map vars;
+  std::shared_ptr<const void> storage;
+  bool mapped = false;  // storage is a file mapping, whose pages the OS can drop
+  std::vector<long> chain_rows;  // Draws of each chain, stored in chain order; empty if unknown
 };
 
-standata read_stan_file(std::string file_name, int num_chains, bool bootstrap = false);
\ No newline at end of file
+// The CSV file of a chain (numbered from 1): <file_prefix><chain>.csv, or
+// <file_prefix><chain>.csv.gz if only the gzip-compressed file exists.
+// Gzipped chains are decompressed in chunks while they are parsed.
+std::string stan_chain_path(const std::string& file_prefix, int chain);
+
+// The chains of a run, mapped (or, if gzipped, decompressed) and scanned
+// for their header and number of draws, but not yet parsed.
+struct scanned_chains;
+
+// Does the I/O pass of reading the chains, which needs nothing but their
+// names, so that it can run before the columns to load are known. Throws
+// std::invalid_argument if num_chains is less than 1.
+std::shared_ptr<const scanned_chains> scan_stan_files(const std::string& file_name, int num_chains);
+
+// If columns is set, only the named parameters are loaded; every other
+// column is skipped while parsing. The chains are scanned first unless
+// scanned holds the same chains.
+standata read_stan_file(std::string file_name, int num_chains,
+                        const std::optional<std::set<std::string>>& columns = std::nullopt,
+                        sample_precision precision = sample_precision::f64,
+                        std::shared_ptr<const scanned_chains> scanned = nullptr);
+
+// Reads the draws chains gained since previous was read from them, and
+// returns previous's draws with them appended to each chain. Only the new
+// draws are parsed. Returns nothing if previous does not know how many
+// draws each chain had, or does not hold the same columns, or if a chain
+// now has fewer draws; the chains must then be read anew.
+std::optional<standata> append_stan_draws(const standata& previous, std::string file_name, int num_chains,
+                                          const std::optional<std::set<std::string>>& columns = std::nullopt,
+                                          sample_precision precision = sample_precision::f64);
+
+// Parses the same draws as read_stan_file without ever holding all of
+// them. Once the chains are scanned, on_layout receives the loaded columns
+// and the number of draws in each chain, and returns how many rows to
+// parse at a time. on_block then receives consecutive blocks of at most
+// that many rows, with their chain and first row within the chain. Chains
+// are parsed in parallel, so on_block is called concurrently for
+// different chains.
+void read_stan_blocks(std::string file_name, int num_chains,
+                      const std::optional<std::set<std::string>>& columns,
+                      const std::function<long(const stan_var_map&, const std::vector<long>&)>& on_layout,
+                      const std::function<void(int, long, Eigen::Ref<const Eigen::MatrixXd>)>& on_block,
+                      std::shared_ptr<const scanned_chains> scanned = nullptr);
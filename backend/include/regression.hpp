@@ -6,5 +6,5 @@
 
 double adj_r_squared(
   std::set<std::string> predictor_names, std::string response_name,
-  const Eigen::MatrixXd& stan_matrix, const std::map<std::string, int>& stan_vars,
+  const sample_matrix& stan_matrix, const stan_var_map& stan_vars,
   bool sqrt_scale = true, bool split_data = true);
@@ -1,9 +1,31 @@
 #include <Eigen/Dense>
+#include <cstdint>
+#include <functional>
 #include <set>
 #include <map>
 #include <string>
+#include <utility>
+#include <read_stan.hpp>
 
+// Fits are remembered, keyed by the sample fingerprint, so refitting a
+// node on unchanged samples is free.
+// Samples with a zero fingerprint are always refit.
 double rf_oob_mse(
   std::set<std::string> predictor_names, std::string response_name,
-  const Eigen::MatrixXd& stan_matrix, const std::map<std::string, int>& stan_vars,
+  const sample_matrix& stan_matrix, const stan_var_map& stan_vars,
   bool sqrt_scale = true, bool split_data = true);
+
+// Called with the cache key and result of every new fit that is cached,
+// from the thread that ran it. Set before any fits run.
+void set_rf_fit_observer(std::function<void(const std::string&, double)> observer);
+
+// Adds a fit recorded by the observer, e.g. in an earlier run, to the cache.
+void seed_rf_cache(const std::string& key, double ered);
+
+// Drops cached fits of samples other than those with fingerprint, e.g.
+// once the samples were reloaded. At most the latest 100000 fits are kept
+// in any case.
+void retain_rf_cache(std::uint64_t fingerprint);
+
+// The number of cached fits and the bytes the cache holds.
+std::pair<std::size_t, std::size_t> rf_cache_usage();
@@ -2,15 +2,14 @@
 
 #include <string>
 #include <optional>
-
-struct ParserOutput {
-  std::string fg_data;
-  std::string tree_data;
-};
+#include <read_model_stream.hpp>
 
 // Runs the model parser subprocess and captures its output.
 // Returns nullopt if the parser fails or produces malformed output.
+// With use_cache set, output is reused from .vd-parser-cache next to the
+// model file if the model, the data and the parser are all unchanged.
 std::optional<ParserOutput> run_model_parser(
   const std::string& model_file,
-  const std::string& data_file
+  const std::string& data_file,
+  bool use_cache = true
 );
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <read_stan.hpp>
+
+// Loads Stan draws through a binary cache stored next to the chain files
+// at <file_prefix>.vdcache, which is memory-mapped as the sample matrix.
+// It is only used if the sizes and modification times of the chain files
+// match those recorded when it was written, and it holds every requested
+// column in the requested precision; otherwise the CSVs are parsed and
+// the cache is rewritten.
+//
+// With out_of_core set, the draws are never all held in memory: the CSVs
+// are parsed a block of rows at a time into a cache with a chunk per
+// chain, which is written even if use_cache is false. Fits then read just
+// the columns they need from the mapping.
+//
+// The samples are given the fingerprint of the chain files. Chains already
+// scanned by scan_stan_files are parsed without reading them again.
+standata load_samples(const std::string& file_prefix, int num_chains,
+                      const std::optional<std::set<std::string>>& columns,
+                      sample_precision precision = sample_precision::f64,
+                      bool use_cache = true, bool out_of_core = false,
+                      std::shared_ptr<const scanned_chains> scanned = nullptr);
+
+// Loads the samples again once the chains may have gained draws. The draws
+// previous holds are kept and only the new ones parsed, unless the samples
+// are out of core or cannot be appended to (see append_stan_draws), in
+// which case they are loaded anew.
+standata reload_samples(const standata& previous, const std::string& file_prefix, int num_chains,
+                        const std::optional<std::set<std::string>>& columns,
+                        sample_precision precision = sample_precision::f64,
+                        bool use_cache = true, bool out_of_core = false);
+
+// Whether the cache is of these chains as they are now, so that loading
+// them needs no CSV parsing (unless it lacks a column or precision).
+bool sample_cache_current(const std::string& file_prefix, int num_chains);
+
+std::optional<standata> read_sample_cache(const std::string& file_prefix, int num_chains,
+                                          const std::optional<std::set<std::string>>& columns,
+                                          sample_precision precision);
+
+void write_sample_cache(const std::string& file_prefix, int num_chains,
+                        const std::optional<std::set<std::string>>& columns,
+                        const standata& data);
+
+void write_sample_cache_out_of_core(const std::string& file_prefix, int num_chains,
+                                    const std::optional<std::set<std::string>>& columns,
+                                    sample_precision precision,
+                                    std::shared_ptr<const scanned_chains> scanned = nullptr);
+
+// Hashes the paths, sizes and modification times of the chain files.
+std::uint64_t sample_fingerprint(const std::string& file_prefix, int num_chains, sample_precision precision);
@@ -2,10 +2,15 @@
 
 #include "parameter_graph.hpp"
 #include "factor_graph.hpp"
+#include "lik_complexity.hpp"
+#include <cstdint>
 #include <memory>
+#include <optional>
+#include <set>
 #include <string>
 #include <tuple>
 #include <utility>
+#include <vector>
 
 void save_tree(const MTree& tree, Node root, const std::string& filename);
 std::pair<std::unique_ptr<MTree>, Node> load_tree(const std::string& filename);
@@ -13,8 +18,30 @@ std::pair<std::unique_ptr<MTree>, Node> load_tree(const std::string& filename);
 void save_fg(const FG& fg, const FG_Map& fg_params, const FG_Map& fg_factors, const std::string& filename);
 std::tuple<FG, FG_Map, FG_Map> load_fg(const std::string& filename);
 
+// Everything startup derives from the factor graph and the samples.
+// Archived alongside the tree so that a saved session reopens without
+// rebuilding it; global_adj_r is only valid for samples with the stored
+// fingerprint.
+struct derived_state {
+  MRF mrf;
+  VertexMap param_vertices;
+  complexity_index complexity;
+  std::string root_name;
+  std::optional<std::vector<std::set<std::string>>> leaves;  // Unknown for sessions first opened from text archives
+  double global_adj_r;
+  std::uint64_t sample_fingerprint;
+  std::optional<int> num_chains = std::nullopt;  // Unknown for archives written before version 3
+};
+
+// Archives are written in a versioned binary format with a string table
+// for names, a CRC-32 checksum and, if compress is set, zlib compression.
+// load_state also reads older binary archives and the Boost text archives
+// written before them, neither of which has derived state.
 void save_state(const MTree& tree, Node root,
                 const FG& fg, const FG_Map& fg_params, const FG_Map& fg_factors,
+                const derived_state& derived,
                 const std::string& sid,
-                const std::string& filename);
-std::tuple<std::unique_ptr<MTree>, Node, FG, FG_Map, FG_Map, std::string> load_state(const std::string& filename);
+                const std::string& filename,
+                bool compress = true);
+std::tuple<std::unique_ptr<MTree>, Node, FG, FG_Map, FG_Map, std::optional<derived_state>, std::string>
+load_state(const std::string& filename);
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+// An append-only log of the changes made to a session since its last
+// snapshot, kept at <path>.vdj next to the snapshot <path>.vds. Each line
+// is a JSON record: a method call with its arguments, or an eRed fit with
+// its cache key. Resuming loads the snapshot, seeds the fit cache and
+// replays the calls, so nothing computed before a crash is fit again.
+//
+// The first line holds the checksum of the snapshot the calls apply to.
+// A journal that does not match the snapshot on disk is left over from
+// before the snapshot was written and is ignored.
+class session_journal {
+public:
+  struct contents {
+    std::vector<std::pair<std::string, nlohmann::json>> calls;
+    std::vector<std::pair<std::string, double>> fits;
+  };
+
+  explicit session_journal(std::string path);
+
+  std::string snapshot_path() const { return _path + ".vds"; }
+  std::string journal_path() const { return _path + ".vdj"; }
+
+  // The records that apply to the current snapshot, if there are any.
+  std::optional<contents> read() const;
+
+  // Opens the journal for appending, starting a new one if it does not
+  // match the snapshot.
+  void open();
+
+  // Records are flushed as they are written, and may be written from
+  // several threads.
+  void record_call(const std::string& method, const nlohmann::json& args);
+  void record_fit(const std::string& key, double ered);
+
+  std::size_t calls_since_snapshot() const;
+
+  // Writes a new snapshot with write_snapshot, which is given the path to
+  // write to, then starts an empty journal for it.
+  void compact(const std::function<void(const std::string&)>& write_snapshot);
+
+private:
+  std::optional<std::uint32_t> snapshot_checksum() const;
+  void start_journal();
+  void append(const nlohmann::json& record);
+
+  std::string _path;
+  mutable std::mutex _mutex;
+  std::ofstream _out;
+  std::size_t _calls = 0;
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <nlohmann/json.hpp>
+
+// Nested spans of backend work, written as a Chrome trace (the JSON format
+// chrome://tracing and ui.perfetto.dev open) when recording stops.
+//
+//   tracing::span span("make_chain");
+//   span.arg("leaves", leaf.size());
+//
+// Spans nest by time on each thread. Each records the thread it ran on and
+// the websocket method it was part of (see metrics::current_operation).
+// When not recording, a span costs one relaxed atomic load.
+
+namespace tracing {
+
+  extern std::atomic<bool> recording;
+
+  inline bool enabled() {
+    return recording.load(std::memory_order_relaxed);
+  }
+
+  // Starts recording spans, to be written to path by stop().
+  void start(const std::string& path);
+
+  // Stops recording and writes every span recorded. Spans still open are
+  // dropped.
+  void stop();
+
+  class span {
+  public:
+    explicit span(std::string_view name) {
+      if(enabled()) {
+        begin(name);
+      }
+    }
+    ~span() {
+      if(_active) {
+        end();
+      }
+    }
+    span(const span&) = delete;
+    span& operator=(const span&) = delete;
+
+    // Adds an argument, shown with the span, e.g. the size of a parameter
+    // set. Ignored when not recording.
+    template<class T>
+    span& arg(const char* key, const T& value) {
+      if(_active) {
+        _args[key] = value;
+      }
+      return *this;
+    }
+
+  private:
+    void begin(std::string_view name);
+    void end();
+
+    bool _active = false;
+    std::string _name;
+    std::chrono::steady_clock::time_point _start;
+    nlohmann::json _args;
+  };
+
+}
@@ -1,8 +1,70 @@
+#include <cstddef>
 #include <functional>
+#include <future>
 #include <optional>
 #include <string>
 #include <nlohmann/json.hpp>
 
-void initialize_ws_client(const std::string& host, int port);
+// If compress_threshold is set, outgoing messages larger than that many bytes
+// are zlib-compressed and sent as binary frames.
+void initialize_ws_client(const std::string& host, int port, std::optional<std::size_t> compress_threshold = std::nullopt);
 void start_ws_client();
-void handle_method(std::string method_name, std::function<std::optional<std::string>(nlohmann::json)> handler);
\ No newline at end of file
+void stop_ws_client();
+
+// Appends every method message received from now on to path, after a
+// first line holding header: one JSON object per line, with the seconds
+// since recording started, the method and its arguments, e.g.
+//   {"t": 12.5, "method": "divide_branch", "args": {...}}
+// Throws std::runtime_error if path cannot be written.
+void record_methods(const std::string& path, const nlohmann::json& header);
+
+// Sets up the handler pool alone, to run methods with invoke_method and
+// no client, as batch mode does. initialize_ws_client does this itself.
+void initialize_method_pool();
+
+// Handlers run on a worker pool. Read handlers share a lock on the backend
+// state and may run concurrently; write handlers hold it exclusively and
+// run one at a time, in the order their messages arrived. Long write
+// handlers are ordered with the write handlers, but hold the lock shared,
+// so that reads go on while they work, e.g. on a copy of the tree; they
+// change the state only within apply_exclusively. Stateless handlers touch
+// no backend state: they take no lock and run even before startup has
+// finished. A handler that throws is answered with a message of type
+// "error" giving the method and what went wrong.
+enum class method_access { read, write, long_write, stateless };
+
+void handle_method(std::string method_name, std::function<std::optional<std::string>(nlohmann::json)> handler,
+                   method_access access = method_access::write);
+
+// Lets the client connect before the state its handlers use is ready:
+// handlers wait for ready before running, in the order their messages
+// arrived. If ready holds an exception, they fail with it. Set before
+// starting the client.
+void hold_methods_until(std::shared_future<void> ready);
+
+// Runs a method's handler on the calling thread, once startup has
+// finished, taking the state lock as it would for a message, and returns
+// its reply. Unlike for messages, failures are thrown. Throws
+// std::out_of_range if there is no such method.
+std::optional<std::string> invoke_method(const std::string& method_name, const nlohmann::json& args);
+
+bool has_method(const std::string& method_name);
+
+// Runs apply with the state lock held exclusively, from a long write
+// handler, which holds the lock shared again afterwards. Anywhere else,
+// just runs apply.
+void apply_exclusively(const std::function<void()>& apply);
+
+// Runs task on the handler pool. With access set, it takes the state lock
+// as a handler with that access would, and write tasks are ordered with
+// write handlers. Exceptions are logged.
+void post_task(std::function<void()> task, std::optional<method_access> access = std::nullopt);
+
+// Waits for every posted task, and those they post in turn, to finish.
+// The pool runs nothing more afterwards.
+void wait_for_tasks();
+
+// Sends a message to the server outside of any method reply, e.g. a tree
+// updated by a background task. Dropped if not connected, which is logged
+// as a warning if warn_if_dropped is set and there is a client.
+void send_to_server(const std::string& message, bool warn_if_dropped = true);
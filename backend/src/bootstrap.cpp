@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+
+#include <bootstrap.hpp>
+#include <logging.hpp>
+#include <parallel.hpp>
+#include <regression_rf.hpp>
+
+using namespace std;
+using Eigen::Index;
+using Eigen::MatrixXd;
+
+resampled_sample_matrix::resampled_sample_matrix(const sample_matrix& base, vector<Index> rows)
+  : _base(base), _rows(std::move(rows)) {}
+
+MatrixXd resampled_sample_matrix::columns(const vector<int>& cols) const {
+  MatrixXd base_cols = _base.columns(cols);
+  return base_cols(_rows, Eigen::all);
+}
+
+vector<Index> bootstrap_rows(Index num_rows, uint64_t seed) {
+  mt19937_64 generator(seed);
+  Index num_train = num_rows / 2;
+  uniform_int_distribution<Index> train_rows(0, max<Index>(0, num_train - 1));
+  uniform_int_distribution<Index> test_rows(num_train, max<Index>(num_train, num_rows - 1));
+
+  vector<Index> rows(num_rows);
+  for(Index ri = 0; ri < num_rows; ++ri) {
+    rows[ri] = ri < num_train ? train_rows(generator) : test_rows(generator);
+  }
+  return rows;
+}
+
+vector<pair<double, double>> bootstrap_ereds(
+  const vector<set<string>>& parameter_sets, const string& response_name,
+  const sample_matrix& stan_matrix, const stan_var_map& stan_vars,
+  int num_replicates, double level, uint64_t seed
+) {
+  if(num_replicates < 2) {
+    throw invalid_argument("Bootstrap needs at least 2 replicates.");
+  }
+  if(level <= 0 || level >= 1) {
+    throw invalid_argument("Bootstrap interval level must be between 0 and 1.");
+  }
+
+  vector<resampled_sample_matrix> replicates;
+  replicates.reserve(num_replicates);
+  for(int ri = 0; ri < num_replicates; ++ri) {
+    replicates.emplace_back(stan_matrix, bootstrap_rows(stan_matrix.rows(), seed + ri));
+  }
+
+  // One task per (parameter set, replicate) fit.
+  size_t num_sets = parameter_sets.size();
+  vector<double> ereds(num_sets * num_replicates);
+  VD_LOG(info, rf) << "Running " << ereds.size() << " bootstrap fits.";
+  parallel_for(ereds.size(), [&](size_t fi) {
+    size_t si = fi / num_replicates;
+    size_t ri = fi % num_replicates;
+    ereds[fi] = rf_oob_mse(parameter_sets[si], response_name, replicates[ri], stan_vars);
+  });
+
+  vector<pair<double, double>> intervals(num_sets);
+  double tail = (1 - level) / 2;
+  for(size_t si = 0; si < num_sets; ++si) {
+    auto first = ereds.begin() + si * num_replicates;
+    vector<double> set_ereds(first, first + num_replicates);
+    sort(set_ereds.begin(), set_ereds.end());
+    auto quantile = [&](double q) {
+      double pos = q * (num_replicates - 1);
+      size_t below = floor(pos);
+      size_t above = min<size_t>(below + 1, num_replicates - 1);
+      return set_ereds[below] + (pos - below) * (set_ereds[above] - set_ereds[below]);
+    };
+    intervals[si] = { quantile(tail), quantile(1 - tail) };
+  }
+  return intervals;
+}
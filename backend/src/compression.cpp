@@ -0,0 +1,105 @@
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <zlib.h>
+
+#include <compression.hpp>
+
+using namespace std;
+
+// zlib counts input and output in 32-bit uInt, so large buffers are
+// streamed through it in pieces of at most this many bytes.
+static const size_t max_zlib_piece = size_t(1) << 30;
+
+string zlib_compress(const string& data, int level) {
+  z_stream stream{};
+  int status = deflateInit(&stream, level);
+  if(status != Z_OK) {
+    throw runtime_error("zlib compression failed with status " + to_string(status));
+  }
+  unique_ptr<z_stream, int(*)(z_streamp)> stream_guard(&stream, &deflateEnd);
+
+  string compressed;
+  size_t consumed = 0;
+  do {
+    size_t piece = min(data.size() - consumed, max_zlib_piece);
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data() + consumed));
+    stream.avail_in = piece;
+    consumed += piece;
+    int flush = (consumed == data.size()) ? Z_FINISH : Z_NO_FLUSH;
+    do {
+      size_t written = compressed.size();
+      compressed.resize(written + max<size_t>(deflateBound(&stream, stream.avail_in), 1 << 16));
+      stream.next_out = reinterpret_cast<Bytef*>(compressed.data() + written);
+      stream.avail_out = compressed.size() - written;
+      status = deflate(&stream, flush);
+      compressed.resize(compressed.size() - stream.avail_out);
+      if(status == Z_STREAM_ERROR) {
+        throw runtime_error("zlib compression failed with status " + to_string(status));
+      }
+    } while(stream.avail_out == 0 || stream.avail_in > 0);
+  } while(consumed < data.size());
+
+  if(status != Z_STREAM_END) {
+    throw runtime_error("zlib compression failed with status " + to_string(status));
+  }
+  return compressed;
+}
+
+string zlib_decompress(string_view compressed, size_t original_size) {
+  z_stream stream{};
+  int status = inflateInit(&stream);
+  if(status != Z_OK) {
+    throw runtime_error("zlib decompression failed with status " + to_string(status));
+  }
+  unique_ptr<z_stream, int(*)(z_streamp)> stream_guard(&stream, &inflateEnd);
+
+  string data(original_size, '\0');
+  size_t consumed = 0;
+  size_t produced = 0;
+  do {
+    size_t in_piece = min(compressed.size() - consumed, max_zlib_piece);
+    size_t out_piece = min(original_size - produced, max_zlib_piece);
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data() + consumed));
+    stream.avail_in = in_piece;
+    stream.next_out = reinterpret_cast<Bytef*>(data.data() + produced);
+    stream.avail_out = out_piece;
+    status = inflate(&stream, Z_NO_FLUSH);
+    consumed += in_piece - stream.avail_in;
+    produced += out_piece - stream.avail_out;
+  } while(status == Z_OK);
+
+  // A stream that ends early, or holds more than original_size bytes,
+  // stops with Z_BUF_ERROR.
+  if(status != Z_STREAM_END || produced != original_size) {
+    throw runtime_error("zlib decompression failed with status " + to_string(status));
+  }
+  return data;
+}
+
+uint32_t crc32_checksum(string_view data, uint32_t preceding) {
+  return crc32_z(preceding, reinterpret_cast<const Bytef*>(data.data()), data.size());
+}
+
+void read_gzip_chunks(const string& path, const function<void(string_view)>& on_chunk, size_t chunk_size) {
+  unique_ptr<gzFile_s, int(*)(gzFile)> file(gzopen(path.c_str(), "rb"), &gzclose);
+  if(!file) {
+    throw runtime_error("Could not open gzip file " + path);
+  }
+  gzbuffer(file.get(), 1 << 17);
+
+  vector<char> chunk(chunk_size);
+  while(true) {
+    int num_read = gzread(file.get(), chunk.data(), chunk.size());
+    if(num_read < 0) {
+      int status;
+      throw runtime_error("Could not decompress " + path + ": " + gzerror(file.get(), &status));
+    }
+    if(num_read == 0) {
+      break;
+    }
+    on_chunk(string_view(chunk.data(), num_read));
+  }
+}
@@ -2,30 +2,40 @@
 #include<factor_graph.hpp>
 // #include <iostream>
 
-std::function<float(std::set<std::string>)> get_complexity(FG factor_graph, FG_Map fg_params, FG_Map fg_facs) {
-
-  int num_lik = 0;
+complexity_index index_complexity(const FG& factor_graph, const FG_Map& fg_params, const FG_Map& fg_facs) {
+  complexity_index index;
   for(const auto& fac: fg_facs) {
     if(factor_graph[fac.second].is_lik) {
-      ++num_lik;
+      ++index.num_lik;
     }
   }
+  for(const auto& param: fg_params) {
+    index.closest_facs.emplace(param.first, closest_factors(param.second, factor_graph));
+  }
+  return index;
+}
 
-  return [factor_graph, fg_params, num_lik](std::set<std::string> params) {
+std::function<float(std::set<std::string>)> get_complexity(complexity_index index) {
+
+  return [index = std::move(index)](std::set<std::string> params) {
     std::set<std::string> closest_facs {};
     for(const auto& param: params) {
-      const auto& param_facs = closest_factors(fg_params.at(param), factor_graph);
+      const auto& param_facs = index.closest_facs.at(param);
       closest_facs.insert(param_facs.begin(), param_facs.end());
     }
     int num_closest = closest_facs.size();
 
-    const float lik_comp = static_cast<float>(num_closest) / static_cast<float>(num_lik);
+    const float lik_comp = static_cast<float>(num_closest) / static_cast<float>(index.num_lik);
     return lik_comp;
   };
 
 }
 
-std::set<std::string> closest_factors(FG_Vertex param_vertex, FG factor_graph) {
+std::function<float(std::set<std::string>)> get_complexity(FG factor_graph, FG_Map fg_params, FG_Map fg_facs) {
+  return get_complexity(index_complexity(factor_graph, fg_params, fg_facs));
+}
+
+std::set<std::string> closest_factors(FG_Vertex param_vertex, const FG& factor_graph) {
   bool searching_lik_facs = true;
   std::set<std::string> closest;
   std::set<FG_Vertex> cur_params {param_vertex};
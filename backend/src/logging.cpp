@@ -0,0 +1,143 @@
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <logging.hpp>
+
+using namespace std;
+
+namespace vdlog {
+
+  atomic<int> thresholds[static_cast<int>(category::num_categories)] = {
+    static_cast<int>(level::info), static_cast<int>(level::info),
+    static_cast<int>(level::info), static_cast<int>(level::info),
+    static_cast<int>(level::info), static_cast<int>(level::info),
+    static_cast<int>(level::info), static_cast<int>(level::info)
+  };
+
+  static const char* level_names[] = { "trace", "debug", "info", "warn", "error", "off" };
+  static const char* category_names[] = { "startup", "ws", "tree", "chain", "rf", "samples", "parser", "io" };
+
+  static level parse_level(const string& name) {
+    for(int li = 0; li <= static_cast<int>(level::off); ++li) {
+      if(name == level_names[li]) return static_cast<level>(li);
+    }
+    throw invalid_argument("Unknown log level: " + name);
+  }
+
+  static category parse_category(const string& name) {
+    for(int ci = 0; ci < static_cast<int>(category::num_categories); ++ci) {
+      if(name == category_names[ci]) return static_cast<category>(ci);
+    }
+    throw invalid_argument("Unknown log category: " + name);
+  }
+
+  void configure(const string& spec) {
+    stringstream spec_stream(spec);
+    string item;
+    while(getline(spec_stream, item, ',')) {
+      auto eq_pos = item.find('=');
+      if(eq_pos == string::npos) {
+        int lvl = static_cast<int>(parse_level(item));
+        for(auto& threshold: thresholds) {
+          threshold.store(lvl);
+        }
+      } else {
+        category cat = parse_category(item.substr(0, eq_pos));
+        thresholds[static_cast<int>(cat)].store(static_cast<int>(parse_level(item.substr(eq_pos + 1))));
+      }
+    }
+  }
+
+  struct entry {
+    level lvl;
+    category cat;
+    string message;
+  };
+
+  // Owns the sink thread. Destroyed at exit, after draining the queue.
+  class sink {
+  public:
+    sink(): _writer([this]() { run(); }) {}
+
+    ~sink() {
+      {
+        lock_guard<mutex> lock(_mutex);
+        _stopping = true;
+      }
+      _ready.notify_one();
+      _writer.join();
+    }
+
+    void push(entry e) {
+      {
+        lock_guard<mutex> lock(_mutex);
+        _queue.push_back(std::move(e));
+      }
+      _ready.notify_one();
+    }
+
+    void wait_empty() {
+      unique_lock<mutex> lock(_mutex);
+      _drained.wait(lock, [this]() { return _queue.empty() && !_writing; });
+    }
+
+  private:
+    void run() {
+      vector<entry> batch;
+      unique_lock<mutex> lock(_mutex);
+      while(true) {
+        _ready.wait(lock, [this]() { return _stopping || !_queue.empty(); });
+        if(_queue.empty() && _stopping) {
+          return;
+        }
+        batch.assign(make_move_iterator(_queue.begin()), make_move_iterator(_queue.end()));
+        _queue.clear();
+        _writing = true;
+        lock.unlock();
+
+        bool wrote_err = false;
+        for(const auto& e: batch) {
+          bool is_err = e.lvl >= level::warn;
+          ostream& out = is_err ? cerr : cout;
+          out << "[" << level_names[static_cast<int>(e.lvl)] << " "
+              << category_names[static_cast<int>(e.cat)] << "] " << e.message << '\n';
+          wrote_err = wrote_err || is_err;
+        }
+        cout.flush();
+        if(wrote_err) cerr.flush();
+        batch.clear();
+
+        lock.lock();
+        _writing = false;
+        _drained.notify_all();
+      }
+    }
+
+    mutex _mutex;
+    condition_variable _ready;
+    condition_variable _drained;
+    deque<entry> _queue;
+    bool _writing = false;
+    bool _stopping = false;
+    thread _writer;
+  };
+
+  static sink& get_sink() {
+    static sink log_sink;
+    return log_sink;
+  }
+
+  void write(level lvl, category cat, string message) {
+    get_sink().push({ lvl, cat, std::move(message) });
+  }
+
+  void flush() {
+    get_sink().wait_empty();
+  }
+
+}
@@ -6,8 +6,12 @@
 #include <queue>
 #include <Eigen/Dense>
 
+#include <logging.hpp>
 #include <markov.hpp>
+#include <metrics.hpp>
 #include <min_sep_vis.hpp>
+#include <parallel.hpp>
+#include <tracing.hpp>
 // #include <regression.hpp>
 #include <regression_rf.hpp>
 
@@ -15,6 +19,9 @@ using namespace std;
 using namespace boost;
 using namespace markov;
 
+static metrics::histogram separator_seconds("vd_separator_search_seconds", "Time spent finding minimal separators.");
+static metrics::histogram chain_seconds("vd_chain_search_seconds", "Time spent building Markov chains from the root to a leaf set.");
+
 int next_available_id(const MTree& tree) {
   set<int> used;
   auto [vi, vi_end] = vertices(tree);
@@ -38,15 +45,16 @@ set<string> set_minus(set<string> pset, set<string> globals) {
   return(pset);
 }
 
-void write_set(set<string>& pset) {
-  cout << "{";
+string format_set(const set<string>& pset) {
+  string formatted = "{";
   for(auto pset_it = pset.begin(); pset_it != pset.end(); pset_it = std::next(pset_it)) {
-    cout << *pset_it;
+    formatted += *pset_it;
     if(std::next(pset_it) != pset.end()) {
-      cout << "; ";
+      formatted += "; ";
     }
   }
-  cout << "}";
+  formatted += "}";
+  return formatted;
 }
 
 vertex_names minimal_separator_u(MRF mrf, vertex_names u, vertex_names v, const map<string, Vertex>& param_vertices) {
@@ -56,7 +64,7 @@ vertex_names minimal_separator_u(MRF mrf, vertex_names u, vertex_names v, const
     try {
       U.insert(param_vertices.at(u_name));
     } catch (const out_of_range& err) {
-      cout << "Error: could find vertex with name " << u_name << ": " << err.what() << endl;
+      VD_LOG(error, chain) << "Could not find vertex with name " << u_name << ": " << err.what();
     }
   }
 
@@ -78,7 +86,7 @@ vertex_names minimal_separator_u(MRF mrf, vertex_names u, vertex_names v, const
         break;
       }
     } catch (std::out_of_range _err) {
-      cout << "Could not locate vertex " << v_name << "!" << endl;
+      VD_LOG(error, chain) << "Could not locate vertex " << v_name << "!";
     }
   }
   if(!separable) {
@@ -131,7 +139,7 @@ vertex_names minimal_separator_u(MRF mrf, vertex_names u, vertex_names v, const
   try {
     start_vertex = param_vertices.at(*v.begin());
   } catch (const std::out_of_range& err) {
-    cout << "Could not access element of v set! " << err.what() << endl; 
+    VD_LOG(error, chain) << "Could not access element of v set! " << err.what();
   }
 
   depth_first_visit(mrf, start_vertex, sep_rec, dfv_color_property_map);
@@ -154,6 +162,9 @@ vertex_names minimal_separator_u(MRF mrf, vertex_names u, vertex_names v, const
 
 pair<vertex_names, bool> minimal_separator(MRF mrf, vertex_names u, vertex_names v, const map<string, Vertex>& param_vertices,
                                            std::function<float(std::set<std::string>)> LC) {
+  metrics::scoped_timer timer(separator_seconds);
+  tracing::span span("minimal_separator");
+  span.arg("u", u.size()).arg("v", v.size());
   vertex_names min_u = minimal_separator_u(mrf, u, v, param_vertices);
   if(min_u.size() < 2) {
     return {min_u, false};
@@ -163,13 +174,8 @@ pair<vertex_names, bool> minimal_separator(MRF mrf, vertex_names u, vertex_names
     float u_complexity = LC(min_u);
     float v_complexity = LC(min_v);
 
-    cout << "Separators found:" << endl;
-    write_set(min_u);
-    cout << "Complexity: " << to_string(u_complexity) << endl;
-    cout << endl;
-    write_set(min_v);
-    cout << "Complexity: " << to_string(v_complexity) << endl;
-    cout << endl << endl;
+    VD_LOG(debug, chain) << "Separators found: " << format_set(min_u) << " (complexity " << u_complexity << "), "
+                         << format_set(min_v) << " (complexity " << v_complexity << ")";
 
     // int u_complexity = 0;
     // int v_complexity = 0;
@@ -231,11 +237,12 @@ markov_chain markov::make_chain(
   const map<string, Vertex>& param_vertices,
   std::function<float(std::set<std::string>)> LC, double y_cut
 ) {
+  metrics::scoped_timer timer(chain_seconds);
+  tracing::span span("make_chain");
+  span.arg("source", source.size()).arg("sink", sink.size());
 
-  cout << "Removing globals... ";
   source = set_minus(source, globals);
   sink = set_minus(sink, globals);
-  cout << "done." << endl;
 
   set<string> y_names;
   for(auto [param_name, param_vertex]: param_vertices) {
@@ -265,11 +272,7 @@ markov_chain markov::make_chain(
     cur_start = split.first;
     cur_end = split.second;
 
-    cout << "Separating:" << endl;
-    write_set(cur_start);
-    cout << endl;
-    write_set(cur_end);
-    cout << endl << endl;
+    VD_LOG(trace, chain) << "Separating " << format_set(cur_start) << " from " << format_set(cur_end);
 
     auto separator_data = minimal_separator(mrf, cur_start, cur_end, param_vertices, LC);
     separator = separator_data.first;
@@ -298,13 +301,8 @@ markov_chain markov::make_chain(
     // double y_perc = static_cast<double>(y_int.size()) / static_cast<double>(num_ys);
 
     if(separator.size() == 0 || sep_complexity >= y_cut) {
-      cout << "-----------------------" << endl;
-      if(separator.size() == 0) {
-        cout << "SEPARATION IMPOSSIBLE" << endl;
-      } else {
-        cout << "COMPLEXITY EXCEEDED" << endl;
-      }
-      cout << "-----------------------" << endl;
+      VD_LOG(debug, chain) << (separator.size() == 0 ? "Separation impossible" : "Complexity exceeded")
+                           << ", chain has " << chain.size() << " links.";
       separable = false;
     }
 
@@ -314,6 +312,7 @@ markov_chain markov::make_chain(
     link.insert(globals.begin(), globals.end());
   }
 
+  span.arg("links", chain.size());
   return chain;
 }
 
@@ -359,14 +358,20 @@ std::pair<unique_ptr<MTree>, Node> markov::make_tree(
   MRF mrf, const string& root, const vector<vertex_names> leaves, 
   const vertex_names& globals, 
   VertexMap& param_vertices,
-  const Eigen::MatrixXd& stan_matrix, const std::map<std::string, int>& stan_vars,
+  const sample_matrix& stan_matrix, const stan_var_map& stan_vars,
   std::function<float(std::set<std::string>)> LC, double y_cut = 1
 ) {
+  tracing::span span("make_tree");
+  span.arg("leaves", leaves.size());
   int num_leaves = leaves.size();
+  // Chains are found independently, each searching its own copy of the
+  // MRF, and the new nodes' eReds are fit together once the tree is built.
   vector<markov_chain> chains(num_leaves);
   vector<markov_chain::iterator> chain_it(num_leaves);
-  for(int ci = 0; ci < num_leaves; ++ci) {
+  parallel_for(num_leaves, [&](size_t ci) {
     chains[ci] = markov::make_chain(mrf, { root }, leaves[ci], globals, param_vertices, LC, y_cut);
+  });
+  for(int ci = 0; ci < num_leaves; ++ci) {
     chain_it[ci] = chains[ci].begin();
   }
 
@@ -398,27 +403,27 @@ std::pair<unique_ptr<MTree>, Node> markov::make_tree(
 
         std::optional<Node> next_node = search_children(cur_node, chain_parameters, markov_tree);
         if(next_node == nullopt) {
-          double ered = rf_oob_mse(chain_parameters, root, stan_matrix, stan_vars);
           auto name_hash = next_available_id(*markov_tree);
           Node new_node = add_vertex({
             .parameters = chain_parameters,
-            .ered = ered,
+            .ered = nullopt,
             .depth = cur_depth + 1,
             .chain_nums = { ci },
             .name = name_hash
           }, *markov_tree);
-          cout << "Connecting " << print_set((*markov_tree)[cur_node].parameters) 
-               << " to " << print_set((*markov_tree)[new_node].parameters) << "." << endl;
+          VD_LOG(debug, tree) << "Connecting " << print_set((*markov_tree)[cur_node].parameters)
+                              << " to " << print_set((*markov_tree)[new_node].parameters) << ".";
           add_edge(cur_node, new_node, *markov_tree);
           node_stack.push(new_node);
         } else {
-          cout << "Found child!" << endl;
+          VD_LOG(trace, tree) << "Found child!";
           (*markov_tree)[next_node.value()].chain_nums.insert(ci);
         }
       }
     }
   }
 
+  fill_missing_ereds(*markov_tree, root_node, stan_matrix, stan_vars);
   return(std::make_pair(std::move(markov_tree), root_node));
 }
 
@@ -445,7 +450,7 @@ Node locate_node(MTree& tree, const Node& root, int node_name) {
   }
 
   if(ex_node == nullopt) {
-    cout << "Could not locate node! Cannot extrude branch." << endl;
+    VD_LOG(error, tree) << "Could not locate node! Cannot extrude branch.";
     throw new std::out_of_range("Could not locate node! Cannot extrude branch.");
   } else {
     auto node = ex_node.value();
@@ -489,7 +494,7 @@ std::pair<Node, vector<Node>> locate_node_depth_first(MTree& tree, const Node& r
   }
 
   if(ex_node == nullopt) {
-    cout << "Could not locate node! Cannot extrude branch." << endl;
+    VD_LOG(error, tree) << "Could not locate node! Cannot extrude branch.";
     throw new std::out_of_range("Could not locate node! Cannot extrude branch.");
   } else {
     auto node = ex_node.value();
@@ -528,7 +533,7 @@ std::set<vector<Node>> find_leaf_paths(MTree& tree, const Node root) {
     });
   }
 
-  cout << "Returning leaf ancestors of length " << to_string(all_ancestors.size()) << "." << endl;
+  VD_LOG(debug, tree) << "Returning leaf ancestors of length " << all_ancestors.size() << ".";
   return(all_ancestors);
 
 }
@@ -536,9 +541,12 @@ std::set<vector<Node>> find_leaf_paths(MTree& tree, const Node root) {
 void markov::divide_branch(
   MTree& tree, const Node& root, 
   int node_name, vertex_names params_kept, 
-  const Eigen::MatrixXd& stan_matrix, const std::map<std::string, int>& stan_vars
+  const sample_matrix& stan_matrix, const stan_var_map& stan_vars,
+  bool defer_ered
 ) {
-  cout << "Beginning divide branch..." << endl;
+  tracing::span span("divide_branch");
+  span.arg("params_kept", params_kept.size());
+  VD_LOG(debug, tree) << "Beginning divide branch...";
 
   std::queue<Node> node_queue {};
   node_queue.push(root);
@@ -561,17 +569,20 @@ void markov::divide_branch(
   }
 
   if(split_nodes == nullopt) {
-    cout << "Could not locate child node! Cannot divide branch." << endl;
+    VD_LOG(error, tree) << "Could not locate child node! Cannot divide branch.";
     throw new std::out_of_range("Could not locate child node! Cannot divide branch.");
   } else {
-    cout << "Modifying tree..." << endl;
+    VD_LOG(debug, tree) << "Modifying tree...";
     auto [par_node, child_node] = split_nodes.value();
     remove_edge(par_node, child_node, tree);
 
     auto child_params = tree[child_node].parameters;
     params_kept.insert(child_params.begin(), child_params.end());
     string root_name = *tree[root].parameters.begin();
-    double ered = rf_oob_mse(params_kept, root_name, stan_matrix, stan_vars);
+    std::optional<double> ered = nullopt;
+    if(!defer_ered) {
+      ered = rf_oob_mse(params_kept, root_name, stan_matrix, stan_vars);
+    }
     auto name_hash = next_available_id(tree);
     Node split_node = add_vertex({
       .parameters = params_kept,
@@ -591,8 +602,9 @@ void markov::divide_branch(
 void markov::auto_divide(
   MTree& tree, const Node& root, 
   int node_name,
-  const Eigen::MatrixXd& stan_matrix, const std::map<std::string, int>& stan_vars
+  const sample_matrix& stan_matrix, const stan_var_map& stan_vars
 ) {
+  tracing::span span("auto_divide");
   std::queue<Node> node_queue {};
   node_queue.push(root);
   bool not_found = true;
@@ -614,7 +626,7 @@ void markov::auto_divide(
   }
 
   if(split_nodes == nullopt) {
-    cout << "Could not locate child node! Cannot divide branch." << endl;
+    VD_LOG(error, tree) << "Could not locate child node! Cannot divide branch.";
     throw new std::out_of_range("Could not locate child node! Cannot divide branch.");
   } else {
     auto [par_node, child_node] = split_nodes.value();
@@ -667,13 +679,19 @@ void markov::auto_divide(
 void markov::extrude_branch(
   MTree& tree, const Node& root, 
   int node_name, vertex_names params_kept, 
-  const Eigen::MatrixXd& stan_matrix, const std::map<std::string, int>& stan_vars
+  const sample_matrix& stan_matrix, const stan_var_map& stan_vars,
+  bool defer_ered
 ) {
+  tracing::span span("extrude_branch");
+  span.arg("params_kept", params_kept.size());
 
   auto node = locate_node(tree, root, node_name);
 
   string root_name = *tree[root].parameters.begin();
-  double ered = rf_oob_mse(params_kept, root_name, stan_matrix, stan_vars);
+  std::optional<double> ered = nullopt;
+  if(!defer_ered) {
+    ered = rf_oob_mse(params_kept, root_name, stan_matrix, stan_vars);
+  }
   auto name_hash = next_available_id(tree);
 
   Node new_node = add_vertex({
@@ -712,9 +730,10 @@ void markov::merge_nodes(
   MRF mrf, const vertex_names& globals, VertexMap& param_vertices,
   MTree& tree, const Node& root, 
   int node_name, int alt_node_name,
-  const Eigen::MatrixXd& stan_matrix, const std::map<std::string, int>& stan_vars,
-  std::function<float(std::set<std::string>)> LC
+  const sample_matrix& stan_matrix, const stan_var_map& stan_vars,
+  std::function<float(std::set<std::string>)> LC, bool defer_ered
 ) {
+  tracing::span span("merge_nodes");
   auto [node, node_anc] = locate_node_depth_first(tree, root, node_name);
   auto [alt_node, alt_node_anc] = locate_node_depth_first(tree, root, alt_node_name);
 
@@ -726,7 +745,7 @@ void markov::merge_nodes(
 
   for(int ai = node_anc.size(); ai > 0; --ai) {
     Node anc_node = node_anc[ai - 1];
-    cout << "Checking if " << to_string(tree[anc_node].name) << " is a common parent." << endl;
+    VD_LOG(trace, tree) << "Checking if " << tree[anc_node].name << " is a common parent.";
     auto find_res = std::find_if(anb, ane, [&tree, &anc_node](Node alt_node){ 
       return(tree[alt_node].name == tree[anc_node].name); 
     });
@@ -754,7 +773,7 @@ void markov::merge_nodes(
     int name_hash = next_available_id(tree);
     Node new_node = add_vertex({
       .parameters = param_names,
-      .ered = rf_oob_mse(param_names, root_param, stan_matrix, stan_vars),
+      .ered = defer_ered ? nullopt : std::make_optional(rf_oob_mse(param_names, root_param, stan_matrix, stan_vars)),
       .depth = tree[prev_node].depth + 1,
       .chain_nums = {},
       .name = name_hash
@@ -808,9 +827,11 @@ void markov::merge_nodes(
 void markov::auto_merge(
   MRF mrf, const vertex_names& globals, VertexMap& param_vertices,
   MTree& tree, const Node& root, 
-  const Eigen::MatrixXd& stan_matrix, const std::map<std::string, int>& stan_vars,
+  const sample_matrix& stan_matrix, const stan_var_map& stan_vars,
   int merge_depth, std::function<float(std::set<std::string>)> LC
 ) {
+  tracing::span span("auto_merge");
+  span.arg("merge_depth", merge_depth);
   auto leaf_anc = find_leaf_paths(tree, root);
   std::map<int, vector<Node>> node_groups;
   for(const vector<Node> path: leaf_anc) {
@@ -848,16 +869,18 @@ void markov::auto_merge(
     }
   }
 
-  cout << "Merging best pair..." << endl;
+  VD_LOG(debug, tree) << "Merging best pair...";
   merge_nodes(mrf, globals, param_vertices, tree, root, best_node, best_alt_node, stan_matrix, stan_vars, LC);
 }
 
 void markov::auto_merge2(
   MRF mrf, const vertex_names& globals, VertexMap& param_vertices,
   MTree& tree, const Node& root, 
-  const Eigen::MatrixXd& stan_matrix, const std::map<std::string, int>& stan_vars,
-  int merge_depth, std::function<float(std::set<std::string>)> LC
+  const sample_matrix& stan_matrix, const stan_var_map& stan_vars,
+  int merge_depth, std::function<float(std::set<std::string>)> LC, bool defer_ered
 ) {
+  tracing::span span("auto_merge2");
+  span.arg("merge_depth", merge_depth);
 
   string root_param = *tree[root].parameters.begin();
 
@@ -902,9 +925,35 @@ void markov::auto_merge2(
   }
 
   if(best_node != best_alt_node) {
-    merge_nodes(mrf, globals, param_vertices, tree, root, best_node, best_alt_node, stan_matrix, stan_vars, LC);
+    merge_nodes(mrf, globals, param_vertices, tree, root, best_node, best_alt_node, stan_matrix, stan_vars, LC, defer_ered);
   } else {
-    cout << "No eligible mergers!" << endl;
+    VD_LOG(info, tree) << "No eligible mergers!";
+  }
+}
+
+int markov::fill_missing_ereds(
+  MTree& tree, const Node& root,
+  const sample_matrix& stan_matrix, const stan_var_map& stan_vars
+) {
+  vector<Node> missing;
+  auto [vi, vi_end] = vertices(tree);
+  for(; vi != vi_end; ++vi) {
+    if(!tree[*vi].ered) {
+      missing.push_back(*vi);
+    }
+  }
+
+  tracing::span span("fill_missing_ereds");
+  span.arg("fits", missing.size());
+  string root_param = *tree[root].parameters.begin();
+  vector<double> ereds(missing.size());
+  parallel_for(missing.size(), [&](size_t mi) {
+    ereds[mi] = rf_oob_mse(tree[missing[mi]].parameters, root_param, stan_matrix, stan_vars);
+  });
+
+  for(size_t mi = 0; mi < missing.size(); ++mi) {
+    tree[missing[mi]].ered = ereds[mi];
   }
+  return missing.size();
 }
 
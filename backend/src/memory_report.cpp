@@ -0,0 +1,341 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#include <sys/resource.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#include <logging.hpp>
+#include <memory_report.hpp>
+
+using namespace std;
+using json = nlohmann::json;
+
+namespace memory {
+
+  // A node of std::set or std::map, before its value: the color and the
+  // parent and child pointers.
+  static const size_t tree_node_bytes = 4 * sizeof(void*);
+
+  // A node of std::list, before its value.
+  static const size_t list_node_bytes = 2 * sizeof(void*);
+
+  // An edge of an undirected or bidirectional graph: a node of the graph's
+  // edge list holding both ends (and the empty property, padded), and an
+  // entry (other end and edge list position) at each end.
+  static const size_t listed_edge_bytes = list_node_bytes + 3 * sizeof(size_t) + 2 * (sizeof(size_t) + sizeof(void*));
+
+  size_t string_bytes(const string& s) {
+    static const size_t small_capacity = string().capacity();
+    return sizeof(string) + (s.capacity() > small_capacity ? s.capacity() + 1 : 0);
+  }
+
+  size_t names_bytes(const vertex_names& names) {
+    size_t bytes = sizeof(vertex_names);
+    for(const string& name: names) {
+      bytes += tree_node_bytes + string_bytes(name);
+    }
+    return bytes;
+  }
+
+  template<class Vertex>
+  static size_t name_map_bytes(const map<string, Vertex>& names) {
+    size_t bytes = sizeof(names);
+    for(const auto& [name, vertex]: names) {
+      bytes += tree_node_bytes + string_bytes(name) + sizeof(vertex);
+    }
+    return bytes;
+  }
+
+  size_t resident_bytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if(GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+      return counters.WorkingSetSize;
+    }
+    return 0;
+#elif defined(__APPLE__)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if(task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) == KERN_SUCCESS) {
+      return info.resident_size;
+    }
+    return 0;
+#else
+    // The second field is the resident set, in pages.
+    ifstream statm("/proc/self/statm");
+    size_t total_pages, resident_pages;
+    if(statm >> total_pages >> resident_pages) {
+      return resident_pages * sysconf(_SC_PAGESIZE);
+    }
+    return 0;
+#endif
+  }
+
+  size_t anonymous_resident_bytes() {
+#if defined(_WIN32) || defined(__APPLE__)
+    return resident_bytes();
+#else
+    // RssAnon is in kB, and missing before Linux 4.5.
+    ifstream status("/proc/self/status");
+    string line;
+    while(getline(status, line)) {
+      if(line.starts_with("RssAnon:")) {
+        return stoull(line.substr(line.find_first_not_of(" \t", 8))) * 1024;
+      }
+    }
+    return resident_bytes();
+#endif
+  }
+
+  size_t peak_resident_bytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if(GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+      return counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0) {
+      return 0;
+    }
+  #ifdef __APPLE__
+    return usage.ru_maxrss;  // In bytes
+  #else
+    return usage.ru_maxrss * size_t(1024);  // In KiB
+  #endif
+#endif
+  }
+
+  string format_bytes(size_t bytes) {
+    static const char* units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    double value = bytes;
+    int ui = 0;
+    while(value >= 1024 && ui < 4) {
+      value /= 1024;
+      ++ui;
+    }
+    ostringstream formatted;
+    formatted.precision(ui == 0 ? 0 : (value < 10 ? 2 : (value < 100 ? 1 : 0)));
+    formatted << fixed << value << " " << units[ui];
+    return formatted.str();
+  }
+
+  size_t parse_bytes(const string& text) {
+    size_t parsed = 0;
+    double value;
+    try {
+      value = stod(text, &parsed);
+    } catch (const logic_error&) {
+      throw invalid_argument("Not a size: \"" + text + "\".");
+    }
+    string suffix = text.substr(parsed);
+    if(!suffix.empty() && (suffix.back() == 'B' || suffix.back() == 'b')) {
+      suffix.pop_back();
+    }
+    if(suffix.size() == 2 && (suffix[1] == 'i' || suffix[1] == 'I')) {
+      suffix.pop_back();
+    }
+    static const string prefixes = "KMGT";
+    double scale = 1;
+    if(suffix.size() == 1) {
+      size_t pi = prefixes.find(toupper(suffix[0]));
+      if(pi == string::npos) {
+        throw invalid_argument("Unknown size suffix in \"" + text + "\"; use K, M, G or T.");
+      }
+      scale = pow(1024.0, pi + 1);
+    } else if(!suffix.empty()) {
+      throw invalid_argument("Unknown size suffix in \"" + text + "\"; use K, M, G or T.");
+    }
+    if(value <= 0) {
+      throw invalid_argument("Size must be positive: \"" + text + "\".");
+    }
+    return static_cast<size_t>(value * scale);
+  }
+
+  void report::add(string name, size_t bytes, json details) {
+    _entries.push_back({ std::move(name), bytes, std::move(details) });
+  }
+
+  size_t report::total() const {
+    size_t bytes = 0;
+    for(const entry& e: _entries) {
+      bytes += e.bytes;
+    }
+    return bytes;
+  }
+
+  json report::to_json() const {
+    json structures = json::object();
+    for(const entry& e: _entries) {
+      json structure = e.details;
+      structure["bytes"] = e.bytes;
+      structures[e.name] = structure;
+    }
+    return {
+      {"structures", structures},
+      {"total_bytes", total()},
+      {"resident_bytes", resident_bytes()},
+      {"peak_resident_bytes", peak_resident_bytes()}
+    };
+  }
+
+  void report::log() const {
+    vector<const entry*> by_size;
+    for(const entry& e: _entries) {
+      by_size.push_back(&e);
+    }
+    sort(by_size.begin(), by_size.end(), [](const entry* a, const entry* b) { return a->bytes > b->bytes; });
+    for(const entry* e: by_size) {
+      VD_LOG(info, startup) << "Memory: " << e->name << " " << format_bytes(e->bytes) << " " << e->details.dump();
+    }
+    VD_LOG(info, startup) << "Memory: " << format_bytes(total()) << " in these structures, "
+                          << format_bytes(resident_bytes()) << " resident, "
+                          << format_bytes(peak_resident_bytes()) << " at peak.";
+  }
+
+  void add_samples(report& r, const standata& data) {
+    const sample_matrix& samples = *data.samples;
+    size_t value_bytes = samples.precision() == sample_precision::f32 ? sizeof(float) : sizeof(double);
+    size_t matrix_bytes = size_t(samples.rows()) * samples.cols() * value_bytes;
+
+    // Each column map node holds its name, column and cached hash.
+    size_t vars_bytes = sizeof(data.vars) + data.vars.bucket_count() * sizeof(void*);
+    for(const auto& [name, col]: data.vars) {
+      vars_bytes += sizeof(void*) + string_bytes(name) + sizeof(col) + sizeof(size_t);
+    }
+
+    r.add("samples", matrix_bytes + vars_bytes, {
+      {"rows", samples.rows()},
+      {"columns", samples.cols()},
+      {"precision", samples.precision() == sample_precision::f32 ? "f32" : "f64"},
+      {"mapped", data.mapped},
+      {"column_map_bytes", vars_bytes}
+    });
+  }
+
+  // Bytes of the MRF's vertices and edges, without its name map.
+  static size_t mrf_graph_bytes(const MRF& mrf) {
+    size_t bytes = sizeof(MRF) + num_edges(mrf) * listed_edge_bytes;
+    for(auto [vi, vi_end] = vertices(mrf); vi != vi_end; ++vi) {
+      bytes += sizeof(MRF::stored_vertex) + string_bytes(mrf[*vi].name) - sizeof(string);
+    }
+    return bytes;
+  }
+
+  void add_mrf(report& r, const MRF& mrf, const VertexMap& param_vertices) {
+    // Duplicates are edges between the same two parameters as an earlier
+    // edge.
+    vector<pair<Vertex, Vertex>> ends;
+    ends.reserve(num_edges(mrf));
+    for(auto [ei, ei_end] = edges(mrf); ei != ei_end; ++ei) {
+      Vertex u = source(*ei, mrf), v = target(*ei, mrf);
+      ends.emplace_back(min(u, v), max(u, v));
+    }
+    sort(ends.begin(), ends.end());
+    size_t duplicates = ends.size() - (unique(ends.begin(), ends.end()) - ends.begin());
+
+    size_t map_bytes = name_map_bytes(param_vertices);
+    r.add("mrf", mrf_graph_bytes(mrf) + map_bytes, {
+      {"vertices", num_vertices(mrf)},
+      {"edges", num_edges(mrf)},
+      {"duplicate_edges", duplicates},
+      {"duplicate_edge_bytes", duplicates * listed_edge_bytes},
+      {"name_map_bytes", map_bytes}
+    });
+  }
+
+  void add_fg(report& r, const FG& fg, const FG_Map& fg_params, const FG_Map& fg_facs) {
+    size_t graph_bytes = sizeof(FG) + num_edges(fg) * listed_edge_bytes;
+    for(auto [vi, vi_end] = vertices(fg); vi != vi_end; ++vi) {
+      graph_bytes += sizeof(FG::stored_vertex) + string_bytes(fg[*vi].name) - sizeof(string);
+    }
+    size_t map_bytes = name_map_bytes(fg_params) + name_map_bytes(fg_facs);
+    r.add("factor_graph", graph_bytes + map_bytes, {
+      {"parameters", fg_params.size()},
+      {"factors", fg_facs.size()},
+      {"edges", num_edges(fg)},
+      {"name_map_bytes", map_bytes}
+    });
+  }
+
+  void add_tree(report& r, const MTree& tree) {
+    // Vertices of a listS graph are allocated separately and listed by
+    // pointer; edges of a directed one are list nodes holding the target.
+    size_t node_bytes = sizeof(MTree);
+    size_t set_bytes = 0;
+    size_t names = 0;
+    vertex_names distinct_names;
+    for(auto [vi, vi_end] = vertices(tree); vi != vi_end; ++vi) {
+      const MarkovNode& node = tree[*vi];
+      node_bytes += list_node_bytes + sizeof(void*) + sizeof(MTree::stored_vertex)
+                    + node.chain_nums.size() * (tree_node_bytes + sizeof(void*))
+                    + out_degree(*vi, tree) * (list_node_bytes + sizeof(void*));
+      set_bytes += names_bytes(node.parameters) - sizeof(vertex_names);
+      names += node.parameters.size();
+      distinct_names.insert(node.parameters.begin(), node.parameters.end());
+    }
+    r.add("tree", node_bytes, { {"nodes", num_vertices(tree)} });
+    r.add("tree_parameter_sets", set_bytes, {
+      {"names", names},
+      {"distinct_names", distinct_names.size()}
+    });
+  }
+
+  size_t make_tree_bytes(const MRF& mrf, const vector<vertex_names>& leaves) {
+    size_t threads = max(1u, thread::hardware_concurrency());
+    size_t concurrent_chains = min(threads, max<size_t>(leaves.size(), 1));
+    return (1 + 2 * concurrent_chains) * mrf_graph_bytes(mrf);
+  }
+
+  void check_limit(size_t limit, const string& stage, size_t projected) {
+    size_t resident = anonymous_resident_bytes();
+    if(resident + projected <= limit) {
+      return;
+    }
+    ostringstream message;
+    message << "Memory limit of " << format_bytes(limit) << " exceeded " << stage << ": "
+            << format_bytes(resident) << " resident outside file mappings";
+    if(projected > 0) {
+      message << " and " << format_bytes(projected) << " more needed";
+    }
+    message << ". Raise the limit, or reduce the samples' footprint with --single_precision or --out_of_core.";
+    throw runtime_error(message.str());
+  }
+
+  limit_watch::limit_watch(size_t limit, function<void(size_t)> on_exceeded, chrono::milliseconds interval) {
+    _thread = thread([this, limit, on_exceeded, interval]() {
+      unique_lock<mutex> lock(_mutex);
+      while(!_wake.wait_for(lock, interval, [this]() { return _stopping; })) {
+        size_t resident = anonymous_resident_bytes();
+        if(resident > limit) {
+          lock.unlock();
+          on_exceeded(resident);
+          return;
+        }
+      }
+    });
+  }
+
+  limit_watch::~limit_watch() {
+    {
+      lock_guard<mutex> lock(_mutex);
+      _stopping = true;
+    }
+    _wake.notify_all();
+    _thread.join();
+  }
+
+}
@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include <logging.hpp>
+#include <metrics.hpp>
+
+using namespace std;
+using json = nlohmann::json;
+
+namespace metrics {
+
+  static thread_local string thread_operation;
+
+  const string& current_operation() {
+    return thread_operation;
+  }
+
+  operation_scope::operation_scope(string operation): _previous(std::move(thread_operation)) {
+    thread_operation = std::move(operation);
+  }
+
+  operation_scope::~operation_scope() {
+    thread_operation = std::move(_previous);
+  }
+
+  // Metrics are statics of several translation units, so the registry is
+  // created on first use rather than relying on initialization order.
+  static mutex& registry_mutex() {
+    static mutex registry_lock;
+    return registry_lock;
+  }
+
+  static map<string, metric*>& registry() {
+    static map<string, metric*> metrics_by_name;
+    return metrics_by_name;
+  }
+
+  metric::metric(string name, string help): _name(std::move(name)), _help(std::move(help)) {
+    lock_guard<mutex> lock(registry_mutex());
+    registry().emplace(_name, this);
+  }
+
+  static string format_value(double value) {
+    ostringstream formatted;
+    formatted.precision(12);
+    formatted << value;
+    return formatted.str();
+  }
+
+  static string labels(const string& operation, const string& extra = "") {
+    string label_list;
+    if(!operation.empty()) {
+      string escaped;
+      for(char c: operation) {
+        if(c == '\\' || c == '"') {
+          escaped += '\\';
+        }
+        escaped += c;
+      }
+      label_list = "method=\"" + escaped + "\"";
+    }
+    if(!extra.empty()) {
+      label_list += (label_list.empty() ? "" : ",") + extra;
+    }
+    return label_list.empty() ? "" : "{" + label_list + "}";
+  }
+
+  static void write_header(string& out, const metric& m, const char* type) {
+    out += "# HELP " + m.name() + " " + m.help() + "\n";
+    out += "# TYPE " + m.name() + " " + type + "\n";
+  }
+
+  void counter::add(double amount) {
+    lock_guard<mutex> lock(_mutex);
+    _values[current_operation()] += amount;
+  }
+
+  json counter::to_json() const {
+    lock_guard<mutex> lock(_mutex);
+    json series = json::array();
+    for(const auto& [operation, value]: _values) {
+      series.push_back({ {"method", operation}, {"value", value} });
+    }
+    return { {"type", "counter"}, {"help", _help}, {"series", series} };
+  }
+
+  void counter::write_prometheus(string& out) const {
+    write_header(out, *this, "counter");
+    lock_guard<mutex> lock(_mutex);
+    for(const auto& [operation, value]: _values) {
+      out += _name + labels(operation) + " " + format_value(value) + "\n";
+    }
+  }
+
+  const vector<double>& latency_bounds() {
+    static const vector<double> bounds = {
+      0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60
+    };
+    return bounds;
+  }
+
+  histogram::histogram(string name, string help, vector<double> bounds)
+    : metric(std::move(name), std::move(help)), _bounds(std::move(bounds)) {}
+
+  void histogram::observe(double value) {
+    size_t bucket = lower_bound(_bounds.begin(), _bounds.end(), value) - _bounds.begin();
+    lock_guard<mutex> lock(_mutex);
+    series& s = _series[current_operation()];
+    if(s.buckets.empty()) {
+      s.buckets.resize(_bounds.size() + 1);
+    }
+    ++s.buckets[bucket];
+    ++s.count;
+    s.sum += value;
+  }
+
+  // Interpolates within the bucket holding the quantile, as Prometheus'
+  // histogram_quantile does. Values past the last bound report it.
+  static double estimate_quantile(const vector<double>& bounds, const vector<uint64_t>& buckets, uint64_t count, double q) {
+    double rank = q * count;
+    uint64_t below = 0;
+    for(size_t bi = 0; bi < buckets.size(); ++bi) {
+      if(below + buckets[bi] >= rank && buckets[bi] > 0) {
+        if(bi == bounds.size()) {
+          return bounds.empty() ? 0 : bounds.back();
+        }
+        double lower = (bi == 0) ? 0 : bounds[bi - 1];
+        return lower + (bounds[bi] - lower) * (rank - below) / buckets[bi];
+      }
+      below += buckets[bi];
+    }
+    return bounds.empty() ? 0 : bounds.back();
+  }
+
+  json histogram::to_json() const {
+    lock_guard<mutex> lock(_mutex);
+    json all_series = json::array();
+    for(const auto& [operation, s]: _series) {
+      json buckets = json::array();
+      uint64_t cumulative = 0;
+      for(size_t bi = 0; bi < _bounds.size(); ++bi) {
+        cumulative += s.buckets[bi];
+        buckets.push_back({ _bounds[bi], cumulative });
+      }
+      all_series.push_back({
+        {"method", operation},
+        {"count", s.count},
+        {"sum", s.sum},
+        {"p50", estimate_quantile(_bounds, s.buckets, s.count, 0.5)},
+        {"p95", estimate_quantile(_bounds, s.buckets, s.count, 0.95)},
+        {"p99", estimate_quantile(_bounds, s.buckets, s.count, 0.99)},
+        {"buckets", buckets}
+      });
+    }
+    return { {"type", "histogram"}, {"help", _help}, {"series", all_series} };
+  }
+
+  void histogram::write_prometheus(string& out) const {
+    write_header(out, *this, "histogram");
+    lock_guard<mutex> lock(_mutex);
+    for(const auto& [operation, s]: _series) {
+      uint64_t cumulative = 0;
+      for(size_t bi = 0; bi < _bounds.size(); ++bi) {
+        cumulative += s.buckets[bi];
+        out += _name + "_bucket" + labels(operation, "le=\"" + format_value(_bounds[bi]) + "\"") + " " + to_string(cumulative) + "\n";
+      }
+      out += _name + "_bucket" + labels(operation, "le=\"+Inf\"") + " " + to_string(s.count) + "\n";
+      out += _name + "_sum" + labels(operation) + " " + format_value(s.sum) + "\n";
+      out += _name + "_count" + labels(operation) + " " + to_string(s.count) + "\n";
+    }
+  }
+
+  json snapshot() {
+    lock_guard<mutex> lock(registry_mutex());
+    json all = json::object();
+    for(const auto& [name, m]: registry()) {
+      all[name] = m->to_json();
+    }
+    return all;
+  }
+
+  string prometheus_text() {
+    lock_guard<mutex> lock(registry_mutex());
+    string out;
+    for(const auto& [name, m]: registry()) {
+      m->write_prometheus(out);
+    }
+    return out;
+  }
+
+  static void write_file(const string& path) {
+    // Scrapers may read the file at any time, so it is replaced whole.
+    string tmp_path = path + ".tmp";
+    {
+      ofstream file(tmp_path, ios::binary | ios::trunc);
+      file << prometheus_text();
+      if(!file) {
+        VD_LOG(warn, startup) << "Could not write metrics to " << tmp_path << ".";
+        return;
+      }
+    }
+    error_code ec;
+    filesystem::rename(tmp_path, path, ec);
+    if(ec) {
+      VD_LOG(warn, startup) << "Could not replace " << path << ": " << ec.message();
+    }
+  }
+
+  static mutex writer_mutex;
+  static condition_variable writer_wake;
+  static bool writer_stopping = false;
+  static thread writer_thread;
+
+  void start_file_writer(const string& path, chrono::seconds interval) {
+    stop_file_writer();
+    {
+      lock_guard<mutex> lock(writer_mutex);
+      writer_stopping = false;
+    }
+    writer_thread = thread([path, interval]() {
+      unique_lock<mutex> lock(writer_mutex);
+      while(!writer_stopping) {
+        lock.unlock();
+        write_file(path);
+        lock.lock();
+        writer_wake.wait_for(lock, interval, []() { return writer_stopping; });
+      }
+      lock.unlock();
+      write_file(path);
+    });
+    VD_LOG(info, startup) << "Writing metrics to " << path << " every " << interval.count() << " s.";
+  }
+
+  void stop_file_writer() {
+    {
+      lock_guard<mutex> lock(writer_mutex);
+      writer_stopping = true;
+    }
+    writer_wake.notify_all();
+    if(writer_thread.joinable()) {
+      writer_thread.join();
+    }
+  }
+
+}
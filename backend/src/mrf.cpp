@@ -1,6 +1,22 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <future>
 #include <iterator>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <utility>
+
+#ifndef _WIN32
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include <boost/graph/graphviz.hpp>
 #include <boost/graph/adjacency_list.hpp>
@@ -10,19 +26,27 @@
 #include <boost/uuid/uuid_io.hpp>
 #include <nlohmann/json.hpp>
 
+#include <bootstrap.hpp>
 #include <lik_complexity.hpp>
+#include <logging.hpp>
 #include <markov.hpp>
+#include <memory_report.hpp>
+#include <metrics.hpp>
+#include <parallel.hpp>
 #include <ws_client.hpp>
 #include <read_mrf.hpp>
 #include <read_tree_data.hpp>
 #include <read_lik.hpp>
 #include <read_stan.hpp>
+#include <sample_cache.hpp>
 #include <regression.hpp>
 #include <regression_rf.hpp>
 #include <serialize_tree.hpp>
 #include <parse_options.hpp>
 #include <run_model_parser.hpp>
 #include <save_state.hpp>
+#include <session_journal.hpp>
+#include <tracing.hpp>
 
 using namespace std;
 using namespace markov;
@@ -35,18 +59,16 @@ struct InitState {
   std::optional<std::pair<std::unique_ptr<MTree>, Node>> tree;  // populated only for archive
   std::optional<std::string> root_name;   // populated only for files
   std::optional<std::vector<std::set<std::string>>> leaves;  // populated only for files
+  std::optional<derived_state> derived;  // populated only for archives that store it
   std::string sid;
 };
 
 InitState init_from_files(const Config& config) {
-  auto parser_output = run_model_parser(*config.model_file, *config.data_file);
+  auto parser_output = run_model_parser(*config.model_file, *config.data_file, config.parser_cache);
   if (!parser_output) {
     throw std::runtime_error("Failed to parse model files");
   }
-  const auto& [fg_data, tree_data] = *parser_output;
-
-  auto [root_name, leaves] = read_tree_data(tree_data);
-  auto [fg, fg_params, fg_facs] = read_fg(fg_data);
+  auto& [fg, fg_params, fg_facs, root_name, leaves] = *parser_output;
 
   const string& sid = boost::uuids::to_string(boost::uuids::random_generator()());
 
@@ -57,12 +79,13 @@ InitState init_from_files(const Config& config) {
     std::nullopt,  // tree not yet constructed
     root_name,
     leaves,
+    std::nullopt,
     sid
   };
 }
 
 InitState init_from_archive(const std::string& archive_path) {
-  auto [tree, root_node, fg, fg_params, fg_facs, sid] = load_state(archive_path);
+  auto [tree, root_node, fg, fg_params, fg_facs, derived, sid] = load_state(archive_path);
 
   return InitState{
     std::move(fg),
@@ -71,15 +94,152 @@ InitState init_from_archive(const std::string& archive_path) {
     std::make_pair(std::move(tree), root_node),
     std::nullopt,  // no root_name in archive mode
     std::nullopt,   // no leaves in archive mode
+    std::move(derived),
     sid
   };
 }
 
-int main(int argc, char* argv[]) {
+// A method call batch mode makes, and when it was first made if replayed
+// from a session log.
+struct batch_call {
+  std::string method_name;
+  json args;
+  std::optional<double> recorded_at;
+};
 
-  #ifndef NDEBUG
-    std::cout << "Warning: Running in debug mode, performance may be significantly degraded." << std::endl;
-  #endif
+// Reads a batch's operations, e.g. [{"method": "auto_merge", "args": {},
+// "repeat": 3}], as the method calls they make, in order.
+std::vector<batch_call> read_batch_operations(const std::string& path) {
+  std::ifstream ops_file(path);
+  json ops = json::parse(ops_file);
+  if (!ops.is_array()) {
+    throw std::runtime_error(path + " does not hold a list of operations.");
+  }
+  std::vector<batch_call> calls;
+  for (const auto& op : ops) {
+    std::string method_name = op.at("method");
+    if (!has_method(method_name)) {
+      throw std::runtime_error("No method named " + method_name + ".");
+    }
+    int repeat = op.value("repeat", 1);
+    for (int ri = 0; ri < repeat; ++ri) {
+      calls.push_back({ method_name, op.value("args", json::object()), std::nullopt });
+    }
+  }
+  return calls;
+}
+
+// The inputs a session log was recorded against, for replays to check.
+json session_inputs(const Config& config, const std::optional<std::string>& archive_file) {
+  auto optional_path = [](const std::optional<std::string>& path) {
+    return path ? json(*path) : json(nullptr);
+  };
+  return {
+    {"model_file", optional_path(config.model_file)},
+    {"data_file", optional_path(config.data_file)},
+    {"archive_file", optional_path(archive_file)},
+    {"stan_file_prefix", config.stan_file_prefix},
+    {"num_chains", config.num_chains},
+    {"single_precision", config.single_precision}
+  };
+}
+
+// Reads the calls of a session log written by record_methods. Saving the
+// state is skipped, since replaying it would overwrite the archive the
+// session saved.
+std::vector<batch_call> read_session_log(const std::string& path, const json& inputs) {
+  std::ifstream log_file(path);
+  std::string line;
+  if (!std::getline(log_file, line)) {
+    throw std::runtime_error(path + " is empty.");
+  }
+  json header = json::parse(line);
+  for (const auto& [key, value] : inputs.items()) {
+    if (header.at("inputs").value(key, json(nullptr)) != value) {
+      VD_LOG(warn, startup) << "The session was recorded with " << key << " " << header.at("inputs").value(key, json(nullptr)).dump()
+                            << ", not " << value.dump() << "; its calls may not apply.";
+    }
+  }
+
+  // A killed backend can leave the last call partly written, which is
+  // skipped; a malformed call anywhere else is an error.
+  std::vector<batch_call> calls;
+  std::size_t skipped = 0;
+  long line_num = 1;
+  std::optional<long> incomplete_line;
+  while (std::getline(log_file, line)) {
+    ++line_num;
+    if (line.empty()) {
+      continue;
+    }
+    if (incomplete_line) {
+      throw std::runtime_error("Malformed call on line " + std::to_string(*incomplete_line) + " of " + path + ".");
+    }
+    json call = json::parse(line, nullptr, false);
+    if (call.is_discarded()) {
+      incomplete_line = line_num;
+      continue;
+    }
+    std::string method_name = call.at("method");
+    if (method_name == "save_state") {
+      ++skipped;
+      continue;
+    }
+    if (!has_method(method_name)) {
+      throw std::runtime_error("No method named " + method_name + ".");
+    }
+    calls.push_back({ method_name, call.at("args"), call.at("t").get<double>() });
+  }
+  if (incomplete_line) {
+    VD_LOG(warn, startup) << "Ignoring incomplete call on line " << *incomplete_line << " of " << path << ".";
+  }
+  VD_LOG(info, startup) << "Replaying " << calls.size() << " calls from " << path
+                        << (skipped > 0 ? ", skipping " + std::to_string(skipped) + " saves." : ".");
+  return calls;
+}
+
+#ifndef _WIN32
+static int stop_signal_pipe[2] = { -1, -1 };
+
+static void on_stop_signal(int signal_number) {
+  unsigned char number = signal_number;
+  [[maybe_unused]] ssize_t written = write(stop_signal_pipe[1], &number, 1);
+}
+#endif
+
+// The relay is usually stopped with Ctrl-C, which interrupts the backend
+// as well. On SIGINT or SIGTERM, the metrics, trace and log are written out
+// before exiting, by a thread of its own, as little is safe in a signal
+// handler itself. Child processes get the default handlers back on exec.
+static void write_out_on_stop_signals() {
+#ifndef _WIN32
+  if (pipe(stop_signal_pipe) != 0) {
+    VD_LOG(warn, startup) << "Could not handle stop signals: " << std::strerror(errno);
+    return;
+  }
+  fcntl(stop_signal_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(stop_signal_pipe[1], F_SETFD, FD_CLOEXEC);
+  std::thread([]() {
+    unsigned char signal_number;
+    if (read(stop_signal_pipe[0], &signal_number, 1) != 1) {
+      return;
+    }
+    VD_LOG(info, startup) << "Stopping on " << strsignal(signal_number) << ".";
+    metrics::stop_file_writer();
+    tracing::stop();
+    vdlog::flush();
+    std::_Exit(128 + signal_number);
+  }).detach();
+
+  struct sigaction action {};
+  action.sa_handler = on_stop_signal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+#endif
+}
+
+int main(int argc, char* argv[]) {
 
   auto result = parse_options(argc, argv);
   if (!result.config) {
@@ -87,128 +247,801 @@ int main(int argc, char* argv[]) {
   }
   const Config& config = *result.config;
 
-  // Initialize state from either archive or files
-  InitState state;
   try {
-    state = config.archive_file
-      ? init_from_archive(*config.archive_file)
-      : init_from_files(config);
-  } catch (const std::exception& e) {
-    std::cerr << "Initialization failed: " << e.what() << std::endl;
+    vdlog::configure(config.log_spec);
+  } catch (const std::invalid_argument& e) {
+    std::cerr << e.what() << std::endl;
     return 1;
   }
 
-  // Derive quantities needed for tree construction and method handlers
-  const auto likelihood_complexity = get_complexity(state.fg, state.fg_params, state.fg_facs);
-  auto [mrf, param_vertices] = mrf_from_fg(state.fg, state.fg_params, state.fg_facs);
-  auto stan_data = read_stan_file(config.stan_file_prefix, config.num_chains);
+  #ifndef NDEBUG
+    VD_LOG(warn, startup) << "Running in debug mode, performance may be significantly degraded.";
+  #endif
+  write_out_on_stop_signals();
+
+  // With a journal, a snapshot left by an earlier run takes the place of
+  // the archive or model files, and the calls journaled since are replayed
+  // once the handlers are set up.
+  std::optional<session_journal> journal;
+  std::optional<session_journal::contents> journaled;
+  std::optional<std::string> archive_file = config.archive_file;
+  if (config.journal) {
+    journal.emplace(*config.journal);
+    if (std::filesystem::exists(journal->snapshot_path())) {
+      VD_LOG(info, startup) << "Resuming session from snapshot " << journal->snapshot_path() << ".";
+      archive_file = journal->snapshot_path();
+    }
+  }
 
+  // The state handlers use. It is built by the startup tasks at the end of
+  // main, which run while the client is already connected; handlers wait
+  // for startup to finish.
+  InitState state;
+  complexity_index complexity;
+  std::function<float(std::set<std::string>)> likelihood_complexity;
+  MRF mrf;
+  VertexMap param_vertices;
   set<string> global_params = {};
-  // Note: global_adj_r needs root_name. In archive mode, get it from the tree.
   string root_name_for_global;
-  if (state.root_name) {
-    root_name_for_global = *state.root_name;
-  } else {
-    // In archive mode, extract from tree's root node
-    root_name_for_global = to_string(state.tree->first->operator[](state.tree->second).name);
-  }
-  auto global_adj_r = rf_oob_mse(global_params, root_name_for_global, *stan_data.samples, stan_data.vars);
+  set<string> sample_columns;
 
-  // Get or construct tree
+  // Samples can be reloaded while running, so handlers share ownership
+  // with any background fits still using the previous ones. They are read
+  // on first use, which an archive of unchanged samples defers until the
+  // tree is next modified.
+  int num_chains = config.num_chains;
+  const sample_precision precision = config.single_precision ? sample_precision::f32 : sample_precision::f64;
+  // Chains scanned at startup, while the model is parsed; only the first
+  // load uses them.
+  std::shared_ptr<const scanned_chains> scanned;
+  auto read_samples = [&]() {
+    return std::make_shared<standata>(load_samples(config.stan_file_prefix, num_chains, sample_columns,
+      precision, config.sample_cache, config.out_of_core, std::exchange(scanned, nullptr)));
+  };
+  std::shared_ptr<standata> stan_data;
+  std::mutex stan_data_mutex;
+  // Until an archive's unchanged samples are loaded, the fingerprint its
+  // eReds were fit against; hashing the chain files would give that of
+  // whatever is on disk now.
+  std::optional<uint64_t> archived_fingerprint;
+  // Refits every eRed and the global limit, once the samples changed.
+  std::function<void()> refit_all;
+  int sample_generation = 0;
+  auto samples = [&]() {
+    std::lock_guard<std::mutex> lock(stan_data_mutex);
+    if (!stan_data) {
+      stan_data = read_samples();
+      if (archived_fingerprint && stan_data->samples->fingerprint() != *archived_fingerprint) {
+        VD_LOG(warn, samples) << "Samples changed since the archive was opened, refitting every eRed.";
+        post_task(refit_all, method_access::write);
+      }
+      archived_fingerprint.reset();
+    }
+    return stan_data;
+  };
+  auto current_fingerprint = [&]() {
+    std::lock_guard<std::mutex> lock(stan_data_mutex);
+    if (stan_data) {
+      return stan_data->samples->fingerprint();
+    }
+    return archived_fingerprint ? *archived_fingerprint : sample_fingerprint(config.stan_file_prefix, num_chains, precision);
+  };
+  bool samples_unchanged = false;  // Since the archive was saved
+
+  double global_adj_r = 0;
   std::unique_ptr<MTree> mtree;
   Node root_node;
-  if (state.tree) {
-    mtree = std::move(state.tree->first);
-    root_node = state.tree->second;
-  } else {
-    auto [t, r] = make_tree(
-      mrf, *state.root_name, { *state.leaves },
-      global_params, param_vertices,
-      *stan_data.samples, stan_data.vars, likelihood_complexity, 1.01);
-    mtree = std::move(t);
-    root_node = r;
-  }
 
   handle_method("get_tree", [&](json _data){
-    cout << "Sending tree to server..." << endl;
+    VD_LOG(info, ws) << "Sending tree to server...";
     return std::make_optional(serialize_tree(root_node, *mtree, global_params, global_adj_r, state.sid));
-  });
+  }, method_access::read);
+
+  handle_method("metrics", [](json _data){
+    return std::make_optional(json{ {"type", "metrics"}, {"metrics", metrics::snapshot()} }.dump());
+  }, method_access::stateless);
+
+  // Bytes held by each of the large structures. Samples an archive of
+  // unchanged samples has not needed yet are not counted.
+  auto measure_memory = [&]() {
+    memory::report report;
+    {
+      std::lock_guard<std::mutex> lock(stan_data_mutex);
+      if (stan_data) {
+        memory::add_samples(report, *stan_data);
+      }
+    }
+    memory::add_fg(report, state.fg, state.fg_params, state.fg_facs);
+    memory::add_mrf(report, mrf, param_vertices);
+    if (mtree) {
+      memory::add_tree(report, *mtree);
+    }
+    auto [cached_fits, cache_bytes] = rf_cache_usage();
+    report.add("ered_cache", cache_bytes, { {"fits", cached_fits} });
+    return report;
+  };
+
+  handle_method("memory", [&](json _data){
+    return std::make_optional(json{ {"type", "memory"}, {"memory", measure_memory().to_json()} }.dump());
+  }, method_access::read);
+
+  auto write_archive = [&](const std::string& path, bool compress) {
+    derived_state derived { mrf, param_vertices, complexity, root_name_for_global, state.leaves, global_adj_r, current_fingerprint(),
+                            num_chains };
+    save_state(*mtree, root_node, state.fg, state.fg_params, state.fg_facs, derived, state.sid, path, compress);
+  };
 
   handle_method("save_state", [&](json args){
-    cout << "Saving backend state to archive." << endl;
     std::string fname = args.at("fname");
-    cout << fname << endl;
+    bool compress = args.value("compress", true);
+    VD_LOG(info, io) << "Saving backend state to archive " << fname << ".vds.";
+    // Written to a temporary file first, so that a failed save leaves the
+    // previous archive intact.
+    std::string path = fname + ".vds";
+    std::string temp_path = path + ".tmp";
     try {
-      save_state(*mtree, root_node, state.fg, state.fg_params, state.fg_facs, state.sid, fname + ".vds");
-    } catch (std::runtime_error e) {
-      cerr << "Error while attempting to write archive file: " << e.what() << "\n";
+      write_archive(temp_path, compress);
+      std::filesystem::rename(temp_path, path);
+    } catch (const std::runtime_error& e) {
+      VD_LOG(error, io) << "Error while attempting to write archive file: " << e.what();
+      std::error_code ignored;
+      std::filesystem::remove(temp_path, ignored);
       return("{\"type\":\"io\",\"status\":false}");
     }
     return("{\"type\":\"io\",\"status\":true}");
-  });
+  }, method_access::read);
 
-  handle_method("divide_branch", [&](json args) {
+  // Methods that change the tree are journaled once they succeed. Every
+  // journal_compact_calls calls, the journal is compacted into a snapshot
+  // in the background, unless eReds are still being refit, since staleness
+  // is not archived. Compaction runs as a long write task, ordered with the
+  // journaled methods, so that it never falls between a long write
+  // swapping in its tree and the call being journaled; it would snapshot
+  // the edit and then journal it again. For the same reason,
+  // compaction_pending is never accessed by two threads at once.
+  const std::size_t journal_compact_calls = 64;
+  bool compaction_pending = false;
+  std::map<std::string, std::function<std::optional<std::string>(json)>> journaled_methods;
+  auto compact_journal = [&]() {
+    compaction_pending = false;
+    auto [vi, vi_end] = vertices(*mtree);
+    if (std::any_of(vi, vi_end, [&](Node node) { return (*mtree)[node].stale; })) {
+      VD_LOG(debug, io) << "Refits pending, postponing journal compaction.";
+      return;
+    }
+    journal->compact([&](const std::string& path) { write_archive(path, true); });
+  };
+  auto handle_journaled_method = [&](const std::string& method_name, std::function<std::optional<std::string>(json)> handler,
+                                     method_access access = method_access::write) {
+    journaled_methods[method_name] = handler;
+    handle_method(method_name, [&, method_name, handler](json args) {
+      auto reply = handler(args);
+      if (journal) {
+        journal->record_call(method_name, args);
+        if (journal->calls_since_snapshot() >= journal_compact_calls && !compaction_pending) {
+          compaction_pending = true;
+          post_task(compact_journal, method_access::long_write);
+        }
+      }
+      return reply;
+    }, access);
+  };
+
+  // Long writes work on a copy of the tree and swap it in once done, so
+  // that reads such as get_tree are answered meanwhile.
+  auto copy_tree = [&]() {
+    auto tree_copy = std::make_unique<MTree>(*mtree);
+    int root_name = (*mtree)[root_node].name;
+    Node copy_root = *std::find_if(vertices(*tree_copy).first, vertices(*tree_copy).second, [&](Node node) {
+      return (*tree_copy)[node].name == root_name;
+    });
+    return std::make_pair(std::move(tree_copy), copy_root);
+  };
+  auto swap_in_tree = [&](std::unique_ptr<MTree>& new_tree, Node new_root) {
+    apply_exclusively([&]() {
+      mtree = std::move(new_tree);
+      root_node = new_root;
+    });
+  };
+
+  // Tree operations apply to the tree they are given, so that a batch can
+  // run them against a copy. With defer_ered set, nodes they add are left
+  // without an ered for fill_missing_ereds to compute.
+  typedef std::function<void(json, MTree&, const Node&, bool)> tree_operation;
+  std::map<std::string, tree_operation> tree_operations;
+
+  tree_operations["divide_branch"] = [&](json args, MTree& tree, const Node& root, bool defer_ered) {
     int node_name = args.at("node_name");
     set<string> params_kept;
     for(const string& param: args.at("params_kept")) {
       params_kept.insert(param);
     }
-    divide_branch(*mtree, root_node, node_name, params_kept, *stan_data.samples, stan_data.vars);
-    return std::make_optional(serialize_tree(root_node, *mtree, global_params, global_adj_r, std::nullopt));
-  });
+    divide_branch(tree, root, node_name, params_kept, *samples()->samples, samples()->vars, defer_ered);
+  };
 
-  handle_method("auto_divide", [&](json args) {
+  tree_operations["auto_divide"] = [&](json args, MTree& tree, const Node& root, bool /*defer_ered*/) {
     int node_name = args.at("node_name");
-    auto_divide(*mtree, root_node, node_name, *stan_data.samples, stan_data.vars);
-    return std::make_optional(serialize_tree(root_node, *mtree, global_params, global_adj_r, std::nullopt));
-  });
+    auto_divide(tree, root, node_name, *samples()->samples, samples()->vars);
+  };
 
-  handle_method("extrude_branch", [&](json args) {
+  tree_operations["extrude_branch"] = [&](json args, MTree& tree, const Node& root, bool defer_ered) {
     int node_name = args.at("node_name");
     set<string> params_kept;
     for(const string& param: args.at("params_kept")) {
       params_kept.insert(param);
     }
-    extrude_branch(*mtree, root_node, node_name, params_kept, *stan_data.samples, stan_data.vars);
-    return std::make_optional(serialize_tree(root_node, *mtree, global_params, global_adj_r, std::nullopt));
-  });
+    extrude_branch(tree, root, node_name, params_kept, *samples()->samples, samples()->vars, defer_ered);
+  };
 
-  handle_method("delete_node", [&](json args) {
+  tree_operations["delete_node"] = [&](json args, MTree& tree, const Node& root, bool /*defer_ered*/) {
     int node_name = args.at("node_name");
-    delete_node(*mtree, root_node, node_name);
-    return std::make_optional(serialize_tree(root_node, *mtree, global_params, global_adj_r, std::nullopt));
-  });
+    delete_node(tree, root, node_name);
+  };
 
-  handle_method("merge_nodes", [&](json args) {
+  tree_operations["merge_nodes"] = [&](json args, MTree& tree, const Node& root, bool defer_ered) {
     int node_name = args.at("node_name");
     int alt_node_name = args.at("alt_node_name");
-    merge_nodes(mrf, global_params, param_vertices, *mtree, root_node, node_name, alt_node_name, *stan_data.samples, stan_data.vars, likelihood_complexity);
+    merge_nodes(mrf, global_params, param_vertices, tree, root, node_name, alt_node_name, *samples()->samples, samples()->vars, likelihood_complexity, defer_ered);
+  };
+
+  tree_operations["auto_merge"] = [&](json /*args*/, MTree& tree, const Node& root, bool defer_ered) {
+    // auto_merge compares existing eReds, so deferred ones are needed first.
+    fill_missing_ereds(tree, root, *samples()->samples, samples()->vars);
+    auto_merge2(mrf, global_params, param_vertices, tree, root, *samples()->samples, samples()->vars, 1, likelihood_complexity, defer_ered);
+  };
+
+  for(const auto& [op_name, operation]: tree_operations) {
+    handle_journaled_method(op_name, [&, operation](json args) {
+      auto [op_tree, op_root] = copy_tree();
+      operation(args, *op_tree, op_root, false);
+      swap_in_tree(op_tree, op_root);
+      return std::make_optional(serialize_tree(root_node, *mtree, global_params, global_adj_r, std::nullopt));
+    }, method_access::long_write);
+  }
+
+  // Applies an ordered list of tree operations atomically: they run against
+  // a copy of the tree, which replaces the current tree only if all succeed.
+  // The eReds of all added nodes are then fit together, and the final tree
+  // is sent once. A failed batch throws, so it is not journaled, and the
+  // client is sent an error instead of the tree.
+  handle_journaled_method("batch", [&](json args) {
+    auto [batch_tree, batch_root] = copy_tree();
+
+    try {
+      for(const json& op: args.at("ops")) {
+        std::string op_name = op.at("method");
+        tree_operations.at(op_name)(op.at("args"), *batch_tree, batch_root, true);
+      }
+      int num_fits = fill_missing_ereds(*batch_tree, batch_root, *samples()->samples, samples()->vars);
+      VD_LOG(info, tree) << "Batch computed " << num_fits << " eReds.";
+      swap_in_tree(batch_tree, batch_root);
+    } catch (const std::exception& err) {
+      throw std::runtime_error("Batch failed, tree left unchanged: " + std::string(err.what()));
+    } catch (...) {
+      throw std::runtime_error("Batch failed, tree left unchanged.");
+    }
     return std::make_optional(serialize_tree(root_node, *mtree, global_params, global_adj_r, std::nullopt));
-  });
+  }, method_access::long_write);
+
+  // Refits every stale node in the background, then applies the results
+  // to nodes that still exist with the same parameters and sends the tree.
+  // Results are dropped if the samples were reloaded again meanwhile.
+  auto refit_stale_nodes = [&]() {
+    struct refit { int name; vertex_names parameters; double ered; };
+    std::vector<refit> refits;
+    auto [vi, vi_end] = vertices(*mtree);
+    for(; vi != vi_end; ++vi) {
+      if((*mtree)[*vi].stale) {
+        refits.push_back({ (*mtree)[*vi].name, (*mtree)[*vi].parameters, 0 });
+      }
+    }
+    string root_param = *(*mtree)[root_node].parameters.begin();
+
+    post_task([&, refits, root_param, data = samples(), generation = sample_generation]() mutable {
+      VD_LOG(info, tree) << "Refitting " << refits.size() << " stale eReds in the background.";
+      parallel_for(refits.size(), [&](size_t ri) {
+        refits[ri].ered = rf_oob_mse(refits[ri].parameters, root_param, *data->samples, data->vars);
+      });
+
+      post_task([&, refits = std::move(refits), generation]() {
+        if(generation != sample_generation) {
+          VD_LOG(debug, tree) << "Samples reloaded during refit, dropping results.";
+          return;
+        }
+        std::map<int, const refit*> by_name;
+        for(const refit& r: refits) {
+          by_name[r.name] = &r;
+        }
+        auto [vi, vi_end] = vertices(*mtree);
+        for(; vi != vi_end; ++vi) {
+          MarkovNode& node = (*mtree)[*vi];
+          auto found = by_name.find(node.name);
+          if(node.stale && found != by_name.end() && found->second->parameters == node.parameters) {
+            node.ered = found->second->ered;
+            node.stale = false;
+          }
+        }
+        VD_LOG(info, tree) << "Refitted stale eReds.";
+        send_to_server(serialize_tree(root_node, *mtree, global_params, global_adj_r, std::nullopt));
+      }, method_access::write);
+    });
+  };
+
+  auto mark_all_stale = [&]() {
+    auto [vi, vi_end] = vertices(*mtree);
+    for(; vi != vi_end; ++vi) {
+      (*mtree)[*vi].stale = true;
+      (*mtree)[*vi].ered_interval.reset();
+    }
+    refit_stale_nodes();
+  };
+
+  // Runs as a write task, after samples() first loaded samples that differ
+  // from those an archive's eReds were fit against.
+  refit_all = [&]() {
+    ++sample_generation;
+    global_adj_r = rf_oob_mse(global_params, root_name_for_global, *samples()->samples, samples()->vars);
+    mark_all_stale();
+    send_to_server(serialize_tree(root_node, *mtree, global_params, global_adj_r, std::nullopt));
+  };
+
+  // Rereads the Stan output, which may have gained draws or, if num_chains
+  // is given, chains. The tree is kept; if the samples changed, every eRed
+  // is marked stale and refit in the background. The new draws and the
+  // global limit are read and fit under the shared lock, so that reads are
+  // answered meanwhile, and only swapped in exclusively. Draws already
+  // loaded are kept, and only those the chains gained are parsed.
+  handle_journaled_method("reload_samples", [&](json args) {
+    int new_num_chains = args.value("num_chains", num_chains);
+    uint64_t old_fingerprint = current_fingerprint();
+    if(new_num_chains == num_chains
+       && sample_fingerprint(config.stan_file_prefix, num_chains, precision) == old_fingerprint) {
+      VD_LOG(info, samples) << "Samples unchanged, keeping eReds.";
+      return std::make_optional(serialize_tree(root_node, *mtree, global_params, global_adj_r, std::nullopt));
+    }
+
+    std::shared_ptr<standata> previous;
+    {
+      std::lock_guard<std::mutex> lock(stan_data_mutex);
+      previous = stan_data;
+    }
+    auto new_data = std::make_shared<standata>(previous
+      ? reload_samples(*previous, config.stan_file_prefix, new_num_chains, sample_columns,
+                       precision, config.sample_cache, config.out_of_core)
+      : load_samples(config.stan_file_prefix, new_num_chains, sample_columns,
+                     precision, config.sample_cache, config.out_of_core));
+    double new_adj_r = rf_oob_mse(global_params, root_name_for_global, *new_data->samples, new_data->vars);
+
+    apply_exclusively([&]() {
+      {
+        std::lock_guard<std::mutex> lock(stan_data_mutex);
+        stan_data = new_data;
+        archived_fingerprint.reset();
+      }
+      num_chains = new_num_chains;
+      ++sample_generation;
+      global_adj_r = new_adj_r;
+      if(new_data->samples->fingerprint() == old_fingerprint) {
+        VD_LOG(info, samples) << "Samples unchanged, keeping eReds.";
+      } else {
+        VD_LOG(info, samples) << "Samples changed, refitting every eRed.";
+        retain_rf_cache(new_data->samples->fingerprint());
+        mark_all_stale();
+      }
+    });
+    return std::make_optional(serialize_tree(root_node, *mtree, global_params, global_adj_r, std::nullopt));
+  }, method_access::long_write);
+
+  // Computes bootstrap intervals for the eReds of the given nodes (all
+  // nodes by default) in the background, then sends the tree with them.
+  // args: num_replicates (default 50), level (default 0.9), seed, and
+  // node_names.
+  handle_method("bootstrap", [&](json args) {
+    int num_replicates = args.value("num_replicates", 50);
+    double level = args.value("level", 0.9);
+    uint64_t seed = args.value("seed", uint64_t(1));
+    std::optional<std::set<int>> node_names;
+    if(args.contains("node_names")) {
+      node_names = args.at("node_names").get<std::set<int>>();
+    }
+
+    std::vector<int> names;
+    std::vector<vertex_names> parameter_sets;
+    auto [vi, vi_end] = vertices(*mtree);
+    for(; vi != vi_end; ++vi) {
+      if(!node_names || node_names->count((*mtree)[*vi].name) > 0) {
+        names.push_back((*mtree)[*vi].name);
+        parameter_sets.push_back((*mtree)[*vi].parameters);
+      }
+    }
+    string root_param = *(*mtree)[root_node].parameters.begin();
+
+    post_task([&, names, parameter_sets, root_param, num_replicates, level, seed,
+               data = samples(), generation = sample_generation]() {
+      auto intervals = bootstrap_ereds(parameter_sets, root_param, *data->samples, data->vars,
+                                       num_replicates, level, seed);
+
+      post_task([&, names, parameter_sets, intervals, generation]() {
+        if(generation != sample_generation) {
+          VD_LOG(debug, tree) << "Samples reloaded during bootstrap, dropping results.";
+          return;
+        }
+        std::map<int, size_t> index_of;
+        for(size_t ni = 0; ni < names.size(); ++ni) {
+          index_of[names[ni]] = ni;
+        }
+        auto [vi, vi_end] = vertices(*mtree);
+        for(; vi != vi_end; ++vi) {
+          MarkovNode& node = (*mtree)[*vi];
+          auto found = index_of.find(node.name);
+          if(found != index_of.end() && parameter_sets[found->second] == node.parameters) {
+            node.ered_interval = intervals[found->second];
+          }
+        }
+        VD_LOG(info, tree) << "Bootstrapped " << names.size() << " eReds.";
+        send_to_server(serialize_tree(root_node, *mtree, global_params, global_adj_r, std::nullopt));
+      }, method_access::write);
+    });
 
-  handle_method("auto_merge", [&](json args) {
-    auto_merge2(mrf, global_params, param_vertices, *mtree, root_node, *stan_data.samples, stan_data.vars, 1, likelihood_complexity);
     return std::make_optional(serialize_tree(root_node, *mtree, global_params, global_adj_r, std::nullopt));
   });
 
-  handle_method("reset_tree", [&](json args) {
+  handle_journaled_method("reset_tree", [&](json args) {
     if (!state.root_name || !state.leaves) {
-      std::cerr << "reset_tree is not available when loaded from archive" << std::endl;
+      VD_LOG(warn, tree) << "reset_tree is not available for archives that do not store the tree's leaves";
       return std::make_optional(serialize_tree(root_node, *mtree, global_params, global_adj_r, std::nullopt));
     }
     auto init_tree = make_tree(
       mrf, *state.root_name, *state.leaves,
       global_params, param_vertices,
-      *stan_data.samples, stan_data.vars, likelihood_complexity, 1);
-    mtree = std::move(init_tree.first);
-    root_node = init_tree.second;
+      *samples()->samples, samples()->vars, likelihood_complexity, 1);
+    swap_in_tree(init_tree.first, init_tree.second);
     return std::make_optional(serialize_tree(root_node, *mtree, global_params, global_adj_r, std::nullopt));
+  }, method_access::long_write);
+
+  if (config.metrics_file) {
+    metrics::start_file_writer(*config.metrics_file);
+  }
+  if (config.trace_file) {
+    tracing::start(*config.trace_file);
+  }
+
+  // With a memory limit, startup checks the resident set, less mapped
+  // files, whose pages the OS can drop, after each stage that allocates
+  // much and before building the tree, whose needs are projected, and is
+  // watched in between. The limit covers startup only: the fit cache and
+  // background fits may grow past it afterwards, and ranger's memory, in
+  // its own processes, is never counted.
+  auto check_memory = [&](const std::string& stage, std::size_t projected = 0) {
+    if (config.memory_limit) {
+      memory::check_limit(*config.memory_limit, stage, projected);
+    }
+  };
+
+  // Batch mode calls methods itself once startup has finished, instead of
+  // connecting to the server, then writes the tree and exits.
+  // Replays are of session logs recorded with --record.
+  std::vector<batch_call> batch_calls;
+  if (config.batch && config.batch->ops_file) {
+    try {
+      batch_calls = read_batch_operations(*config.batch->ops_file);
+    } catch (const std::exception& e) {
+      VD_LOG(error, startup) << "Could not read batch operations from " << *config.batch->ops_file << ": " << e.what();
+      return 1;
+    }
+  }
+  if (config.batch && config.batch->replay_file) {
+    try {
+      batch_calls = read_session_log(*config.batch->replay_file, session_inputs(config, archive_file));
+    } catch (const std::exception& e) {
+      VD_LOG(error, startup) << "Could not read session log " << *config.batch->replay_file << ": " << e.what();
+      return 1;
+    }
+  }
+  if (config.record_file && !config.batch) {
+    try {
+      record_methods(*config.record_file, {
+        {"started", std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count()},
+        {"inputs", session_inputs(config, archive_file)}
+      });
+    } catch (const std::exception& e) {
+      VD_LOG(error, startup) << e.what();
+      return 1;
+    }
+  }
+
+  std::promise<void> startup_done;
+  hold_methods_until(startup_done.get_future().share());
+  std::atomic<bool> ws_stopped = false;
+  std::thread ws_thread;
+  if (config.batch) {
+    initialize_method_pool();
+  } else {
+    initialize_ws_client("localhost", config.ws_port, config.compress_threshold);
+    ws_thread = std::thread([&]() {
+      start_ws_client();
+      ws_stopped = true;
+    });
+  }
+
+  // Startup tasks run concurrently where they do not depend on each other.
+  // Only parsing the samples waits for the model, to learn which columns to
+  // load; the chains are mapped and scanned meanwhile.
+  // Every change of a task's state is sent to the server.
+  task_graph startup;
+  startup.on_change([](const std::vector<task_graph::task_status>& statuses) {
+    json stages = json::array();
+    for (const auto& status : statuses) {
+      stages.push_back({ {"name", status.name}, {"state", task_state_name(status.state)}, {"seconds", status.seconds} });
+    }
+    send_to_server(json{ {"type", "status"}, {"stages", stages} }.dump(), false);
+  });
+
+  startup.add("model", {}, [&]() {
+    state = archive_file
+      ? init_from_archive(*archive_file)
+      : init_from_files(config);
+    if (state.derived) {
+      state.root_name = state.derived->root_name;
+      state.leaves = state.derived->leaves;
+      // Samples reloaded with more chains stay so in a resumed session.
+      if (state.derived->num_chains && *state.derived->num_chains != num_chains) {
+        VD_LOG(info, startup) << "Using the archive's " << *state.derived->num_chains << " chains.";
+        num_chains = *state.derived->num_chains;
+      }
+    }
+
+    // Note: global_adj_r needs root_name. In archive mode, get it from the tree.
+    if (state.root_name) {
+      root_name_for_global = *state.root_name;
+    } else {
+      // In archive mode, extract from tree's root node
+      root_name_for_global = *(*state.tree->first)[state.tree->second].parameters.begin();
+    }
+
+    // Only the root and the factor graph's parameters can ever be fit, so
+    // every other Stan column is skipped while loading.
+    sample_columns = { root_name_for_global };
+    for (const auto& [param_name, param_vertex]: state.fg_params) {
+      sample_columns.insert(param_name);
+    }
+
+    if (journal) {
+      journaled = journal->read();
+      if (journaled) {
+        VD_LOG(info, startup) << "Journal has " << journaled->calls.size() << " calls and "
+                              << journaled->fits.size() << " fits to replay.";
+        for (const auto& [key, ered] : journaled->fits) {
+          seed_rf_cache(key, ered);
+        }
+      }
+      journal->open();
+      set_rf_fit_observer([&](const std::string& key, double ered) { journal->record_fit(key, ered); });
+    }
+    check_memory("after reading the model");
+  });
+
+  // Derive quantities needed for tree construction and method handlers.
+  // Archives store them, along with the root and leaves they came from.
+  startup.add("complexity", {"model"}, [&]() {
+    complexity = state.derived
+      ? state.derived->complexity
+      : index_complexity(state.fg, state.fg_params, state.fg_facs);
+    likelihood_complexity = get_complexity(complexity);
+  });
+
+  startup.add("mrf", {"model"}, [&]() {
+    if (state.derived) {
+      mrf = std::move(state.derived->mrf);
+      param_vertices = std::move(state.derived->param_vertices);
+    } else {
+      std::tie(mrf, param_vertices) = mrf_from_fg(state.fg, state.fg_params, state.fg_facs);
+    }
+    check_memory("after building the MRF");
+  });
+
+  // An archive's samples are usually unchanged and never loaded, and a
+  // current sample cache needs no CSVs, so neither is scanned ahead.
+  startup.add("chains", {}, [&]() {
+    if (archive_file || (config.sample_cache && sample_cache_current(config.stan_file_prefix, num_chains))) {
+      return;
+    }
+    scanned = scan_stan_files(config.stan_file_prefix, num_chains);
+  });
+
+  startup.add("samples", {"model", "chains"}, [&]() {
+    if (state.derived && state.derived->sample_fingerprint == current_fingerprint()) {
+      VD_LOG(info, startup) << "Samples unchanged since the archive was saved, reusing its derived state.";
+      samples_unchanged = true;
+      std::lock_guard<std::mutex> lock(stan_data_mutex);
+      archived_fingerprint = state.derived->sample_fingerprint;
+      return;
+    }
+    if (state.derived) {
+      VD_LOG(warn, startup) << "Samples have changed since the archive was saved; its eReds may be out of date.";
+    }
+    samples();
+    check_memory("after loading the samples");
   });
 
-  initialize_ws_client("localhost", config.ws_port);
-  start_ws_client();
+  startup.add("global_limit", {"samples"}, [&]() {
+    global_adj_r = samples_unchanged
+      ? state.derived->global_adj_r
+      : rf_oob_mse(global_params, root_name_for_global, *samples()->samples, samples()->vars);
+  });
+
+  // Get or construct tree
+  startup.add("tree", {"complexity", "mrf", "samples"}, [&]() {
+    if (state.tree) {
+      mtree = std::move(state.tree->first);
+      root_node = state.tree->second;
+    } else {
+      check_memory("before building the tree", memory::make_tree_bytes(mrf, *state.leaves));
+      auto [t, r] = make_tree(
+        mrf, *state.root_name, { *state.leaves },
+        global_params, param_vertices,
+        *samples()->samples, samples()->vars, likelihood_complexity, 1.01);
+      mtree = std::move(t);
+      root_node = r;
+    }
+  });
+
+  // Replaying runs as a write task, so that it is ordered with the
+  // background tasks the calls start. Fits the calls made were seeded
+  // above.
+  startup.add("journal", {"tree", "global_limit"}, [&]() {
+    if (!journaled || journaled->calls.empty()) {
+      return;
+    }
+    std::promise<void> replayed;
+    post_task([&]() {
+      try {
+        VD_LOG(info, startup) << "Replaying " << journaled->calls.size() << " journaled calls.";
+        for (const auto& [method_name, args] : journaled->calls) {
+          journaled_methods.at(method_name)(args);
+        }
+        journaled.reset();
+        replayed.set_value();
+      } catch (...) {
+        replayed.set_exception(std::current_exception());
+      }
+    }, method_access::write);
+    replayed.get_future().get();
+  });
+
+  std::optional<memory::limit_watch> memory_watch;
+  if (config.memory_limit) {
+    memory_watch.emplace(*config.memory_limit, [&](std::size_t resident) {
+      VD_LOG(error, startup) << "Initialization failed: memory limit of " << memory::format_bytes(*config.memory_limit)
+                             << " exceeded, with " << memory::format_bytes(resident) << " resident outside file mappings. Raise the limit, "
+                             << "or reduce the samples' footprint with --single_precision or --out_of_core.";
+      metrics::stop_file_writer();
+      tracing::stop();
+      vdlog::flush();
+      std::_Exit(1);
+    });
+  }
+
+  try {
+    startup.run();
+  } catch (const std::exception& e) {
+    VD_LOG(error, startup) << "Initialization failed: " << e.what();
+    startup_done.set_exception(std::current_exception());
+    // The client may not have started yet, in which case stopping it has
+    // no effect, so stop it until it has.
+    while (ws_thread.joinable() && !ws_stopped) {
+      stop_ws_client();
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    memory_watch.reset();
+    if (ws_thread.joinable()) {
+      ws_thread.join();
+    }
+    metrics::stop_file_writer();
+    tracing::stop();
+    vdlog::flush();
+    return 1;
+  }
+  memory_watch.reset();
+  startup_done.set_value();
+  VD_LOG(info, startup) << "Startup finished.";
+  post_task([&]() { measure_memory().log(); }, method_access::read);
+
+  if (config.batch) {
+    // Each call is timed as the interface would wait for it: background
+    // tasks it posts run on, alongside the calls that follow.
+    int status = 0;
+    json steps = json::array();
+    std::size_t num_failed = 0;
+    for (std::size_t ci = 0; ci < batch_calls.size(); ++ci) {
+      const batch_call& call = batch_calls[ci];
+      auto call_start = std::chrono::steady_clock::now();
+      std::optional<std::string> error;
+      try {
+        invoke_method(call.method_name, call.args);
+      } catch (const std::exception& e) {
+        error = e.what();
+      } catch (...) {
+        error = "unknown error";
+      }
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - call_start).count();
+      json step = { {"method", call.method_name}, {"recorded_at", call.recorded_at ? json(*call.recorded_at) : json(nullptr)},
+                    {"seconds", seconds} };
+      if (!error) {
+        VD_LOG(info, startup) << "Batch: " << call.method_name << " (" << ci + 1 << " of " << batch_calls.size()
+                              << ") took " << seconds << " s.";
+      } else if (config.batch->replay_file) {
+        // A replay goes on past calls that fail, as they may have in the
+        // session, and reports them with the rest.
+        VD_LOG(warn, startup) << "Batch: " << call.method_name << " (" << ci + 1 << " of " << batch_calls.size()
+                              << ") failed after " << seconds << " s: " << *error;
+        step["error"] = *error;
+        ++num_failed;
+      } else {
+        VD_LOG(error, startup) << "Batch failed: " << *error;
+        status = 1;
+        break;
+      }
+      steps.push_back(step);
+    }
+    // Refits and other tasks the calls posted finish before the tree is
+    // written.
+    wait_for_tasks();
+    const std::string& out_prefix = config.batch->out_prefix;
+    if (config.batch->replay_file) {
+      std::vector<std::size_t> slowest(steps.size());
+      std::iota(slowest.begin(), slowest.end(), 0);
+      std::sort(slowest.begin(), slowest.end(), [&](std::size_t a, std::size_t b) {
+        return steps[a]["seconds"].get<double>() > steps[b]["seconds"].get<double>();
+      });
+      double total_seconds = 0;
+      for (const auto& step : steps) {
+        total_seconds += step["seconds"].get<double>();
+      }
+      VD_LOG(info, startup) << "Replayed " << steps.size() << " calls in " << total_seconds << " s, "
+                            << num_failed << " of which failed.";
+      for (std::size_t si = 0; si < std::min<std::size_t>(slowest.size(), 5); ++si) {
+        VD_LOG(info, startup) << "  Step " << slowest[si] + 1 << ", " << steps[slowest[si]]["method"].get<std::string>()
+                              << ": " << steps[slowest[si]]["seconds"].get<double>() << " s";
+      }
+      std::ofstream report_file(out_prefix + ".replay.json", std::ios::binary | std::ios::trunc);
+      report_file << json{
+        {"session_log", *config.batch->replay_file},
+        {"completed", status == 0},
+        {"failed", num_failed},
+        {"total_seconds", total_seconds},
+        {"steps", steps}
+      }.dump(2) << "\n";
+      if (!report_file) {
+        VD_LOG(error, io) << "Could not write " << out_prefix << ".replay.json.";
+        status = 1;
+      }
+    }
+    if (status == 0) {
+      try {
+        std::ofstream tree_file(out_prefix + ".json", std::ios::binary | std::ios::trunc);
+        tree_file << serialize_tree(root_node, *mtree, global_params, global_adj_r, state.sid);
+        if (!tree_file) {
+          throw std::runtime_error("Could not write " + out_prefix + ".json.");
+        }
+        write_archive(out_prefix + ".vds", true);
+        VD_LOG(info, io) << "Wrote the tree to " << out_prefix << ".json and the session to " << out_prefix << ".vds.";
+      } catch (const std::exception& e) {
+        VD_LOG(error, io) << "Batch failed: " << e.what();
+        status = 1;
+      }
+    }
+    metrics::stop_file_writer();
+    tracing::stop();
+    vdlog::flush();
+    return status;
+  }
+
+  ws_thread.join();
+  metrics::stop_file_writer();
+  tracing::stop();
 
-  cout << "WS client start called." << endl;
+  VD_LOG(info, ws) << "WS client stopped.";
 
   return 0;
 }
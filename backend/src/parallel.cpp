@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <metrics.hpp>
+#include <parallel.hpp>
+#include <tracing.hpp>
+
+using namespace std;
+
+// 0 outside parallel_for workers, which may use every hardware thread.
+static thread_local unsigned worker_threads = 0;
+
+unsigned available_threads() {
+  return worker_threads > 0 ? worker_threads : max(1u, thread::hardware_concurrency());
+}
+
+void parallel_for(size_t n, const function<void(size_t)>& body, unsigned max_threads) {
+  unsigned available = available_threads();
+  if(max_threads == 0) {
+    max_threads = available;
+  }
+  size_t num_threads = min<size_t>(max_threads, n);
+  if(num_threads <= 1) {
+    for(size_t i = 0; i < n; ++i) {
+      body(i);
+    }
+    return;
+  }
+
+  atomic<size_t> next_index = 0;
+  exception_ptr first_error = nullptr;
+  mutex error_mutex;
+
+  // Workers record metrics against the caller's operation.
+  const string operation = metrics::current_operation();
+  const unsigned share = max<unsigned>(1, available / num_threads);
+  auto worker = [&]() {
+    metrics::operation_scope scope(operation);
+    worker_threads = share;
+    for(size_t i = next_index++; i < n; i = next_index++) {
+      try {
+        body(i);
+      } catch (...) {
+        lock_guard<mutex> lock(error_mutex);
+        if(!first_error) {
+          first_error = current_exception();
+        }
+      }
+    }
+  };
+
+  vector<thread> threads;
+  threads.reserve(num_threads);
+  for(size_t ti = 0; ti < num_threads; ++ti) {
+    threads.emplace_back(worker);
+  }
+  for(auto& t: threads) {
+    t.join();
+  }
+
+  if(first_error) {
+    rethrow_exception(first_error);
+  }
+}
+
+void task_graph::add(string name, vector<string> dependencies, function<void()> task) {
+  vector<size_t> dependency_indices;
+  for(const string& dependency: dependencies) {
+    auto found = find_if(_statuses.begin(), _statuses.end(), [&](const task_status& status) {
+      return status.name == dependency;
+    });
+    if(found == _statuses.end()) {
+      throw invalid_argument("Task " + name + " depends on unknown task " + dependency + ".");
+    }
+    dependency_indices.push_back(found - _statuses.begin());
+  }
+  _tasks.push_back({ std::move(dependency_indices), std::move(task) });
+  _statuses.push_back({ std::move(name) });
+}
+
+void task_graph::on_change(function<void(const vector<task_status>&)> callback) {
+  _on_change = std::move(callback);
+}
+
+void task_graph::set_state(size_t ti, task_state state, double seconds) {
+  lock_guard<mutex> lock(_mutex);
+  _statuses[ti].state = state;
+  _statuses[ti].seconds = seconds;
+  if(_on_change) {
+    _on_change(_statuses);
+  }
+}
+
+void task_graph::run() {
+  vector<shared_future<void>> finished;
+  finished.reserve(_tasks.size());
+  for(size_t ti = 0; ti < _tasks.size(); ++ti) {
+    finished.push_back(async(launch::async, [this, ti, &finished]() {
+      try {
+        for(size_t dependency: _tasks[ti].dependencies) {
+          finished[dependency].get();
+        }
+      } catch (...) {
+        set_state(ti, task_state::skipped);
+        throw;
+      }
+      set_state(ti, task_state::running);
+      auto start = chrono::steady_clock::now();
+      try {
+        tracing::span span("startup " + _statuses[ti].name);
+        _tasks[ti].run();
+      } catch (...) {
+        set_state(ti, task_state::failed);
+        throw;
+      }
+      set_state(ti, task_state::done, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }).share());
+  }
+
+  // Dependencies are added before the tasks that need them, so the first
+  // task to throw in this order is one that failed rather than skipped.
+  exception_ptr first_error = nullptr;
+  for(auto& task_finished: finished) {
+    try {
+      task_finished.get();
+    } catch (...) {
+      if(!first_error) {
+        first_error = current_exception();
+      }
+    }
+  }
+  if(first_error) {
+    rethrow_exception(first_error);
+  }
+}
+
+const char* task_state_name(task_graph::task_state state) {
+  switch(state) {
+    case task_graph::task_state::waiting: return "waiting";
+    case task_graph::task_state::running: return "running";
+    case task_graph::task_state::done: return "done";
+    case task_graph::task_state::failed: return "failed";
+    case task_graph::task_state::skipped: return "skipped";
+  }
+  return "unknown";
+}
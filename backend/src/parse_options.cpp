@@ -3,21 +3,49 @@
 
 #include <boost/program_options.hpp>
 
+#include <memory_report.hpp>
 #include <parse_options.hpp>
+#include <read_stan.hpp>
 
 namespace options = boost::program_options;
 using namespace std;
 
 ParseResult parse_options(int argc, char* argv[]) {
+  // "batch" as the first argument builds the tree without a client. Past
+  // it, the arguments parse as usual, with it in place of the program name.
+  const bool batch = argc > 1 && string(argv[1]) == "batch";
+  if (batch) {
+    --argc;
+    ++argv;
+  }
+
   options::options_description ops_desc("Command line options.");
   auto ops = ops_desc.add_options();
   ops("help", "print this help message")
   ("model_file,M", options::value<string>(), "specify the model file (required unless -A is set)")
   ("data_file,D", options::value<string>(), "specify the data file (required unless -A is set)")
   ("archive,A", options::value<string>(), "load state from archive file (alternative to -M and -D)")
-  ("stan_file_prefix,S", options::value<string>()->required(), "specify the prefix of Stan's MCMC output CSV files")
+  ("stan_file_prefix,S", options::value<string>()->required(), "specify the prefix of Stan's MCMC output CSV files, which are read from <prefix><chain>.csv or <prefix><chain>.csv.gz")
   ("num_chains,N", options::value<int>()->required(), "specify the number of MCMC chains, i.e. the number of MCMC CSV files to read")
-  ("port,P", options::value<int>()->default_value(8765), "specify the WebSocket server port (default: 8765)");
+  ("port,P", options::value<int>()->default_value(8765), "specify the WebSocket server port (default: 8765)")
+  ("compress_threshold", options::value<size_t>(), "zlib-compress outgoing WebSocket messages larger than this many bytes (default: no compression)")
+  ("no_sample_cache", "always parse the Stan CSV files instead of using or writing the binary sample cache <stan_file_prefix>.vdcache")
+  ("no_parser_cache", "always run the model parser instead of reusing its output from .vd-parser-cache next to the model file")
+  ("single_precision", "store posterior draws as 32-bit floats, halving the memory used by the sample matrix; fits still compute in double precision")
+  ("out_of_core", "never hold all posterior draws in memory: stream the Stan CSV files into a chunked sample cache on disk and read only the columns each fit needs")
+  ("journal", options::value<string>(), "journal every change to the session to <path>.vdj, compacting it into the snapshot <path>.vds in the background; if that snapshot exists, the session is resumed from it and the journal replayed")
+  ("metrics_file", options::value<string>(), "write timings and counters of websocket methods, chain searches, eRed fits and serialization to this file every 10 seconds, in the Prometheus text format")
+  ("trace", options::value<string>(), "record nested spans of methods, tree operations, chain searches and fits, and write them to this file on exit as a Chrome trace (open in ui.perfetto.dev or chrome://tracing)")
+  ("record", options::value<string>(), "record every method message received, with the time it arrived, to this session log, one JSON object per line, for replaying with backend batch --replay")
+  ("memory_limit", options::value<string>(), "fail startup with a clear message, rather than be killed by the OS, if the resident memory, not counting mapped files such as the sample cache, exceeds or is about to exceed this size, e.g. 16G or 512M; not enforced once startup has finished, nor on ranger's processes")
+  ("log", options::value<string>()->default_value("info"), "log levels (trace, debug, info, warn, error, off), either one level or per category, e.g. \"warn,rf=debug\". Categories: startup, ws, tree, chain, rf, samples, parser, io");
+
+  options::options_description batch_desc("Batch options, for backend batch [options].");
+  batch_desc.add_options()
+  ("out", options::value<string>(), "build the tree, run any --ops on it, write it to <out>.json and the session to the archive <out>.vds, and exit")
+  ("ops", options::value<string>(), "JSON file of methods to call once the tree is built, in order, with the arguments the interface sends, e.g. [{\"method\": \"auto_merge\", \"args\": {}, \"repeat\": 3}, {\"method\": \"auto_divide\", \"args\": {\"node_name\": 4}}]")
+  ("replay", options::value<string>(), "session log written by --record, whose method calls to make once the tree is built, in order, logging the time each takes and writing them, and the error of any that fail, to <out>.replay.json; not with --ops or --journal");
+  ops_desc.add(batch_desc);
 
   options::variables_map user_input;
 
@@ -38,7 +66,65 @@ ParseResult parse_options(int argc, char* argv[]) {
   Config config;
   config.stan_file_prefix = user_input["stan_file_prefix"].as<string>();
   config.num_chains = user_input["num_chains"].as<int>();
+  if (config.num_chains < 1) {
+    std::cerr << "Error: --num_chains must be at least 1." << endl;
+    return {std::nullopt, 1};
+  }
   config.ws_port = user_input["port"].as<int>();
+  config.log_spec = user_input["log"].as<string>();
+  config.sample_cache = user_input.count("no_sample_cache") == 0;
+  config.parser_cache = user_input.count("no_parser_cache") == 0;
+  config.single_precision = user_input.count("single_precision") > 0;
+  config.out_of_core = user_input.count("out_of_core") > 0;
+  if (user_input.count("journal")) {
+    config.journal = user_input["journal"].as<string>();
+  }
+  if (user_input.count("metrics_file")) {
+    config.metrics_file = user_input["metrics_file"].as<string>();
+  }
+  if (user_input.count("trace")) {
+    config.trace_file = user_input["trace"].as<string>();
+  }
+  if (user_input.count("memory_limit")) {
+    try {
+      config.memory_limit = memory::parse_bytes(user_input["memory_limit"].as<string>());
+    } catch (const std::invalid_argument& err) {
+      std::cerr << "Error: Invalid --memory_limit: " << err.what() << endl;
+      return {std::nullopt, 1};
+    }
+  }
+  if (batch) {
+    if (!user_input.count("out")) {
+      std::cerr << "Error: Batch mode needs --out." << endl;
+      return {std::nullopt, 1};
+    }
+    if (user_input.count("ops") && user_input.count("replay")) {
+      std::cerr << "Error: Cannot specify both --ops and --replay." << endl;
+      return {std::nullopt, 1};
+    }
+    // The journal would be resumed before the replay and then record every
+    // replayed call, so the session log would not start from its inputs.
+    if (user_input.count("replay") && user_input.count("journal")) {
+      std::cerr << "Error: Cannot specify both --journal and --replay." << endl;
+      return {std::nullopt, 1};
+    }
+    config.batch = BatchConfig{ user_input["out"].as<string>(), std::nullopt, std::nullopt };
+    if (user_input.count("ops")) {
+      config.batch->ops_file = user_input["ops"].as<string>();
+    }
+    if (user_input.count("replay")) {
+      config.batch->replay_file = user_input["replay"].as<string>();
+    }
+  } else if (user_input.count("out") || user_input.count("ops") || user_input.count("replay")) {
+    std::cerr << "Error: --out, --ops and --replay are only valid in batch mode (backend batch ...)." << endl;
+    return {std::nullopt, 1};
+  }
+  if (user_input.count("record")) {
+    config.record_file = user_input["record"].as<string>();
+  }
+  if (user_input.count("compress_threshold")) {
+    config.compress_threshold = user_input["compress_threshold"].as<size_t>();
+  }
 
   // Check for archive mode vs file mode
   bool has_archive = user_input.count("archive") > 0;
@@ -81,8 +167,18 @@ ParseResult parse_options(int argc, char* argv[]) {
     }
   }
 
+  if (config.batch && config.batch->ops_file && !std::filesystem::exists(*config.batch->ops_file)) {
+    std::cerr << "Error: Batch operations file does not exist: " << *config.batch->ops_file << endl;
+    files_missing = true;
+  }
+  if (config.batch && config.batch->replay_file && !std::filesystem::exists(*config.batch->replay_file)) {
+    std::cerr << "Error: Session log does not exist: " << *config.batch->replay_file << endl;
+    files_missing = true;
+  }
+
   // Check if Stan output files exist (check for first chain)
-  string first_chain_file = config.stan_file_prefix + "1.csv";
+  // Chains may be plain CSV files or gzip-compressed .csv.gz files.
+  string first_chain_file = stan_chain_path(config.stan_file_prefix, 1);
   if (!std::filesystem::exists(first_chain_file)) {
     std::cerr << "Error: Stan output file does not exist: " << first_chain_file << endl;
     std::cerr << "       (Looking for files with prefix: " << config.stan_file_prefix << ")" << endl;
@@ -90,7 +186,7 @@ ParseResult parse_options(int argc, char* argv[]) {
   } else {
     // Check if all chains exist
     for (int i = 1; i <= config.num_chains; ++i) {
-      string chain_file = config.stan_file_prefix + to_string(i) + ".csv";
+      string chain_file = stan_chain_path(config.stan_file_prefix, i);
       if (!std::filesystem::exists(chain_file)) {
         std::cerr << "Error: Stan output file does not exist: " << chain_file << endl;
         files_missing = true;
@@ -3,17 +3,18 @@
 #include <iterator>
 
 #include <factor_graph.hpp>
+#include <logging.hpp>
 #include <read_lik.hpp>
 
 lik_facs read_lik(std::string lik_file_path) {
-  std::cout << "Reading MRF graph." << std::endl; 
+  VD_LOG(info, parser) << "Reading likelihood factors.";
 
   lik_facs factors {};
 
   // Read LIK file
   std::ifstream lik_file(lik_file_path);
   if (!lik_file.is_open()) {
-      std::cerr << "Could not open lik file, aborting." << std::endl;
+      VD_LOG(error, parser) << "Could not open lik file, aborting.";
   }
 
   bool reading_factor_name = false;
@@ -32,7 +33,7 @@ lik_facs read_lik(std::string lik_file_path) {
 }
 
 std::tuple<FG, FG_Map, FG_Map> read_fg(std::string fg_data) {
-  std::cout << "Reading factor graph." << std::endl; 
+  VD_LOG(info, parser) << "Reading factor graph.";
 
   lik_facs factors {};
 
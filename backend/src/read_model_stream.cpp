@@ -0,0 +1,184 @@
+#include <cstring>
+#include <set>
+#include <stdexcept>
+#include <tuple>
+
+#include <logging.hpp>
+#include <read_lik.hpp>
+#include <read_model_stream.hpp>
+
+using namespace std;
+
+static const char stream_magic[4] = { 'V', 'D', 'F', 'G' };
+static const uint32_t stream_version = 1;
+
+optional<uint32_t> model_stream_reader::peek_u32(size_t offset) const {
+  if(_pos + offset + sizeof(uint32_t) > _pending.size()) {
+    return nullopt;
+  }
+  // The parser writes little-endian integers.
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(_pending.data() + _pos + offset);
+  return uint32_t(bytes[0]) | (uint32_t(bytes[1]) << 8) | (uint32_t(bytes[2]) << 16) | (uint32_t(bytes[3]) << 24);
+}
+
+const string& model_stream_reader::name(uint32_t id) const {
+  if(id >= _names.size()) {
+    throw runtime_error("Model parser output refers to undefined name " + to_string(id) + ".");
+  }
+  return _names[id];
+}
+
+// Parameters get a vertex when a factor first refers to them, as read_fg
+// does. name checks the id, which every name has a slot for.
+FG_Vertex model_stream_reader::param_vertex(uint32_t id) {
+  const string& param_name = name(id);
+  if(!_param_vertices[id]) {
+    const ModelQuantity param { param_name, false, false };
+    _param_vertices[id] = add_vertex(param, _output.fg);
+    _output.fg_params.emplace(param.name, *_param_vertices[id]);
+  }
+  return *_param_vertices[id];
+}
+
+// Decodes the record at _pos if it has fully arrived. Returns false if
+// more input is needed.
+bool model_stream_reader::decode_record() {
+  if(_pos >= _pending.size()) {
+    return false;
+  }
+  char tag = _pending[_pos];
+  switch(tag) {
+    case 'n': {
+      auto len = peek_u32(1);
+      if(!len || _pos + 5 + *len > _pending.size()) {
+        return false;
+      }
+      _names.emplace_back(_pending, _pos + 5, *len);
+      _param_vertices.emplace_back();
+      _pos += 5 + *len;
+      return true;
+    }
+    case 'f': {
+      auto count = peek_u32(5);
+      if(!count || _pos + 9 + 4 * size_t(*count) > _pending.size()) {
+        return false;
+      }
+      const string& factor_name = name(*peek_u32(1));
+      const ModelQuantity factor { factor_name, true, factor_name.ends_with("_lik") };
+      const auto factor_vertex = add_vertex(factor, _output.fg);
+      _output.fg_factors.emplace(factor_name, factor_vertex);
+      for(uint32_t pi = 0; pi < *count; ++pi) {
+        add_edge(param_vertex(*peek_u32(9 + 4 * pi)), factor_vertex, _output.fg);
+      }
+      _pos += 9 + 4 * size_t(*count);
+      return true;
+    }
+    case 'r': {
+      auto id = peek_u32(1);
+      if(!id) {
+        return false;
+      }
+      _output.root_name = name(*id);
+      _pos += 5;
+      return true;
+    }
+    case 'l': {
+      auto count = peek_u32(1);
+      if(!count || _pos + 5 + 4 * size_t(*count) > _pending.size()) {
+        return false;
+      }
+      set<string> leaf_set;
+      for(uint32_t li = 0; li < *count; ++li) {
+        leaf_set.insert(name(*peek_u32(5 + 4 * li)));
+      }
+      _output.leaves.push_back(std::move(leaf_set));
+      _pos += 5 + 4 * size_t(*count);
+      return true;
+    }
+    case 'e':
+      _ended = true;
+      ++_pos;
+      return true;
+    default:
+      throw runtime_error(string("Unknown record '") + tag + "' in model parser output.");
+  }
+}
+
+void model_stream_reader::feed(string_view bytes) {
+  if(_ended) {
+    _trailing.append(bytes);
+    return;
+  }
+  _pending.append(bytes);
+  if(!_binary) {
+    if(_pending.size() < sizeof(stream_magic) + sizeof(uint32_t)) {
+      return;
+    }
+    _binary = memcmp(_pending.data(), stream_magic, sizeof(stream_magic)) == 0;
+    if(*_binary) {
+      _pos = sizeof(stream_magic);
+      uint32_t version = *peek_u32(0);
+      if(version != stream_version) {
+        throw runtime_error("Model parser output has version " + to_string(version)
+                            + ", but this backend reads version " + to_string(stream_version) + ".");
+      }
+      _pos += sizeof(uint32_t);
+      VD_LOG(debug, parser) << "Reading binary model parser output.";
+    }
+  }
+  if(!*_binary) {
+    return;
+  }
+
+  while(!_ended && decode_record()) {}
+  if(_ended) {
+    _trailing.append(_pending, _pos);
+  }
+  // Keep only the partial record at the end.
+  _pending.erase(0, _pos);
+  _pos = 0;
+}
+
+optional<ParserOutput> model_stream_reader::finish() {
+  if(_binary && *_binary) {
+    if(!_ended) {
+      VD_LOG(error, parser) << "Model parser output ended early.";
+      return nullopt;
+    }
+    if(!_trailing.empty()) {
+      VD_LOG(warn, parser) << "Model parser wrote after its output:\n" << _trailing;
+    }
+    VD_LOG(info, parser) << "Read factor graph with " << _output.fg_factors.size() << " factors and "
+                         << _output.fg_params.size() << " parameters.";
+    return std::move(_output);
+  }
+
+  // Text output. Strip \r characters (Windows pipes may produce \r\n line
+  // endings).
+  string interp_data;
+  interp_data.reserve(_pending.size());
+  for(char c: _pending) {
+    if(c != '\r') {
+      interp_data.push_back(c);
+    }
+  }
+
+  // Check for empty output
+  if (interp_data.empty()) {
+    VD_LOG(error, parser) << "Model parser produced no output.";
+    return std::nullopt;
+  }
+
+  // Split output into factor graph data and tree data
+  const size_t tree_begin = interp_data.find("\n--");
+  if (tree_begin == string::npos) {
+    VD_LOG(error, parser) << "Parser output missing '--' delimiter. Malformed output. Output was:\n"
+                          << interp_data.substr(0, 500) << (interp_data.size() > 500 ? "... (truncated)" : "");
+    return std::nullopt;
+  }
+
+  ParserOutput output;
+  std::tie(output.fg, output.fg_params, output.fg_factors) = read_fg(interp_data.substr(0, tree_begin));
+  std::tie(output.root_name, output.leaves) = read_tree_data(interp_data.substr(tree_begin + 4));
+  return output;
+}
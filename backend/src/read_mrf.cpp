@@ -3,13 +3,14 @@
 #include <iterator>
 // #include <boost/graph/adjacency_list.hpp>
 
+#include<logging.hpp>
 #include<parameter_graph.hpp>
 #include<factor_graph.hpp>
 
 using namespace std;
   
 std::pair<MRF, VertexMap> read_mrf(string mrf_file_path) {
-  cout << "Reading MRF graph." << endl; 
+  VD_LOG(info, parser) << "Reading MRF graph.";
 
   VertexMap param_vertices;
   vector<Parameter> params(0);
@@ -17,7 +18,7 @@ std::pair<MRF, VertexMap> read_mrf(string mrf_file_path) {
   // Read MRF file
   ifstream mrf_file(mrf_file_path);
   if (!mrf_file.is_open()) {
-      std::cerr << "Could not open mrf file, aborting." << std::endl;
+      VD_LOG(error, parser) << "Could not open mrf file, aborting.";
   }
 
   string mrf_line;
@@ -54,7 +55,7 @@ std::pair<MRF, VertexMap> read_mrf(string mrf_file_path) {
     add_edge(v0, v1, mrf);
   });
 
-  cout << "MRF read." << endl;
+  VD_LOG(info, parser) << "MRF read.";
 
   return std::make_pair(mrf, param_vertices);
 }
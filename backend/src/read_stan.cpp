@@ -1,14 +1,26 @@
-#include<map>
-#include<fstream>
+#include<algorithm>
+#include<charconv>
+#include<cstdlib>
+#include<cstring>
+#include<filesystem>
 #include<iostream>
-#include<random>
+#include<stdexcept>
+#include<string_view>
+#include<vector>
 #include<Eigen/Dense>
+#include<boost/interprocess/file_mapping.hpp>
+#include<boost/interprocess/mapped_region.hpp>
 
+#include<compression.hpp>
+#include<logging.hpp>
+#include<parallel.hpp>
 #include<read_stan.hpp>
 
 using namespace std;
 using Eigen::MatrixXd;
-using Eigen::Map;
+using Eigen::MatrixXf;
+using Eigen::VectorXd;
+namespace ipc = boost::interprocess;
 
 vector<int> dot_pos(string name) {
   vector<int> pos;
@@ -17,89 +29,429 @@ vector<int> dot_pos(string name) {
   }
   return(pos);
 }
- 
-standata read_stan_file(string file_name, int num_chains, bool bootstrap) {
-  vector<double> stan_data;
-  vector<string> stan_names;
-  int sample_size = 0;
 
-  for(int i = 1; i < num_chains + 1; ++i) {
+// Converts a Stan CSV column name such as "a.1.2" to "a[1,2]".
+static string stan_param_name(string par_name) {
+  vector<int> par_dots = dot_pos(par_name);
+  if(par_dots.size() > 0) {
+    par_name[par_dots[0]] = '[';
+    for(int pi = 1; pi < par_dots.size(); ++pi) {
+      par_name[par_dots[pi]] = ',';
+    }
+    par_name = par_name + "]";
+  }
+  return par_name;
+}
+
+// A chain file, either mapped into memory or read through gzip, with its
+// CSV header and the number of draws that follow it.
+struct chain_file {
+  string path;
+  bool gzipped = false;
+  ipc::file_mapping mapping;
+  ipc::mapped_region region;
+  string_view contents;
+  string header;
+  long num_rows = 0;
+};
+
+static string_view strip_cr(string_view line) {
+  if(!line.empty() && line.back() == '\r') {
+    line.remove_suffix(1);
+  }
+  return line;
+}
 
-    ifstream stan_file(file_name + to_string(i) + ".csv");
+// Calls on_line with every line of the chain. Gzipped chains are
+// decompressed a chunk at a time, so the lines passed are only valid
+// during the call.
+template<class OnLine>
+static void for_each_line(const chain_file& chain, OnLine&& on_line) {
+  if(!chain.gzipped) {
+    size_t pos = 0;
+    while(pos < chain.contents.size()) {
+      size_t line_end = chain.contents.find('\n', pos);
+      if(line_end == string_view::npos) {
+        line_end = chain.contents.size();
+      }
+      on_line(strip_cr(chain.contents.substr(pos, line_end - pos)));
+      pos = line_end + 1;
+    }
+    return;
+  }
 
-    if (!stan_file.is_open()) {
-      throw runtime_error("Could not open stan csv file, aborting.");
+  string partial;
+  read_gzip_chunks(chain.path, [&](string_view chunk) {
+    size_t pos = 0;
+    size_t line_end;
+    while((line_end = chunk.find('\n', pos)) != string_view::npos) {
+      if(partial.empty()) {
+        on_line(strip_cr(chunk.substr(pos, line_end - pos)));
+      } else {
+        partial.append(chunk.substr(pos, line_end - pos));
+        on_line(strip_cr(partial));
+        partial.clear();
+      }
+      pos = line_end + 1;
     }
+    partial.append(chunk.substr(pos));
+  });
+  if(!partial.empty()) {
+    on_line(strip_cr(partial));
+  }
+}
 
-    bool header_done = false;
-    string stan_file_line;
+// Comment lines (adaptation info, timing) and blank lines carry no draws.
+static bool is_data_line(string_view line) {
+  return !line.empty() && line[0] != '#';
+}
 
-    while(getline(stan_file, stan_file_line)) {
-      bool is_data = stan_file_line[0] != '#';
-      if(is_data && header_done) {
-        stringstream stan_line_data(stan_file_line);
-        string stan_file_cell;
-        while (getline(stan_line_data, stan_file_cell, ',')) {
-          stan_data.push_back(stod(stan_file_cell));
-        }
-        ++sample_size;
-      } else if (is_data && !header_done) {
-        if(stan_names.size() == 0) {
-          stringstream stan_line_data(stan_file_line);
-          string stan_file_cell;
-          while (getline(stan_line_data, stan_file_cell, ',')) {
-            stan_names.push_back(stan_file_cell);
-          }
+// Finds the header and counts the draws. For a gzipped chain this is a
+// full decompression pass, which lets the draws be parsed in a second
+// pass straight into place.
+static void scan_chain(chain_file& chain) {
+  bool seen_header = false;
+  for_each_line(chain, [&](string_view line) {
+    if(!is_data_line(line)) {
+      return;
+    }
+    if(seen_header) {
+      ++chain.num_rows;
+    } else {
+      chain.header = line;
+      seen_header = true;
+    }
+  });
+}
+
+static double parse_cell(const char* begin, const char* end, const char** cell_end) {
+  double value;
+#if defined(__cpp_lib_to_chars)
+  auto [ptr, ec] = from_chars(begin, end, value);
+  if(ec != errc()) {
+    *cell_end = begin;
+    return 0;
+  }
+  *cell_end = ptr;
+#else
+  // Without floating-point from_chars, copy the cell so strtod sees a
+  // terminated string rather than reading past the end of the mapping.
+  char buffer[64];
+  size_t cell_len = min<size_t>(find(begin, end, ',') - begin, sizeof(buffer) - 1);
+  memcpy(buffer, begin, cell_len);
+  buffer[cell_len] = '\0';
+  char* parsed_end;
+  value = strtod(buffer, &parsed_end);
+  *cell_end = begin + (parsed_end - buffer);
+#endif
+  return value;
+}
+
+// Parses the draws of one chain into the sample matrix. CSV column c is
+// stored in matrix column dest_cols[c], or skipped without parsing if that
+// is -1. Draw d goes to row first_row + d % block_rows, and on_block(first
+// draw, number of draws) is called whenever a block of rows is complete,
+// including a final partial block. Passing block_rows >= the chain's draws
+// parses the whole chain into consecutive rows. The first skip_draws draws
+// are skipped without parsing them, and draws are counted from the next.
+template<class Matrix, class OnBlock>
+static void parse_chain(const chain_file& chain, const vector<int>& dest_cols,
+                        Matrix& stan_matrix, long first_row, long block_rows, OnBlock&& on_block,
+                        long skip_draws = 0) {
+  const long num_vars = dest_cols.size();
+  bool seen_header = false;
+  long skipped = 0;
+  long draw = 0;
+  for_each_line(chain, [&](string_view line) {
+    if(!is_data_line(line)) {
+      return;
+    }
+    if(!seen_header) {
+      seen_header = true;
+      return;
+    }
+    if(skipped < skip_draws) {
+      ++skipped;
+      return;
+    }
+    const long row = first_row + draw % block_rows;
+    const char* cell = line.data();
+    const char* line_end = line.data() + line.size();
+    auto malformed = [&](long col) {
+      return runtime_error("Malformed draw " + to_string(skip_draws + draw + 1) + " in " + chain.path
+                           + ", column " + to_string(col + 1) + ".");
+    };
+    for(long col = 0; col < num_vars; ++col) {
+      bool last = (col == num_vars - 1);
+      if(dest_cols[col] < 0) {
+        const char* comma = static_cast<const char*>(memchr(cell, ',', line_end - cell));
+        if(last ? comma != nullptr : comma == nullptr) {
+          throw malformed(col);
         }
-        header_done = true;
+        cell = last ? line_end : comma + 1;
+        continue;
+      }
+      const char* cell_end;
+      stan_matrix(row, dest_cols[col]) = static_cast<typename Matrix::Scalar>(parse_cell(cell, line_end, &cell_end));
+      if(cell_end == cell || (last ? cell_end != line_end : (cell_end == line_end || *cell_end != ','))) {
+        throw malformed(col);
       }
+      cell = cell_end + 1;
+    }
+    ++draw;
+    if(draw % block_rows == 0) {
+      on_block(draw - block_rows, block_rows);
     }
+  });
+  if(draw % block_rows != 0) {
+    on_block(draw - draw % block_rows, draw % block_rows);
+  }
+}
 
-    stan_file.close();
+static vector<string> split_header(string_view header) {
+  vector<string> names;
+  size_t pos = 0;
+  while(pos <= header.size()) {
+    size_t comma = header.find(',', pos);
+    if(comma == string_view::npos) {
+      comma = header.size();
+    }
+    names.emplace_back(header.substr(pos, comma - pos));
+    pos = comma + 1;
   }
+  return names;
+}
 
-  int num_vars = stan_names.size();
+// Parses every chain into a new matrix with the given scalar type and
+// points data.samples at it. Returns the matrix, which owns the storage.
+template<class Matrix>
+static shared_ptr<const Matrix> parse_samples(
+  const vector<chain_file>& chains, const vector<long>& first_rows, const vector<int>& dest_cols,
+  long sample_size, int num_vars, standata& data
+) {
+  auto stan_matrix = std::make_unique<Matrix>(sample_size, num_vars);
+  parallel_for(chains.size(), [&](size_t ci) {
+    parse_chain(chains[ci], dest_cols, *stan_matrix, first_rows[ci], max(1L, chains[ci].num_rows), [](long, long) {});
+  });
 
-  auto stan_matrix_t =  std::make_unique<Map<MatrixXd>>(stan_data.data(), num_vars, sample_size);
-  cout << "Finished reading in matrix..." << endl;
-  auto stan_matrix = std::make_unique<MatrixXd>(stan_matrix_t -> transpose());
-  cout << "Finished transposing matrix..." << endl;
+  std::shared_ptr<const Matrix> storage = std::move(stan_matrix);
+  data.samples = std::make_unique<dense_sample_matrix>(storage->data(), storage->rows(), storage->cols());
+  return storage;
+}
 
-  cout << "Read " << stan_matrix -> rows() << " x " 
-       << stan_matrix -> cols() << " matrix." << endl;
+struct scanned_chains {
+  string file_name;
+  vector<chain_file> chains;
+  vector<string> names;  // Of the CSV columns, shared by every chain
+};
 
-  map<string, int> col_names;
-  for(int ci = 0; ci < stan_names.size(); ++ci) {
-    string par_name = stan_names[ci];
-    vector<int> par_dots = dot_pos(par_name);
-    if(par_dots.size() > 0) {
-      par_name[par_dots[0]] = '[';
-      for(int pi = 1; pi < par_dots.size(); ++pi) {
-        par_name[par_dots[pi]] = ',';
+// The chains of a run, mapped and scanned, with the loaded columns.
+struct stan_chains {
+  shared_ptr<const scanned_chains> scanned;
+  vector<int> dest_cols;
+  stan_var_map col_names;
+  int num_vars = 0;
+  int num_skipped = 0;
+};
+
+shared_ptr<const scanned_chains> scan_stan_files(const string& file_name, int num_chains) {
+  // Every chain is checked against the first, so there must be one.
+  if(num_chains < 1) {
+    throw invalid_argument("Need at least one chain to read, not " + to_string(num_chains) + ".");
+  }
+  auto scanned = make_shared<scanned_chains>();
+  scanned->file_name = file_name;
+  scanned->chains = vector<chain_file>(num_chains);
+
+  // Map every chain and count its draws, so the destination can be sized
+  // once and each chain parsed straight into its rows.
+  parallel_for(num_chains, [&](size_t ci) {
+    chain_file& chain = scanned->chains[ci];
+    chain.path = stan_chain_path(file_name, ci + 1);
+    chain.gzipped = chain.path.ends_with(".gz");
+    if(!chain.gzipped) {
+      try {
+        chain.mapping = ipc::file_mapping(chain.path.c_str(), ipc::read_only);
+        chain.region = ipc::mapped_region(chain.mapping, ipc::read_only);
+      } catch (const ipc::interprocess_exception& err) {
+        throw runtime_error("Could not open stan csv file " + chain.path + ", aborting.");
       }
-      par_name = par_name + "]";
+      chain.contents = string_view(static_cast<const char*>(chain.region.get_address()), chain.region.get_size());
+    }
+    scan_chain(chain);
+  });
+
+  // Columns are mapped by the first chain's header, so every chain must
+  // have the same columns in the same order.
+  const vector<chain_file>& chains = scanned->chains;
+  scanned->names = split_header(chains[0].header);
+  const vector<string>& stan_names = scanned->names;
+  for(int ci = 1; ci < num_chains; ++ci) {
+    vector<string> chain_names = split_header(chains[ci].header);
+    if(chain_names.size() != stan_names.size()) {
+      throw runtime_error("Stan csv file " + chains[ci].path + " has a different number of columns than " + chains[0].path + ".");
+    }
+    auto first_differing = mismatch(stan_names.begin(), stan_names.end(), chain_names.begin()).first;
+    if(first_differing != stan_names.end()) {
+      size_t col = first_differing - stan_names.begin();
+      throw runtime_error("Stan csv file " + chains[ci].path + " has column " + chain_names[col] + " where "
+                          + chains[0].path + " has " + stan_names[col] + " (column " + to_string(col + 1) + ").");
     }
-    col_names.insert(make_pair(par_name, ci));
   }
+  return scanned;
+}
 
-  if(bootstrap) {
-    std::random_device rd;
-    std::mt19937 generator(rd());
-    std::uniform_int_distribution<> unif(0, stan_matrix->rows()-1);
+// Uses chains scanned in advance if they are of this run, and scans them
+// otherwise.
+static void open_chains(stan_chains& run, const string& file_name, int num_chains, const optional<set<string>>& columns,
+                        shared_ptr<const scanned_chains> scanned) {
+  if(scanned && scanned->file_name == file_name && scanned->chains.size() == static_cast<size_t>(num_chains)) {
+    run.scanned = std::move(scanned);
+  } else {
+    run.scanned = scan_stan_files(file_name, num_chains);
+  }
 
-    auto sm_boot = std::make_unique<MatrixXd>(stan_matrix->rows(), stan_matrix->cols());
-    for(int i = 0; i < stan_matrix->rows(); ++i){
-      sm_boot->row(i) = stan_matrix->row(unif(generator));
+  // Decide which CSV columns to keep and where they go in the matrix.
+  const vector<string>& stan_names = run.scanned->names;
+  run.dest_cols = vector<int>(stan_names.size(), -1);
+  for(size_t ci = 0; ci < stan_names.size(); ++ci) {
+    string par_name = stan_param_name(stan_names[ci]);
+    if(!columns || columns->count(par_name) > 0) {
+      run.dest_cols[ci] = run.num_vars;
+      run.col_names.emplace(par_name, run.num_vars);
+      ++run.num_vars;
     }
-    return {
-      .samples = std::move(sm_boot),
-      .vars = col_names
-    };
+  }
+  run.num_skipped = stan_names.size() - run.num_vars;
+}
+
+string stan_chain_path(const string& file_prefix, int chain) {
+  string path = file_prefix + to_string(chain) + ".csv";
+  if(!filesystem::exists(path) && filesystem::exists(path + ".gz")) {
+    return path + ".gz";
+  }
+  return path;
+}
+
+standata read_stan_file(string file_name, int num_chains, const optional<set<string>>& columns,
+                        sample_precision precision, shared_ptr<const scanned_chains> scanned) {
+  stan_chains run;
+  open_chains(run, file_name, num_chains, columns, std::move(scanned));
+  const vector<chain_file>& chains = run.scanned->chains;
+
+  vector<long> first_rows(num_chains);
+  long sample_size = 0;
+  for(int ci = 0; ci < num_chains; ++ci) {
+    first_rows[ci] = sample_size;
+    sample_size += chains[ci].num_rows;
+  }
+
+  VD_LOG(info, samples) << "Reading " << sample_size << " x " << run.num_vars << " matrix"
+                        << (precision == sample_precision::f32 ? " in single precision" : "")
+                        << " (" << run.num_skipped << " unused columns skipped).";
+
+  standata data;
+  data.vars = run.col_names;
+  for(const chain_file& chain: chains) {
+    data.chain_rows.push_back(chain.num_rows);
+  }
+  if(precision == sample_precision::f32) {
+    data.storage = parse_samples<MatrixXf>(chains, first_rows, run.dest_cols, sample_size, run.num_vars, data);
   } else {
-    return {
-      .samples = std::move(stan_matrix),
-      .vars = col_names
-    };
+    data.storage = parse_samples<MatrixXd>(chains, first_rows, run.dest_cols, sample_size, run.num_vars, data);
+  }
+  return data;
+}
+
+// Copies the previous draws of every chain to its new rows, a column at a
+// time, then parses each chain's new draws after them.
+template<class Matrix>
+static shared_ptr<const Matrix> append_samples(
+  const standata& previous, const vector<chain_file>& chains, const vector<long>& first_rows,
+  const vector<int>& dest_cols, long sample_size, int num_vars, standata& data
+) {
+  auto stan_matrix = std::make_unique<Matrix>(sample_size, num_vars);
+  parallel_for(num_vars, [&](size_t col) {
+    VectorXd old_values = previous.samples->col(col);
+    long old_row = 0;
+    for(size_t ci = 0; ci < chains.size(); ++ci) {
+      long old_rows = previous.chain_rows[ci];
+      stan_matrix->col(col).segment(first_rows[ci], old_rows)
+        = old_values.segment(old_row, old_rows).cast<typename Matrix::Scalar>();
+      old_row += old_rows;
+    }
+  });
+  parallel_for(chains.size(), [&](size_t ci) {
+    long old_rows = previous.chain_rows[ci];
+    parse_chain(chains[ci], dest_cols, *stan_matrix, first_rows[ci] + old_rows,
+                max(1L, chains[ci].num_rows - old_rows), [](long, long) {}, old_rows);
+  });
+
+  std::shared_ptr<const Matrix> storage = std::move(stan_matrix);
+  data.samples = std::make_unique<dense_sample_matrix>(storage->data(), storage->rows(), storage->cols());
+  return storage;
+}
+
+optional<standata> append_stan_draws(const standata& previous, string file_name, int num_chains,
+                                     const optional<set<string>>& columns, sample_precision precision) {
+  if(previous.chain_rows.size() != static_cast<size_t>(num_chains)) {
+    return nullopt;
+  }
+  stan_chains run;
+  open_chains(run, file_name, num_chains, columns, nullptr);
+  const vector<chain_file>& chains = run.scanned->chains;
+  if(run.col_names != previous.vars) {
+    return nullopt;
   }
 
-}
\ No newline at end of file
+  vector<long> first_rows(num_chains);
+  long sample_size = 0;
+  for(int ci = 0; ci < num_chains; ++ci) {
+    if(chains[ci].num_rows < previous.chain_rows[ci]) {
+      VD_LOG(info, samples) << "Stan csv file " << chains[ci].path << " has fewer draws than were read before.";
+      return nullopt;
+    }
+    first_rows[ci] = sample_size;
+    sample_size += chains[ci].num_rows;
+  }
+
+  VD_LOG(info, samples) << "Appending " << sample_size - previous.samples->rows() << " new draws to "
+                        << previous.samples->rows() << " x " << run.num_vars << " matrix.";
+
+  standata data;
+  data.vars = run.col_names;
+  for(const chain_file& chain: chains) {
+    data.chain_rows.push_back(chain.num_rows);
+  }
+  if(precision == sample_precision::f32) {
+    data.storage = append_samples<MatrixXf>(previous, chains, first_rows, run.dest_cols, sample_size, run.num_vars, data);
+  } else {
+    data.storage = append_samples<MatrixXd>(previous, chains, first_rows, run.dest_cols, sample_size, run.num_vars, data);
+  }
+  return data;
+}
+
+void read_stan_blocks(string file_name, int num_chains, const optional<set<string>>& columns,
+                      const function<long(const stan_var_map&, const vector<long>&)>& on_layout,
+                      const function<void(int, long, Eigen::Ref<const MatrixXd>)>& on_block,
+                      shared_ptr<const scanned_chains> scanned) {
+  stan_chains run;
+  open_chains(run, file_name, num_chains, columns, std::move(scanned));
+  const vector<chain_file>& chains = run.scanned->chains;
+
+  vector<long> chain_rows(num_chains);
+  for(int ci = 0; ci < num_chains; ++ci) {
+    chain_rows[ci] = chains[ci].num_rows;
+  }
+  long block_rows = max(1L, on_layout(run.col_names, chain_rows));
+
+  VD_LOG(info, samples) << "Streaming " << run.num_vars << " columns in blocks of " << block_rows << " draws"
+                        << " (" << run.num_skipped << " unused columns skipped).";
+
+  parallel_for(num_chains, [&](size_t ci) {
+    MatrixXd block(min(block_rows, max(1L, chain_rows[ci])), run.num_vars);
+    parse_chain(chains[ci], run.dest_cols, block, 0, block.rows(), [&](long first_draw, long num_draws) {
+      on_block(ci, first_draw, block.topRows(num_draws));
+    });
+  });
+}
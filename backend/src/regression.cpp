@@ -9,7 +9,7 @@ using Eigen::VectorXd;
 using Eigen::all;
 using Eigen::seqN;
 
-MatrixXd predictor_matrix(const MatrixXd& stan_matrix, const std::map<std::string, int>& stan_vars, set<string> pred_names, int poly, bool interactions){
+MatrixXd predictor_matrix(const sample_matrix& stan_matrix, const stan_var_map& stan_vars, set<string> pred_names, int poly, bool interactions){
   vector<int> var_indices(pred_names.size());
   int pi = 0;
   for(const string& pred_name: pred_names) {
@@ -19,7 +19,7 @@ MatrixXd predictor_matrix(const MatrixXd& stan_matrix, const std::map<std::strin
 
   VectorXd intercept = (ArrayXd::Zero(stan_matrix.rows()) + 1).matrix();
 
-  MatrixXd pred_matrix = stan_matrix(all, var_indices);
+  MatrixXd pred_matrix = stan_matrix.columns(var_indices);
   MatrixXd out_matrix(stan_matrix.rows(), var_indices.size() + 1);
   out_matrix << intercept, pred_matrix;
 
@@ -53,12 +53,12 @@ MatrixXd predictor_matrix(const MatrixXd& stan_matrix, const std::map<std::strin
 
 double adj_r_squared(
   set<string> predictor_names, std::string response_name,
-  const MatrixXd& stan_matrix, const std::map<std::string, int>& stan_vars,
+  const sample_matrix& stan_matrix, const stan_var_map& stan_vars,
   bool sqrt_scale = true, bool split_data = true
 ) {
 
   int num_observations = stan_matrix.rows();
-  VectorXd response = stan_matrix(all, stan_vars.at(response_name));
+  VectorXd response = stan_matrix.col(stan_vars.at(response_name));
   MatrixXd predictors = predictor_matrix(stan_matrix, stan_vars, predictor_names, 1, true);
   int num_predictors = predictors.cols() - 1;
 
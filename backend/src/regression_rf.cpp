@@ -1,10 +1,17 @@
 #include <regression_rf.hpp>
+#include <logging.hpp>
+#include <memory_report.hpp>
+#include <metrics.hpp>
+#include <parallel.hpp>
+#include <tracing.hpp>
 
 #include <fstream>
 #include <filesystem>
 #include <sstream>
 #include <regex>
 #include <iostream>
+#include <mutex>
+#include <deque>
 
 #include <boost/version.hpp>
 #if BOOST_VERSION >= 108800
@@ -14,6 +21,8 @@
 #endif
 #include <boost/asio.hpp>
 #include <boost/dll/runtime_symbol_info.hpp>
+#include <boost/uuid/uuid_generators.hpp>
+#include <boost/uuid/uuid_io.hpp>
 
 #if BOOST_VERSION >= 108800
 namespace proc = boost::process;
@@ -51,8 +60,52 @@ static boost::filesystem::path get_ranger_path() {
   return ranger_path;
 }
 
+static metrics::histogram fit_seconds("vd_ered_fit_seconds", "Time spent fitting random forests for eReds; the count is the number of fits.");
+static metrics::counter fit_cache_hits("vd_ered_cache_hits_total", "eReds reused from earlier fits instead of refitting.");
+
+// Results of fits, keyed by the sample fingerprint and the fit's inputs,
+// and their keys from oldest to newest. Past max_cached_fits, the oldest
+// are dropped.
+static const size_t max_cached_fits = 100'000;
+static mutex rf_cache_mutex;
+static map<string, double> rf_cache;
+static deque<string> rf_cache_order;
+static function<void(const string&, double)> rf_fit_observer;
+
+// Called with rf_cache_mutex held.
+static void cache_fit(const string& key, double ered) {
+  if(!rf_cache.emplace(key, ered).second) {
+    return;
+  }
+  rf_cache_order.push_back(key);
+  while(rf_cache_order.size() > max_cached_fits) {
+    rf_cache.erase(rf_cache_order.front());
+    rf_cache_order.pop_front();
+  }
+}
+
+static string rf_cache_key(uint64_t fingerprint, const set<string>& predictor_names,
+                           const string& response_name, bool sqrt_scale, bool split_data) {
+  string key = to_string(fingerprint) + (sqrt_scale ? "s" : "-") + (split_data ? "h" : "-") + "|" + response_name;
+  for(const string& name: predictor_names) {
+    key += "|" + name;
+  }
+  return key;
+}
+
 // Helper to run ranger and capture output
-static string run_ranger(const vector<string>& args) {
+static string run_ranger(vector<string> args) {
+  // Fits run concurrently inside parallel_for, so each ranger gets only
+  // its share of the cores.
+  args.push_back("--nthreads");
+  args.push_back(to_string(available_threads()));
+
+  // Ranger's progress output is only of interest when tracing fits.
+  bool verbose = vdlog::enabled(vdlog::level::trace, vdlog::category::rf);
+  if(verbose) {
+    args.push_back("--verbose");
+  }
+
   asio::io_context ioc;
   asio::readable_pipe ranger_pipe{ioc};
 
@@ -74,15 +127,18 @@ static string run_ranger(const vector<string>& args) {
   }
 
   ranger_proc.wait();
+  if(verbose) {
+    VD_LOG(trace, rf) << ranger_output;
+  }
   return ranger_output;
 }
 
-double rf_oob_mse(
-  set<string> predictor_names, std::string response_name,
-  const MatrixXd& stan_matrix, const std::map<std::string, int>& stan_vars,
+static double fit_rf_oob_mse(
+  const set<string>& predictor_names, const std::string& response_name,
+  const sample_matrix& stan_matrix, const stan_var_map& stan_vars,
   bool sqrt_scale, bool split_data
 ) {
-  cout << "Computing RF holdout prediction error." << endl;
+  VD_LOG(debug, rf) << "Computing RF holdout prediction error for " << predictor_names.size() << " predictors.";
 
   // No predictors means no variance explained, so SSR/SST = 1
   if(predictor_names.empty()) {
@@ -91,11 +147,13 @@ double rf_oob_mse(
 
   int num_predictors = predictor_names.size();
 
+  // Fits may run concurrently, so every call gets its own set of files.
   auto temp_dir = std::filesystem::temp_directory_path();
-  auto train_file = temp_dir / "ranger_train.csv";
-  auto test_file = temp_dir / "ranger_test.csv";
-  auto forest_file = temp_dir / "ranger_model.forest";
-  auto pred_prefix = temp_dir / "ranger_pred";
+  string fit_id = boost::uuids::to_string(boost::uuids::random_generator()());
+  auto train_file = temp_dir / ("ranger_train_" + fit_id + ".csv");
+  auto test_file = temp_dir / ("ranger_test_" + fit_id + ".csv");
+  auto forest_file = temp_dir / ("ranger_model_" + fit_id + ".forest");
+  auto pred_prefix = temp_dir / ("ranger_pred_" + fit_id);
   string train_file_str = train_file.string();
   string test_file_str = test_file.string();
   string forest_file_str = forest_file.string();
@@ -118,8 +176,14 @@ double rf_oob_mse(
   int num_train = num_rows / 2;
   int num_test = num_rows - num_train;
 
+  // Copy out just the columns of this fit, widened to double if the
+  // samples are stored in single precision. The response is last.
+  vector<int> fit_indices = pred_indices;
+  fit_indices.push_back(response_idx);
+  MatrixXd fit_data = stan_matrix.columns(fit_indices);
+
   // Extract test response for SST calculation
-  VectorXd response_test = stan_matrix.col(response_idx).tail(num_test);
+  VectorXd response_test = fit_data.col(num_predictors).tail(num_test);
   double response_mean = response_test.mean();
   double SST = (response_test.array() - response_mean).matrix().squaredNorm();
 
@@ -131,15 +195,19 @@ double rf_oob_mse(
     out << sanitized_response << "\n";
   };
 
+  auto write_row = [&](ofstream& out, int row) {
+    for(int col = 0; col < num_predictors; ++col) {
+      out << fit_data(row, col) << ",";
+    }
+    out << fit_data(row, num_predictors) << "\n";
+  };
+
   // Write training data (first half)
   {
     ofstream csv_out(train_file_str);
     write_header(csv_out);
     for(int row = 0; row < num_train; ++row) {
-      for(int pred_idx : pred_indices) {
-        csv_out << stan_matrix(row, pred_idx) << ",";
-      }
-      csv_out << stan_matrix(row, response_idx) << "\n";
+      write_row(csv_out, row);
     }
   }
 
@@ -148,38 +216,41 @@ double rf_oob_mse(
     ofstream csv_out(test_file_str);
     write_header(csv_out);
     for(int row = num_train; row < num_rows; ++row) {
-      for(int pred_idx : pred_indices) {
-        csv_out << stan_matrix(row, pred_idx) << ",";
-      }
-      csv_out << stan_matrix(row, response_idx) << "\n";
+      write_row(csv_out, row);
     }
   }
 
   // Step 1: Train ranger and save forest
-  run_ranger({
-    "--file", train_file_str,
-    "--treetype", "3",  // Regression
-    "--ntree", "1000",
-    "--mtry", std::to_string(num_predictors),
-    "--splitrule", "5",
-    "--minbucket", "3",
-    "--noreplace",
-    "--fraction", "1",
-    "--depvarname", sanitized_response,
-    "--write",
-    "--outprefix", forest_file_str,
-    "--verbose"
-  });
+  {
+    tracing::span span("ranger train");
+    span.arg("predictors", num_predictors).arg("rows", num_train);
+    run_ranger({
+      "--file", train_file_str,
+      "--treetype", "3",  // Regression
+      "--ntree", "1000",
+      "--mtry", std::to_string(num_predictors),
+      "--splitrule", "5",
+      "--minbucket", "3",
+      "--noreplace",
+      "--fraction", "1",
+      "--depvarname", sanitized_response,
+      "--write",
+      "--outprefix", forest_file_str
+    });
+  }
 
   // Step 2: Predict on test data
-  run_ranger({
-    "--file", test_file_str,
-    "--treetype", "3",  // Regression
-    "--depvarname", sanitized_response,
-    "--predict", forest_file_str + ".forest",
-    "--outprefix", pred_prefix_str,
-    "--verbose"
-  });
+  {
+    tracing::span span("ranger predict");
+    span.arg("rows", num_test);
+    run_ranger({
+      "--file", test_file_str,
+      "--treetype", "3",  // Regression
+      "--depvarname", sanitized_response,
+      "--predict", forest_file_str + ".forest",
+      "--outprefix", pred_prefix_str
+    });
+  }
 
   // Step 3: Read predictions from output file
   string pred_file_str = pred_prefix_str + ".prediction";
@@ -215,8 +286,8 @@ double rf_oob_mse(
   double SSR = (response_test - predictions).squaredNorm();
   double normalized = SSR / SST;
 
-  cout << "num_test: " << num_test << ", SSR: " << SSR << ", SST: " << SST << endl;
-  cout << "Normalized (SSR/SST): " << normalized << endl;
+  VD_LOG(debug, rf) << "num_test: " << num_test << ", SSR: " << SSR << ", SST: " << SST
+                    << ", normalized (SSR/SST): " << normalized;
 
   // Clean up temp files
   std::filesystem::remove(train_file);
@@ -230,3 +301,79 @@ double rf_oob_mse(
     return normalized;
   }
 }
+
+double rf_oob_mse(
+  set<string> predictor_names, std::string response_name,
+  const sample_matrix& stan_matrix, const stan_var_map& stan_vars,
+  bool sqrt_scale, bool split_data
+) {
+  tracing::span span("rf_oob_mse");
+  span.arg("predictors", predictor_names.size());
+  uint64_t fingerprint = stan_matrix.fingerprint();
+  if(fingerprint == 0) {
+    metrics::scoped_timer timer(fit_seconds);
+    return fit_rf_oob_mse(predictor_names, response_name, stan_matrix, stan_vars, sqrt_scale, split_data);
+  }
+
+  string key = rf_cache_key(fingerprint, predictor_names, response_name, sqrt_scale, split_data);
+  {
+    lock_guard<mutex> lock(rf_cache_mutex);
+    auto cached = rf_cache.find(key);
+    if(cached != rf_cache.end()) {
+      VD_LOG(debug, rf) << "Reusing RF fit for " << predictor_names.size() << " predictors.";
+      fit_cache_hits.add();
+      span.arg("cached", true);
+      return cached->second;
+    }
+  }
+
+  // Concurrent requests for the same fit may both compute it; either
+  // result is kept.
+  double ered;
+  {
+    metrics::scoped_timer timer(fit_seconds);
+    ered = fit_rf_oob_mse(predictor_names, response_name, stan_matrix, stan_vars, sqrt_scale, split_data);
+  }
+  {
+    lock_guard<mutex> lock(rf_cache_mutex);
+    cache_fit(key, ered);
+  }
+  if(rf_fit_observer) {
+    rf_fit_observer(key, ered);
+  }
+  return ered;
+}
+
+void set_rf_fit_observer(function<void(const string&, double)> observer) {
+  rf_fit_observer = std::move(observer);
+}
+
+void seed_rf_cache(const string& key, double ered) {
+  lock_guard<mutex> lock(rf_cache_mutex);
+  cache_fit(key, ered);
+}
+
+void retain_rf_cache(uint64_t fingerprint) {
+  const string prefix = to_string(fingerprint);
+  auto other_samples = [&](const string& key) {
+    return key.compare(0, prefix.size(), prefix) != 0 || (key[prefix.size()] != 's' && key[prefix.size()] != '-');
+  };
+  lock_guard<mutex> lock(rf_cache_mutex);
+  size_t before = rf_cache.size();
+  erase_if(rf_cache, [&](const auto& entry) { return other_samples(entry.first); });
+  erase_if(rf_cache_order, other_samples);
+  VD_LOG(debug, rf) << "Dropped " << before - rf_cache.size() << " cached fits of earlier samples.";
+}
+
+pair<size_t, size_t> rf_cache_usage() {
+  lock_guard<mutex> lock(rf_cache_mutex);
+  size_t bytes = sizeof(rf_cache);
+  // Each map node holds its color and links, then the key and eRed.
+  for(const auto& [key, ered]: rf_cache) {
+    bytes += 4 * sizeof(void*) + memory::string_bytes(key) + sizeof(ered);
+  }
+  for(const string& key: rf_cache_order) {
+    bytes += memory::string_bytes(key);
+  }
+  return { rf_cache.size(), bytes };
+}
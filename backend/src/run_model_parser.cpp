@@ -1,6 +1,12 @@
 #include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <vector>
 
 #include <boost/version.hpp>
 #if BOOST_VERSION >= 108800
@@ -10,7 +16,10 @@
 #endif
 #include <boost/asio.hpp>
 #include <boost/dll/runtime_symbol_info.hpp>
+#include <boost/uuid/uuid_generators.hpp>
+#include <boost/uuid/uuid_io.hpp>
 
+#include <logging.hpp>
 #include <run_model_parser.hpp>
 
 #if BOOST_VERSION >= 108800
@@ -21,9 +30,81 @@ namespace proc = boost::process::v2;
 namespace asio = boost::asio;
 using namespace std;
 
+// Parsing evaluates the model on its data, which is slow for large data
+// files, so output is cached in a directory next to the model, in a file
+// named by the hash of the model file, the data file and the parser binary.
+static const size_t max_cached_outputs = 16;
+
+// FNV-1a over the contents of the files.
+static uint64_t hash_files(const vector<filesystem::path>& paths) {
+  uint64_t hash = 14695981039346656037ull;
+  vector<char> buffer(1 << 20);
+  for (const auto& path : paths) {
+    ifstream in(path, ios::binary);
+    if (!in) {
+      throw runtime_error("Could not read " + path.string() + ".");
+    }
+    while (in.read(buffer.data(), buffer.size()) || in.gcount() > 0) {
+      for (streamsize bi = 0; bi < in.gcount(); ++bi) {
+        hash = (hash ^ static_cast<unsigned char>(buffer[bi])) * 1099511628211ull;
+      }
+    }
+    // Separates the files, so that moving bytes between them changes the hash.
+    hash = (hash ^ 0xff) * 1099511628211ull;
+  }
+  return hash;
+}
+
+static filesystem::path parser_cache_dir(const string& model_file) {
+  return filesystem::absolute(model_file).parent_path() / ".vd-parser-cache";
+}
+
+static optional<string> read_cached_output(const filesystem::path& path) {
+  ifstream in(path, ios::binary);
+  if (!in) {
+    return nullopt;
+  }
+  stringstream contents;
+  contents << in.rdbuf();
+  return contents.str();
+}
+
+// Written to a temporary file first, so that concurrent backends never
+// read a partial entry. Least recently written entries beyond
+// max_cached_outputs are removed.
+static void write_cached_output(const filesystem::path& path, const string& output) {
+  filesystem::create_directories(path.parent_path());
+  filesystem::path temp_path = path;
+  temp_path += "." + boost::uuids::to_string(boost::uuids::random_generator()()) + ".tmp";
+  {
+    ofstream out(temp_path, ios::binary | ios::trunc);
+    out.write(output.data(), output.size());
+    if (!out) {
+      throw runtime_error("Could not write " + temp_path.string() + ".");
+    }
+  }
+  filesystem::rename(temp_path, path);
+
+  vector<filesystem::directory_entry> entries;
+  for (const auto& entry : filesystem::directory_iterator(path.parent_path())) {
+    if (entry.path().extension() == ".vdparse") {
+      entries.push_back(entry);
+    }
+  }
+  if (entries.size() > max_cached_outputs) {
+    sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+      return a.last_write_time() > b.last_write_time();
+    });
+    for (size_t ei = max_cached_outputs; ei < entries.size(); ++ei) {
+      filesystem::remove(entries[ei].path());
+    }
+  }
+}
+
 std::optional<ParserOutput> run_model_parser(
   const std::string& model_file,
-  const std::string& data_file
+  const std::string& data_file,
+  bool use_cache
 ) {
   // Get executable directory for finding sibling executables
   boost::filesystem::path exec_path = boost::dll::program_location();
@@ -36,69 +117,111 @@ std::optional<ParserOutput> run_model_parser(
 
   // Check that vd-model-parser exists before trying to run it
   if (!boost::filesystem::exists(model_parser_path)) {
-    cerr << "Error: vd-model-parser executable not found at: " << model_parser_path << endl;
+    VD_LOG(error, parser) << "vd-model-parser executable not found at: " << model_parser_path;
     return std::nullopt;
   }
 
+  // The cache is only an optimization, so failing to use it is not fatal.
+  optional<filesystem::path> cache_path;
+  if (use_cache) {
+    try {
+      uint64_t key = hash_files({ model_file, data_file, model_parser_path.string() });
+      stringstream name;
+      name << hex << setw(16) << setfill('0') << key << ".vdparse";
+      cache_path = parser_cache_dir(model_file) / name.str();
+      if (auto cached = read_cached_output(*cache_path)) {
+        VD_LOG(info, parser) << "Using cached parser output " << cache_path->string() << ".";
+        // An entry that does not decode, e.g. one truncated on disk, is
+        // removed and the parser run as on a miss, rewriting it.
+        optional<ParserOutput> output;
+        try {
+          model_stream_reader reader;
+          reader.feed(*cached);
+          output = reader.finish();
+        } catch (const std::exception& err) {
+          VD_LOG(warn, parser) << "Could not decode cached parser output: " << err.what();
+        }
+        if (output) {
+          return output;
+        }
+        VD_LOG(warn, parser) << "Removing corrupt parser cache entry " << cache_path->string() << ".";
+        filesystem::remove(*cache_path);
+      }
+    } catch (const std::exception& err) {
+      VD_LOG(warn, parser) << "Could not check the parser cache: " << err.what();
+      cache_path.reset();
+    }
+  }
+
   asio::io_context ioc;
   asio::readable_pipe interp_pipe{ioc};
 
-  cout << "Running parser: " << model_parser_path << endl;
+  VD_LOG(info, parser) << "Running parser: " << model_parser_path;
 
   proc::process interp_proc(
     ioc,
     model_parser_path.string(),
-    { model_file, "-d", data_file },
+    { model_file, "-d", data_file, "-b" },
     proc::process_stdio({{}, interp_pipe, {}})
   );
 
-  string interp_data;
+  // The graph is built from each chunk as it arrives. The output is only
+  // kept whole if it is to be cached; otherwise just its start is kept, to
+  // report errors.
+  const size_t error_output_size = 4096;
+  model_stream_reader reader;
+  optional<string> stream_error;
+  string raw_output;
+  vector<char> chunk(1 << 16);
   boost::system::error_code pipe_code;
-  asio::read(interp_pipe, asio::dynamic_buffer(interp_data), pipe_code);
+  size_t num_read;
+  while ((num_read = interp_pipe.read_some(asio::buffer(chunk), pipe_code)) > 0 || !pipe_code) {
+    string_view bytes(chunk.data(), num_read);
+    if (cache_path) {
+      raw_output.append(bytes);
+    } else if (raw_output.size() < error_output_size) {
+      raw_output.append(bytes.substr(0, error_output_size - raw_output.size()));
+    }
+    // Keep reading after an error, so that the parser can finish.
+    if (!stream_error) {
+      try {
+        reader.feed(bytes);
+      } catch (const std::exception& err) {
+        stream_error = err.what();
+      }
+    }
+  }
 
   bool pipe_done = (pipe_code == asio::error::eof)
     || (pipe_code == asio::error::broken_pipe);
   if (!pipe_done) {
-    cerr << "Error reading model parser output: " << pipe_code.message() << endl;
+    VD_LOG(error, parser) << "Error reading model parser output: " << pipe_code.message();
     return std::nullopt;
   }
 
   int exit_code = interp_proc.wait();
 
   if (exit_code != 0) {
-    cerr << "Error: model parser exited with code " << exit_code << endl;
-    if (!interp_data.empty()) {
-      cerr << "Parser output:\n" << interp_data << endl;
+    VD_LOG(error, parser) << "Model parser exited with code " << exit_code;
+    if (!raw_output.empty()) {
+      VD_LOG(error, parser) << "Parser output:\n" << raw_output.substr(0, error_output_size);
     }
     return std::nullopt;
   }
-
-  cout << "Parser ran successfully" << endl;
-
-  // Strip \r characters (Windows pipes may produce \r\n line endings)
-  interp_data.erase(
-    std::remove(interp_data.begin(), interp_data.end(), '\r'),
-    interp_data.end());
-
-  // Check for empty output
-  if (interp_data.empty()) {
-    cerr << "Error: model parser produced no output." << endl;
-    return std::nullopt;
-  }
-
-  // Split output into factor graph data and tree data
-  const size_t tree_begin = interp_data.find("\n--");
-  if (tree_begin == string::npos) {
-    cerr << "Error: Parser output missing '--' delimiter. Malformed output." << endl;
-    cerr << "Output was:\n" << interp_data.substr(0, 500);
-    if (interp_data.size() > 500) cerr << "... (truncated)";
-    cerr << endl;
+  if (stream_error) {
+    VD_LOG(error, parser) << "Could not read model parser output: " << *stream_error;
     return std::nullopt;
   }
 
-  ParserOutput output;
-  output.fg_data = interp_data.substr(0, tree_begin);
-  output.tree_data = interp_data.substr(tree_begin + 4);
+  VD_LOG(info, parser) << "Parser ran successfully";
 
+  auto output = reader.finish();
+  if (output && cache_path) {
+    try {
+      write_cached_output(*cache_path, raw_output);
+    } catch (const std::exception& err) {
+      VD_LOG(warn, parser) << "Could not cache parser output: " << err.what();
+    }
+  }
   return output;
 }
@@ -0,0 +1,468 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+#include <Eigen/Dense>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <binary_io.hpp>
+#include <logging.hpp>
+#include <sample_cache.hpp>
+
+using namespace std;
+namespace fs = std::filesystem;
+namespace ipc = boost::interprocess;
+
+// Layout (native byte order, the cache never leaves the machine):
+//   magic, version, num_chains, then per chain: file size, mtime
+//   complete flag, requested column names (if not complete)
+//   precision, cols, loaded column names
+//   number of chunks, rows in each chunk
+//   number of chains with known draws (0 or num_chains), draws of each
+//   padding to 8 bytes
+//   the chunks, each holding its rows of every column in column-major order
+// Chunks split the draws by rows, never spanning two chains. A cache built
+// in memory has a single chunk, which is exactly a column-major matrix; an
+// out-of-core cache has a chunk per chain, so that each column's draws are
+// contiguous within every chain however many columns there are, and is
+// filled in through a mapping as the CSVs are parsed.
+static const char cache_magic[8] = { 'V', 'D', 'S', 'A', 'M', 'P', 'L', 'E' };
+static const uint32_t cache_version = 4;
+
+// Rows are parsed out of core in blocks of about this many bytes per chain,
+// then copied column by column into the chain's chunk.
+static const size_t block_bytes = size_t(64) << 20;
+
+struct chain_stamp {
+  uint64_t size;
+  int64_t mtime;
+
+  bool operator==(const chain_stamp& other) const {
+    return size == other.size && mtime == other.mtime;
+  }
+};
+
+static string cache_path(const string& file_prefix) {
+  return file_prefix + ".vdcache";
+}
+
+static vector<chain_stamp> chain_stamps(const string& file_prefix, int num_chains) {
+  vector<chain_stamp> stamps;
+  for(int ci = 1; ci <= num_chains; ++ci) {
+    fs::path chain_path = stan_chain_path(file_prefix, ci);
+    stamps.push_back({
+      static_cast<uint64_t>(fs::file_size(chain_path)),
+      static_cast<int64_t>(fs::last_write_time(chain_path).time_since_epoch().count())
+    });
+  }
+  return stamps;
+}
+
+template<class T> static void write_value(ofstream& out, const T& value) {
+  out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+static void write_strings(ofstream& out, const vector<string>& strings) {
+  write_value<uint64_t>(out, strings.size());
+  for(const string& str: strings) {
+    write_value<uint32_t>(out, str.size());
+    out.write(str.data(), str.size());
+  }
+}
+
+// The mapping and region must stay alive as long as the matrix views them.
+struct mapped_cache {
+  ipc::file_mapping mapping;
+  ipc::mapped_region region;
+};
+
+struct cache_chunk {
+  Eigen::Index first_row;
+  Eigen::Index rows;
+  const char* values;
+};
+
+// Draws in a cache with several chunks. Each requested column is gathered
+// from every chunk of the mapping, so only the pages of columns that are
+// actually used are ever read from disk.
+class chunked_sample_matrix final : public sample_matrix {
+public:
+  chunked_sample_matrix(vector<cache_chunk> chunks, Eigen::Index cols, sample_precision precision)
+    : _chunks(std::move(chunks)), _cols(cols), _precision(precision) {}
+
+  Eigen::Index rows() const override {
+    return _chunks.empty() ? 0 : _chunks.back().first_row + _chunks.back().rows;
+  }
+  Eigen::Index cols() const override { return _cols; }
+  sample_precision precision() const override { return _precision; }
+
+  Eigen::MatrixXd columns(const vector<int>& cols) const override {
+    Eigen::MatrixXd out(rows(), cols.size());
+    for(const cache_chunk& chunk: _chunks) {
+      if(_precision == sample_precision::f32) {
+        Eigen::Map<const Eigen::MatrixXf> values(reinterpret_cast<const float*>(chunk.values), chunk.rows, _cols);
+        out.middleRows(chunk.first_row, chunk.rows) = values(Eigen::all, cols).cast<double>();
+      } else {
+        Eigen::Map<const Eigen::MatrixXd> values(reinterpret_cast<const double*>(chunk.values), chunk.rows, _cols);
+        out.middleRows(chunk.first_row, chunk.rows) = values(Eigen::all, cols);
+      }
+    }
+    return out;
+  }
+
+private:
+  vector<cache_chunk> _chunks;
+  Eigen::Index _cols;
+  sample_precision _precision;
+};
+
+static size_t value_size(sample_precision precision) {
+  return precision == sample_precision::f32 ? sizeof(float) : sizeof(double);
+}
+
+static vector<string> column_names(const stan_var_map& vars) {
+  vector<string> names(vars.size());
+  for(const auto& [name, col]: vars) {
+    names[col] = name;
+  }
+  return names;
+}
+
+// Writes everything up to the first chunk and returns its offset.
+static size_t write_cache_header(ofstream& out, const string& file_prefix, int num_chains,
+                                 const optional<set<string>>& columns, sample_precision precision,
+                                 const stan_var_map& vars, const vector<uint64_t>& chunk_rows,
+                                 const vector<long>& chain_rows) {
+  out.write(cache_magic, sizeof(cache_magic));
+  write_value<uint32_t>(out, cache_version);
+  write_value<uint32_t>(out, num_chains);
+  for(const chain_stamp& stamp: chain_stamps(file_prefix, num_chains)) {
+    write_value(out, stamp);
+  }
+  write_value<uint8_t>(out, columns ? 0 : 1);
+  if(columns) {
+    write_strings(out, vector<string>(columns->begin(), columns->end()));
+  }
+
+  write_value<uint8_t>(out, static_cast<uint8_t>(precision));
+  write_value<uint64_t>(out, vars.size());
+  write_strings(out, column_names(vars));
+  write_value<uint64_t>(out, chunk_rows.size());
+  for(uint64_t rows: chunk_rows) {
+    write_value(out, rows);
+  }
+  write_value<uint64_t>(out, chain_rows.size());
+  for(long rows: chain_rows) {
+    write_value<uint64_t>(out, rows);
+  }
+  const char padding[8] = {};
+  out.write(padding, (8 - static_cast<size_t>(out.tellp()) % 8) % 8);
+  return out.tellp();
+}
+
+// Writes the given rows of every column, converted to the cache precision.
+static void write_chunk(ostream& out, const Eigen::Ref<const Eigen::MatrixXd>& values, sample_precision precision) {
+  if(precision == sample_precision::f32) {
+    Eigen::MatrixXf narrowed = values.cast<float>();
+    out.write(reinterpret_cast<const char*>(narrowed.data()), narrowed.size() * sizeof(float));
+  } else {
+    for(Eigen::Index col = 0; col < values.cols(); ++col) {
+      out.write(reinterpret_cast<const char*>(values.col(col).data()), values.rows() * sizeof(double));
+    }
+  }
+}
+
+// Reads the header up to the chain stamps, and returns why the cache cannot
+// be used for these chains, if it cannot.
+static optional<string> stale_reason(binary_reader& reader, const string& file_prefix, int num_chains) {
+  if(memcmp(reader.take(sizeof(cache_magic)), cache_magic, sizeof(cache_magic)) != 0
+     || reader.read<uint32_t>() != cache_version) {
+    return "has an unknown format";
+  }
+
+  vector<chain_stamp> stamps = chain_stamps(file_prefix, num_chains);
+  if(reader.read<uint32_t>() != static_cast<uint32_t>(num_chains)) {
+    return "is for a different number of chains";
+  }
+  for(int ci = 0; ci < num_chains; ++ci) {
+    chain_stamp stamp = reader.read<chain_stamp>();
+    if(!(stamp == stamps[ci])) {
+      return "is out of date";
+    }
+  }
+  return nullopt;
+}
+
+bool sample_cache_current(const string& file_prefix, int num_chains) {
+  string path = cache_path(file_prefix);
+  if(!fs::exists(path)) {
+    return false;
+  }
+  try {
+    ipc::file_mapping mapping(path.c_str(), ipc::read_only);
+    ipc::mapped_region region(mapping, ipc::read_only);
+    binary_reader reader(static_cast<const char*>(region.get_address()), region.get_size(), "Sample cache");
+    return !stale_reason(reader, file_prefix, num_chains);
+  } catch (const std::exception&) {
+    return false;
+  }
+}
+
+optional<standata> read_sample_cache(const string& file_prefix, int num_chains,
+                                     const optional<set<string>>& columns, sample_precision precision) {
+  string path = cache_path(file_prefix);
+  if(!fs::exists(path)) {
+    return nullopt;
+  }
+
+  try {
+    auto cache = make_shared<mapped_cache>();
+    cache->mapping = ipc::file_mapping(path.c_str(), ipc::read_only);
+    cache->region = ipc::mapped_region(cache->mapping, ipc::read_only);
+    binary_reader reader(static_cast<const char*>(cache->region.get_address()), cache->region.get_size(), "Sample cache");
+
+    if(optional<string> reason = stale_reason(reader, file_prefix, num_chains)) {
+      VD_LOG(info, samples) << "Sample cache " << path << " " << *reason << ".";
+      return nullopt;
+    }
+
+    bool complete = reader.read<uint8_t>() != 0;
+    if(!complete) {
+      vector<string> requested = reader.read_strings();
+      set<string> cached_columns(requested.begin(), requested.end());
+      bool covers = columns && std::includes(cached_columns.begin(), cached_columns.end(),
+                                             columns->begin(), columns->end());
+      if(!covers) {
+        VD_LOG(info, samples) << "Sample cache " << path << " does not hold every needed column.";
+        return nullopt;
+      }
+    }
+
+    if(static_cast<sample_precision>(reader.read<uint8_t>()) != precision) {
+      VD_LOG(info, samples) << "Sample cache " << path << " was written in a different precision.";
+      return nullopt;
+    }
+    uint64_t cols = reader.read<uint64_t>();
+    vector<string> names = reader.read_strings();
+    if(names.size() != cols) {
+      throw runtime_error("Sample cache column count mismatch.");
+    }
+    vector<cache_chunk> chunks(reader.read<uint64_t>());
+    Eigen::Index rows = 0;
+    for(cache_chunk& chunk: chunks) {
+      chunk.first_row = rows;
+      chunk.rows = reader.read<uint64_t>();
+      rows += chunk.rows;
+    }
+    uint64_t chains_with_rows = reader.read<uint64_t>();
+    if(chains_with_rows != 0 && chains_with_rows != static_cast<uint64_t>(num_chains)) {
+      throw runtime_error("Sample cache chain count mismatch.");
+    }
+    vector<long> chain_rows(chains_with_rows);
+    for(long& chain_draws: chain_rows) {
+      chain_draws = reader.read<uint64_t>();
+    }
+    reader.take((8 - reader.pos() % 8) % 8);
+    for(cache_chunk& chunk: chunks) {
+      chunk.values = reader.take(chunk.rows * cols * value_size(precision));
+    }
+
+    stan_var_map vars;
+    for(uint64_t ci = 0; ci < cols; ++ci) {
+      vars.emplace(names[ci], ci);
+    }
+
+    size_t num_chunks = chunks.size();
+    unique_ptr<sample_matrix> samples;
+    if(num_chunks != 1) {
+      samples = make_unique<chunked_sample_matrix>(std::move(chunks), cols, precision);
+    } else if(precision == sample_precision::f32) {
+      samples = make_unique<dense_sample_matrix>(reinterpret_cast<const float*>(chunks[0].values), rows, cols);
+    } else {
+      samples = make_unique<dense_sample_matrix>(reinterpret_cast<const double*>(chunks[0].values), rows, cols);
+    }
+
+    VD_LOG(info, samples) << "Mapped " << rows << " x " << cols << " matrix in " << num_chunks
+                          << " chunk(s) from sample cache " << path << ".";
+    return standata {
+      .samples = std::move(samples),
+      .vars = std::move(vars),
+      .storage = cache,
+      .mapped = true,
+      .chain_rows = std::move(chain_rows)
+    };
+  } catch (const std::exception& err) {
+    VD_LOG(warn, samples) << "Could not read sample cache " << path << ": " << err.what();
+    return nullopt;
+  }
+}
+
+void write_sample_cache(const string& file_prefix, int num_chains,
+                        const optional<set<string>>& columns, const standata& data) {
+  string path = cache_path(file_prefix);
+  string temp_path = path + ".tmp";
+  const sample_matrix& samples = *data.samples;
+
+  {
+    ofstream out(temp_path, ios::binary | ios::trunc);
+    if(!out) {
+      throw runtime_error("Could not open " + temp_path + " for writing.");
+    }
+    write_cache_header(out, file_prefix, num_chains, columns, samples.precision(), data.vars,
+                       { static_cast<uint64_t>(samples.rows()) }, data.chain_rows);
+    for(int col = 0; col < samples.cols(); ++col) {
+      write_chunk(out, samples.col(col), samples.precision());
+    }
+
+    if(!out) {
+      throw runtime_error("Failed while writing " + temp_path + ".");
+    }
+  }
+  fs::rename(temp_path, path);
+}
+
+void write_sample_cache_out_of_core(const string& file_prefix, int num_chains,
+                                    const optional<set<string>>& columns, sample_precision precision,
+                                    shared_ptr<const scanned_chains> scanned) {
+  string path = cache_path(file_prefix);
+  string temp_path = path + ".tmp";
+
+  // Each chain's chunk and draws.
+  vector<size_t> chunk_offsets;
+  vector<long> chunk_rows;
+  ipc::file_mapping mapping;
+  ipc::mapped_region region;
+
+  auto on_layout = [&](const stan_var_map& vars, const vector<long>& chain_rows) {
+    long block_rows = max<long>(1, block_bytes / max<size_t>(1, vars.size() * sizeof(double)));
+    chunk_rows = chain_rows;
+
+    ofstream out(temp_path, ios::binary | ios::trunc);
+    if(!out) {
+      throw runtime_error("Could not open " + temp_path + " for writing.");
+    }
+    size_t offset = write_cache_header(out, file_prefix, num_chains, columns, precision, vars,
+                                       vector<uint64_t>(chain_rows.begin(), chain_rows.end()), chain_rows);
+    for(long rows: chain_rows) {
+      chunk_offsets.push_back(offset);
+      offset += rows * vars.size() * value_size(precision);
+    }
+    out.close();
+    fs::resize_file(temp_path, offset);
+    if(offset > 0) {
+      mapping = ipc::file_mapping(temp_path.c_str(), ipc::read_write);
+      region = ipc::mapped_region(mapping, ipc::read_write);
+    }
+    return block_rows;
+  };
+
+  auto on_block = [&](int chain, long first_draw, Eigen::Ref<const Eigen::MatrixXd> block) {
+    char* chunk = static_cast<char*>(region.get_address()) + chunk_offsets[chain];
+    for(Eigen::Index col = 0; col < block.cols(); ++col) {
+      long first = col * chunk_rows[chain] + first_draw;
+      if(precision == sample_precision::f32) {
+        Eigen::Map<Eigen::VectorXf>(reinterpret_cast<float*>(chunk) + first, block.rows()) = block.col(col).cast<float>();
+      } else {
+        Eigen::Map<Eigen::VectorXd>(reinterpret_cast<double*>(chunk) + first, block.rows()) = block.col(col);
+      }
+    }
+  };
+
+  read_stan_blocks(file_prefix, num_chains, columns, on_layout, on_block, std::move(scanned));
+  if(region.get_size() > 0 && !region.flush()) {
+    throw runtime_error("Failed while writing " + temp_path + ".");
+  }
+  region = ipc::mapped_region();
+  mapping = ipc::file_mapping();
+  fs::rename(temp_path, path);
+}
+
+uint64_t sample_fingerprint(const string& file_prefix, int num_chains, sample_precision precision) {
+  // FNV-1a over the chain paths, sizes and modification times.
+  uint64_t hash = 14695981039346656037ull;
+  auto mix = [&](const void* data, size_t size) {
+    for(size_t bi = 0; bi < size; ++bi) {
+      hash = (hash ^ static_cast<const unsigned char*>(data)[bi]) * 1099511628211ull;
+    }
+  };
+  vector<chain_stamp> stamps = chain_stamps(file_prefix, num_chains);
+  for(int ci = 0; ci < num_chains; ++ci) {
+    string path = stan_chain_path(file_prefix, ci + 1);
+    mix(path.data(), path.size());
+    mix(&stamps[ci], sizeof(chain_stamp));
+  }
+  mix(&precision, sizeof(precision));
+  return hash;
+}
+
+// The samples are usable without a cache, so failing to write one is only
+// worth a warning.
+static void try_write_sample_cache(const string& file_prefix, int num_chains,
+                                   const optional<set<string>>& columns, const standata& data) {
+  try {
+    write_sample_cache(file_prefix, num_chains, columns, data);
+    VD_LOG(info, samples) << "Wrote sample cache " << cache_path(file_prefix) << ".";
+  } catch (const std::exception& err) {
+    VD_LOG(warn, samples) << "Could not write sample cache: " << err.what();
+  }
+}
+
+static standata load_samples_unstamped(const string& file_prefix, int num_chains,
+                                       const optional<set<string>>& columns, sample_precision precision,
+                                       bool use_cache, bool out_of_core,
+                                       shared_ptr<const scanned_chains> scanned) {
+  if(use_cache) {
+    if(auto cached = read_sample_cache(file_prefix, num_chains, columns, precision)) {
+      return std::move(*cached);
+    }
+  }
+
+  if(out_of_core) {
+    write_sample_cache_out_of_core(file_prefix, num_chains, columns, precision, std::move(scanned));
+    VD_LOG(info, samples) << "Wrote out-of-core sample cache " << cache_path(file_prefix) << ".";
+    if(auto cached = read_sample_cache(file_prefix, num_chains, columns, precision)) {
+      return std::move(*cached);
+    }
+    throw runtime_error("Could not map the out-of-core sample cache " + cache_path(file_prefix) + ".");
+  }
+
+  standata data = read_stan_file(file_prefix, num_chains, columns, precision, std::move(scanned));
+  if(use_cache) {
+    try_write_sample_cache(file_prefix, num_chains, columns, data);
+  }
+  return data;
+}
+
+standata load_samples(const string& file_prefix, int num_chains,
+                      const optional<set<string>>& columns, sample_precision precision,
+                      bool use_cache, bool out_of_core, shared_ptr<const scanned_chains> scanned) {
+  // Stamp before loading, so chains that change while they are read give
+  // a fingerprint that will not match the next load.
+  uint64_t fingerprint = sample_fingerprint(file_prefix, num_chains, precision);
+  standata data = load_samples_unstamped(file_prefix, num_chains, columns, precision, use_cache, out_of_core,
+                                         std::move(scanned));
+  data.samples->set_fingerprint(fingerprint);
+  return data;
+}
+
+standata reload_samples(const standata& previous, const string& file_prefix, int num_chains,
+                        const optional<set<string>>& columns, sample_precision precision,
+                        bool use_cache, bool out_of_core) {
+  uint64_t fingerprint = sample_fingerprint(file_prefix, num_chains, precision);
+  optional<standata> appended;
+  if(!out_of_core) {
+    appended = append_stan_draws(previous, file_prefix, num_chains, columns, precision);
+  }
+  if(!appended) {
+    return load_samples(file_prefix, num_chains, columns, precision, use_cache, out_of_core);
+  }
+  if(use_cache) {
+    try_write_sample_cache(file_prefix, num_chains, columns, *appended);
+  }
+  appended->samples->set_fingerprint(fingerprint);
+  return std::move(*appended);
+}
@@ -1,13 +1,25 @@
 #include "save_state.hpp"
 
+#include <cstdint>
 #include <fstream>
+#include <iterator>
+#include <optional>
+#include <set>
 #include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/graph/adj_list_serialize.hpp>
 #include <boost/serialization/set.hpp>
 #include <boost/serialization/optional.hpp>
 #include <boost/serialization/map.hpp>
+#include <boost/serialization/utility.hpp>
+
+#include <binary_io.hpp>
+#include <compression.hpp>
+#include <logging.hpp>
 
 void save_tree(const MTree& tree, Node root, const std::string& filename) {
     std::ofstream ofs(filename);
@@ -47,21 +59,313 @@ std::tuple<FG, FG_Map, FG_Map> load_fg(const std::string& filename) {
     return {std::move(fg), std::move(fg_params), std::move(fg_factors)};
 }
 
+// Binary archive layout (native byte order):
+//   magic, version, flags, payload size, stored size, CRC-32 of the stored
+//   payload, then the payload, zlib-compressed if flags say so.
+// The payload starts with a string table; parameter and factor names are
+// stored once there and referred to by index everywhere else.
+static const char state_magic[8] = { 'V', 'D', 'S', 'T', 'A', 'T', 'E', '\0' };
+// Version 2 added derived state, version 3 its number of chains.
+static const std::uint32_t state_version = 3;
+static const std::uint32_t compressed_payload = 1;
+
+namespace {
+
+// Interns strings, so that each distinct name is written once.
+class string_table {
+public:
+    std::uint32_t id(const std::string& str) {
+        auto [it, inserted] = ids.emplace(str, strings.size());
+        if (inserted) {
+            strings.push_back(str);
+        }
+        return it->second;
+    }
+
+    std::unordered_map<std::string, std::uint32_t> ids;
+    std::vector<std::string> strings;
+};
+
+}
+
+static void write_tree(binary_writer& out, string_table& names, const MTree& tree, Node root) {
+    out.write<std::int32_t>(tree[root].name);
+
+    std::unordered_map<Node, std::uint32_t> index;
+    out.write<std::uint64_t>(num_vertices(tree));
+    for (auto vi = vertices(tree).first; vi != vertices(tree).second; ++vi) {
+        const MarkovNode& node = tree[*vi];
+        index.emplace(*vi, index.size());
+        out.write<std::int32_t>(node.name);
+        out.write<std::int32_t>(node.depth);
+        out.write<std::uint8_t>(node.ered.has_value());
+        out.write<double>(node.ered.value_or(0));
+        out.write<std::uint8_t>(node.ered_interval.has_value());
+        out.write<double>(node.ered_interval ? node.ered_interval->first : 0);
+        out.write<double>(node.ered_interval ? node.ered_interval->second : 0);
+        out.write<std::uint32_t>(node.parameters.size());
+        for (const std::string& param : node.parameters) {
+            out.write<std::uint32_t>(names.id(param));
+        }
+        out.write<std::uint32_t>(node.chain_nums.size());
+        for (int chain_num : node.chain_nums) {
+            out.write<std::int32_t>(chain_num);
+        }
+    }
+
+    // Edges are written in out-edge order, so children keep their order.
+    out.write<std::uint64_t>(num_edges(tree));
+    for (auto vi = vertices(tree).first; vi != vertices(tree).second; ++vi) {
+        for (auto ei = out_edges(*vi, tree).first; ei != out_edges(*vi, tree).second; ++ei) {
+            out.write<std::uint32_t>(index.at(source(*ei, tree)));
+            out.write<std::uint32_t>(index.at(target(*ei, tree)));
+        }
+    }
+}
+
+static std::pair<std::unique_ptr<MTree>, Node> read_tree(binary_reader& in, const std::vector<std::string>& names) {
+    auto tree = std::make_unique<MTree>();
+    int root_name = in.read<std::int32_t>();
+    std::optional<Node> root;
+
+    std::vector<Node> nodes(in.read<std::uint64_t>());
+    for (Node& node : nodes) {
+        MarkovNode data;
+        data.name = in.read<std::int32_t>();
+        data.depth = in.read<std::int32_t>();
+        bool has_ered = in.read<std::uint8_t>();
+        double ered = in.read<double>();
+        if (has_ered) {
+            data.ered = ered;
+        }
+        bool has_interval = in.read<std::uint8_t>();
+        double lower = in.read<double>();
+        double upper = in.read<double>();
+        if (has_interval) {
+            data.ered_interval = std::make_pair(lower, upper);
+        }
+        std::uint32_t num_params = in.read<std::uint32_t>();
+        for (std::uint32_t pi = 0; pi < num_params; ++pi) {
+            data.parameters.insert(names.at(in.read<std::uint32_t>()));
+        }
+        std::uint32_t num_chains = in.read<std::uint32_t>();
+        for (std::uint32_t ci = 0; ci < num_chains; ++ci) {
+            data.chain_nums.insert(in.read<std::int32_t>());
+        }
+        node = add_vertex(std::move(data), *tree);
+        if ((*tree)[node].name == root_name) {
+            root = node;
+        }
+    }
+
+    std::uint64_t edge_count = in.read<std::uint64_t>();
+    for (std::uint64_t ei = 0; ei < edge_count; ++ei) {
+        std::uint32_t from = in.read<std::uint32_t>();
+        std::uint32_t to = in.read<std::uint32_t>();
+        add_edge(nodes.at(from), nodes.at(to), *tree);
+    }
+
+    if (!root) {
+        throw std::runtime_error("Root node not found in loaded state");
+    }
+    return {std::move(tree), *root};
+}
+
+template <class Map>
+static void write_vertex_map(binary_writer& out, string_table& names, const Map& vertex_map) {
+    out.write<std::uint64_t>(vertex_map.size());
+    for (const auto& [name, vertex] : vertex_map) {
+        out.write<std::uint32_t>(names.id(name));
+        out.write<std::uint64_t>(vertex);
+    }
+}
+
+template <class Map>
+static Map read_vertex_map(binary_reader& in, const std::vector<std::string>& names) {
+    Map vertex_map;
+    std::uint64_t count = in.read<std::uint64_t>();
+    for (std::uint64_t mi = 0; mi < count; ++mi) {
+        const std::string& name = names.at(in.read<std::uint32_t>());
+        vertex_map.emplace(name, in.read<std::uint64_t>());
+    }
+    return vertex_map;
+}
+
+static void write_fg(binary_writer& out, string_table& names,
+                     const FG& fg, const FG_Map& fg_params, const FG_Map& fg_factors) {
+    out.write<std::uint64_t>(num_vertices(fg));
+    for (auto vi = vertices(fg).first; vi != vertices(fg).second; ++vi) {
+        out.write<std::uint32_t>(names.id(fg[*vi].name));
+        out.write<std::uint8_t>(fg[*vi].is_factor);
+        out.write<std::uint8_t>(fg[*vi].is_lik);
+    }
+    out.write<std::uint64_t>(num_edges(fg));
+    for (auto ei = edges(fg).first; ei != edges(fg).second; ++ei) {
+        out.write<std::uint64_t>(source(*ei, fg));
+        out.write<std::uint64_t>(target(*ei, fg));
+    }
+    write_vertex_map(out, names, fg_params);
+    write_vertex_map(out, names, fg_factors);
+}
+
+static std::tuple<FG, FG_Map, FG_Map> read_fg(binary_reader& in, const std::vector<std::string>& names) {
+    FG fg(in.read<std::uint64_t>());
+    for (auto vi = vertices(fg).first; vi != vertices(fg).second; ++vi) {
+        fg[*vi].name = names.at(in.read<std::uint32_t>());
+        fg[*vi].is_factor = in.read<std::uint8_t>();
+        fg[*vi].is_lik = in.read<std::uint8_t>();
+    }
+    std::uint64_t edge_count = in.read<std::uint64_t>();
+    for (std::uint64_t ei = 0; ei < edge_count; ++ei) {
+        std::uint64_t from = in.read<std::uint64_t>();
+        std::uint64_t to = in.read<std::uint64_t>();
+        if (from >= num_vertices(fg) || to >= num_vertices(fg)) {
+            throw std::runtime_error("Archive has an edge to a missing factor graph vertex.");
+        }
+        add_edge(from, to, fg);
+    }
+    FG_Map fg_params = read_vertex_map<FG_Map>(in, names);
+    FG_Map fg_factors = read_vertex_map<FG_Map>(in, names);
+    return {std::move(fg), std::move(fg_params), std::move(fg_factors)};
+}
+
+static void write_name_set(binary_writer& out, string_table& names, const std::set<std::string>& name_set) {
+    out.write<std::uint32_t>(name_set.size());
+    for (const std::string& name : name_set) {
+        out.write<std::uint32_t>(names.id(name));
+    }
+}
+
+static std::set<std::string> read_name_set(binary_reader& in, const std::vector<std::string>& names) {
+    std::set<std::string> name_set;
+    std::uint32_t count = in.read<std::uint32_t>();
+    for (std::uint32_t ni = 0; ni < count; ++ni) {
+        name_set.insert(names.at(in.read<std::uint32_t>()));
+    }
+    return name_set;
+}
+
+static void write_derived(binary_writer& out, string_table& names, const derived_state& derived) {
+    out.write<std::uint64_t>(num_vertices(derived.mrf));
+    for (auto vi = vertices(derived.mrf).first; vi != vertices(derived.mrf).second; ++vi) {
+        out.write<std::uint32_t>(names.id(derived.mrf[*vi].name));
+    }
+    out.write<std::uint64_t>(num_edges(derived.mrf));
+    for (auto ei = edges(derived.mrf).first; ei != edges(derived.mrf).second; ++ei) {
+        out.write<std::uint64_t>(source(*ei, derived.mrf));
+        out.write<std::uint64_t>(target(*ei, derived.mrf));
+    }
+    write_vertex_map(out, names, derived.param_vertices);
+
+    out.write<std::int32_t>(derived.complexity.num_lik);
+    out.write<std::uint64_t>(derived.complexity.closest_facs.size());
+    for (const auto& [param, factors] : derived.complexity.closest_facs) {
+        out.write<std::uint32_t>(names.id(param));
+        write_name_set(out, names, factors);
+    }
+
+    out.write<std::uint32_t>(names.id(derived.root_name));
+    out.write<std::uint8_t>(derived.leaves.has_value());
+    out.write<std::uint64_t>(derived.leaves ? derived.leaves->size() : 0);
+    for (const std::set<std::string>& leaf : derived.leaves.value_or(std::vector<std::set<std::string>>())) {
+        write_name_set(out, names, leaf);
+    }
+
+    out.write<double>(derived.global_adj_r);
+    out.write<std::uint64_t>(derived.sample_fingerprint);
+    out.write<std::int32_t>(derived.num_chains.value_or(0));
+}
+
+static derived_state read_derived(binary_reader& in, const std::vector<std::string>& names, std::uint32_t version) {
+    derived_state derived;
+    derived.mrf = MRF(in.read<std::uint64_t>());
+    for (auto vi = vertices(derived.mrf).first; vi != vertices(derived.mrf).second; ++vi) {
+        derived.mrf[*vi].name = names.at(in.read<std::uint32_t>());
+    }
+    std::uint64_t edge_count = in.read<std::uint64_t>();
+    for (std::uint64_t ei = 0; ei < edge_count; ++ei) {
+        std::uint64_t from = in.read<std::uint64_t>();
+        std::uint64_t to = in.read<std::uint64_t>();
+        if (from >= num_vertices(derived.mrf) || to >= num_vertices(derived.mrf)) {
+            throw std::runtime_error("Archive has an edge to a missing MRF vertex.");
+        }
+        add_edge(from, to, derived.mrf);
+    }
+    derived.param_vertices = read_vertex_map<VertexMap>(in, names);
+
+    derived.complexity.num_lik = in.read<std::int32_t>();
+    std::uint64_t num_params = in.read<std::uint64_t>();
+    for (std::uint64_t pi = 0; pi < num_params; ++pi) {
+        const std::string& param = names.at(in.read<std::uint32_t>());
+        derived.complexity.closest_facs.emplace(param, read_name_set(in, names));
+    }
+
+    derived.root_name = names.at(in.read<std::uint32_t>());
+    bool has_leaves = in.read<std::uint8_t>();
+    std::vector<std::set<std::string>> leaves(in.read<std::uint64_t>());
+    for (std::set<std::string>& leaf : leaves) {
+        leaf = read_name_set(in, names);
+    }
+    if (has_leaves) {
+        derived.leaves = std::move(leaves);
+    }
+
+    derived.global_adj_r = in.read<double>();
+    derived.sample_fingerprint = in.read<std::uint64_t>();
+    if (version >= 3) {
+        std::int32_t num_chains = in.read<std::int32_t>();
+        if (num_chains > 0) {
+            derived.num_chains = num_chains;
+        }
+    }
+    return derived;
+}
+
 void save_state(const MTree& tree, Node root,
                 const FG& fg, const FG_Map& fg_params, const FG_Map& fg_factors,
+                const derived_state& derived,
                 const std::string& sid,
-                const std::string& filename) {
-    std::ofstream ofs(filename);
-    if(ofs) {
-        boost::archive::text_oarchive oa(ofs);
-        int root_name = tree[root].name;
-        oa << sid << root_name << tree << fg << fg_params << fg_factors;
-    } else {
-        throw std::ios_base::failure("Failed to open arhive file for writing.");
+                const std::string& filename,
+                bool compress) {
+    string_table names;
+    binary_writer body;
+    body.write_string(sid);
+    write_tree(body, names, tree, root);
+    write_fg(body, names, fg, fg_params, fg_factors);
+    write_derived(body, names, derived);
+
+    binary_writer payload;
+    payload.write<std::uint64_t>(names.strings.size());
+    for (const std::string& name : names.strings) {
+        payload.write_string(name);
+    }
+    payload.data() += body.data();
+
+    std::string stored = compress ? zlib_compress(payload.data()) : std::move(payload.data());
+    std::uint64_t payload_size = compress ? payload.data().size() : stored.size();
+
+    binary_writer header;
+    header.data().append(state_magic, sizeof(state_magic));
+    header.write<std::uint32_t>(state_version);
+    header.write<std::uint32_t>(compress ? compressed_payload : 0);
+    header.write<std::uint64_t>(payload_size);
+    header.write<std::uint64_t>(stored.size());
+    header.write<std::uint32_t>(crc32_checksum(stored));
+
+    std::ofstream ofs(filename, std::ios::binary);
+    if (!ofs) {
+        throw std::ios_base::failure("Failed to open archive file for writing.");
+    }
+    ofs.write(header.data().data(), header.data().size());
+    ofs.write(stored.data(), stored.size());
+    if (!ofs) {
+        throw std::ios_base::failure("Failed while writing archive file.");
     }
 }
 
-std::tuple<std::unique_ptr<MTree>, Node, FG, FG_Map, FG_Map, std::string> load_state(const std::string& filename) {
+// Archives written before the binary format are Boost text archives.
+static std::tuple<std::unique_ptr<MTree>, Node, FG, FG_Map, FG_Map, std::optional<derived_state>, std::string>
+load_text_state(const std::string& filename) {
     auto tree = std::make_unique<MTree>();
     int root_name;
     FG fg;
@@ -75,8 +379,49 @@ std::tuple<std::unique_ptr<MTree>, Node, FG, FG_Map, FG_Map, std::string> load_s
 
     for (auto vi = vertices(*tree).first; vi != vertices(*tree).second; ++vi) {
         if ((*tree)[*vi].name == root_name) {
-            return {std::move(tree), *vi, std::move(fg), std::move(fg_params), std::move(fg_factors), sid};
+            return {std::move(tree), *vi, std::move(fg), std::move(fg_params), std::move(fg_factors), std::nullopt, sid};
         }
     }
     throw std::runtime_error("Root node not found in loaded state");
 }
+
+std::tuple<std::unique_ptr<MTree>, Node, FG, FG_Map, FG_Map, std::optional<derived_state>, std::string>
+load_state(const std::string& filename) {
+    std::ifstream ifs(filename, std::ios::binary);
+    if (!ifs) {
+        throw std::runtime_error("Could not open archive file " + filename);
+    }
+    std::string contents((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    if (contents.compare(0, sizeof(state_magic), state_magic, sizeof(state_magic)) != 0) {
+        VD_LOG(info, io) << "Loading text archive " << filename << ".";
+        return load_text_state(filename);
+    }
+
+    binary_reader header(contents.data(), contents.size(), "Archive " + filename);
+    header.take(sizeof(state_magic));
+    std::uint32_t version = header.read<std::uint32_t>();
+    if (version > state_version) {
+        throw std::runtime_error("Archive " + filename + " has format version " + std::to_string(version)
+                                 + ", newer than this backend supports (" + std::to_string(state_version) + ").");
+    }
+    std::uint32_t flags = header.read<std::uint32_t>();
+    std::uint64_t payload_size = header.read<std::uint64_t>();
+    std::uint64_t stored_size = header.read<std::uint64_t>();
+    std::uint32_t checksum = header.read<std::uint32_t>();
+    std::string_view stored(header.take(stored_size), stored_size);
+    if (crc32_checksum(stored) != checksum) {
+        throw std::runtime_error("Archive " + filename + " is corrupt (checksum mismatch).");
+    }
+
+    std::string payload = (flags & compressed_payload) ? zlib_decompress(stored, payload_size) : std::string(stored);
+    binary_reader in(payload.data(), payload.size(), "Archive " + filename);
+    std::vector<std::string> names = in.read_strings();
+    std::string sid = in.read_string();
+    auto [tree, root] = read_tree(in, names);
+    auto [fg, fg_params, fg_factors] = read_fg(in, names);
+    std::optional<derived_state> derived;
+    if (version >= 2) {
+        derived = read_derived(in, names, version);
+    }
+    return {std::move(tree), root, std::move(fg), std::move(fg_params), std::move(fg_factors), std::move(derived), sid};
+}
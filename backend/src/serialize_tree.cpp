@@ -2,11 +2,17 @@
 #include <queue>
 
 #include <boost/graph/adjacency_list.hpp>
+#include <logging.hpp>
+#include <metrics.hpp>
 #include <parameter_graph.hpp>
+#include <tracing.hpp>
 
 using namespace std;
 using namespace boost;
 
+static metrics::histogram serialize_seconds("vd_serialize_seconds", "Time spent serializing trees for the frontend.");
+static metrics::counter serialized_bytes("vd_serialized_bytes_total", "Bytes of serialized trees, before compression.");
+
 pair<string,string> serialize_node(const Node& node, const MTree& tree, string parent_name) {
   vector<string> ordered_params {};
   for(const string param: tree[node].parameters) {
@@ -34,6 +40,13 @@ pair<string,string> serialize_node(const Node& node, const MTree& tree, string p
   serialized_str += "\"name\":\"" + node_name + "\",";
   serialized_str += "\"params\":" + set_array + ",";
   serialized_str += "\"ered\":" + to_string(tree[node].ered.value()) + ",";
+  if(tree[node].stale) {
+    serialized_str += "\"stale\":true,";
+  }
+  if(tree[node].ered_interval) {
+    serialized_str += "\"ered_interval\":[" + to_string(tree[node].ered_interval->first) + ","
+                      + to_string(tree[node].ered_interval->second) + "],";
+  }
   serialized_str += "\"parent\":\"" + parent_name + "\"";
   serialized_str += "}";
 
@@ -58,6 +71,8 @@ string serialize_tree(
   const set<string>& globals, double global_limit,
   std::optional<std::string> sid
 ) {
+  metrics::scoped_timer timer(serialize_seconds);
+  tracing::span span("serialize_tree");
 
   queue<pair<Node, string>> node_queue{};
 
@@ -94,6 +109,8 @@ string serialize_tree(
     tree_str += ",\"sid\":\"" + *sid + "\"";
   }
   tree_str += "}";
-  cout << tree_str << endl;
+  VD_LOG(trace, io) << tree_str;
+  serialized_bytes.add(tree_str.size());
+  span.arg("bytes", tree_str.size());
   return tree_str;
 }
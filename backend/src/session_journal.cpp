@@ -0,0 +1,138 @@
+#include <filesystem>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include <compression.hpp>
+#include <logging.hpp>
+#include <session_journal.hpp>
+
+using namespace std;
+using json = nlohmann::json;
+
+session_journal::session_journal(string path) : _path(std::move(path)) {}
+
+// Snapshots are identified by the checksum of their contents, which are
+// read a chunk at a time, never whole.
+optional<uint32_t> session_journal::snapshot_checksum() const {
+  ifstream in(snapshot_path(), ios::binary);
+  if(!in) {
+    return nullopt;
+  }
+  uint32_t checksum = 0;
+  vector<char> chunk(1 << 20);
+  while(in.read(chunk.data(), chunk.size()) || in.gcount() > 0) {
+    checksum = crc32_checksum(string_view(chunk.data(), in.gcount()), checksum);
+  }
+  return checksum;
+}
+
+static json snapshot_header(optional<uint32_t> checksum) {
+  return json{{"snapshot", checksum ? json(*checksum) : json(nullptr)}};
+}
+
+optional<session_journal::contents> session_journal::read() const {
+  ifstream in(journal_path());
+  string line;
+  if(!in || !getline(in, line)) {
+    return nullopt;
+  }
+  if(json::parse(line, nullptr, false) != snapshot_header(snapshot_checksum())) {
+    VD_LOG(warn, io) << "Journal " << journal_path() << " predates snapshot " << snapshot_path() << ", ignoring it.";
+    return nullopt;
+  }
+
+  contents records;
+  long line_num = 1;
+  while(getline(in, line)) {
+    ++line_num;
+    // A crash can leave a record partly written, which open() then ends.
+    json record = json::parse(line, nullptr, false);
+    if(record.is_discarded()) {
+      VD_LOG(warn, io) << "Ignoring incomplete record on line " << line_num << " of journal " << journal_path() << ".";
+      continue;
+    }
+    if(record.contains("method")) {
+      records.calls.emplace_back(record.at("method"), record.at("args"));
+    } else if(record.contains("fit")) {
+      records.fits.emplace_back(record.at("fit"), record.at("ered"));
+    }
+  }
+  return records;
+}
+
+void session_journal::open() {
+  lock_guard<mutex> lock(_mutex);
+  if(auto records = read()) {
+    _calls = records->calls.size();
+    // End an incomplete last record, so that new records start on a line
+    // of their own.
+    ifstream in(journal_path(), ios::binary | ios::ate);
+    bool ends_line = true;
+    if(in.tellg() > 0) {
+      in.seekg(-1, ios::end);
+      ends_line = in.get() == '\n';
+    }
+    _out.open(journal_path(), ios::app);
+    if(!ends_line) {
+      _out << '\n';
+    }
+  } else {
+    start_journal();
+  }
+  if(!_out) {
+    throw runtime_error("Could not open journal " + journal_path() + ".");
+  }
+}
+
+// Written to a temporary file first, so that the journal on disk is
+// always complete.
+void session_journal::start_journal() {
+  _out.close();
+  string temp_path = journal_path() + ".tmp";
+  {
+    ofstream out(temp_path, ios::trunc);
+    out << snapshot_header(snapshot_checksum()).dump() << '\n';
+    if(!out) {
+      throw runtime_error("Could not write journal " + temp_path + ".");
+    }
+  }
+  filesystem::rename(temp_path, journal_path());
+  _out.open(journal_path(), ios::app);
+  _calls = 0;
+}
+
+void session_journal::append(const json& record) {
+  _out << record.dump() << '\n';
+  _out.flush();
+  if(!_out) {
+    VD_LOG(error, io) << "Failed to write to journal " << journal_path() << ".";
+  }
+}
+
+void session_journal::record_call(const string& method, const json& args) {
+  lock_guard<mutex> lock(_mutex);
+  append(json{{"method", method}, {"args", args}});
+  ++_calls;
+}
+
+void session_journal::record_fit(const string& key, double ered) {
+  lock_guard<mutex> lock(_mutex);
+  append(json{{"fit", key}, {"ered", ered}});
+}
+
+size_t session_journal::calls_since_snapshot() const {
+  lock_guard<mutex> lock(_mutex);
+  return _calls;
+}
+
+// A crash after the snapshot is replaced but before the journal is leaves
+// the old journal, which no longer matches and so is ignored.
+void session_journal::compact(const function<void(const string&)>& write_snapshot) {
+  lock_guard<mutex> lock(_mutex);
+  string temp_path = snapshot_path() + ".tmp";
+  write_snapshot(temp_path);
+  filesystem::rename(temp_path, snapshot_path());
+  start_journal();
+  VD_LOG(info, io) << "Compacted journal into snapshot " << snapshot_path() << ".";
+}
@@ -0,0 +1,111 @@
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+#include <logging.hpp>
+#include <metrics.hpp>
+#include <tracing.hpp>
+
+using namespace std;
+using json = nlohmann::json;
+
+namespace tracing {
+
+  atomic<bool> recording = false;
+
+  // Bounds the memory a long session can spend on spans; later ones are
+  // counted but not kept.
+  static const size_t max_events = 2'000'000;
+
+  static mutex trace_mutex;
+  static string trace_path;
+  static chrono::steady_clock::time_point trace_start;
+  static vector<json> events;
+  static size_t dropped_events = 0;
+
+  // Small, stable thread ids read better in trace viewers than native ones.
+  static atomic<int> next_thread_id = 1;
+  static int thread_id() {
+    thread_local int id = next_thread_id++;
+    return id;
+  }
+
+  void start(const string& path) {
+    lock_guard<mutex> lock(trace_mutex);
+    trace_path = path;
+    trace_start = chrono::steady_clock::now();
+    events.clear();
+    dropped_events = 0;
+    recording = true;
+    VD_LOG(info, startup) << "Recording a trace to " << path << ".";
+  }
+
+  void stop() {
+    vector<json> recorded;
+    size_t dropped;
+    string path;
+    {
+      lock_guard<mutex> lock(trace_mutex);
+      if(!recording) {
+        return;
+      }
+      recording = false;
+      recorded.swap(events);
+      dropped = dropped_events;
+      path = trace_path;
+    }
+
+    // Written an event at a time, since a long session's trace is large.
+    ofstream trace_file(path, ios::binary | ios::trunc);
+    trace_file << "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":" << dropped << "},\"traceEvents\":[";
+    for(size_t ei = 0; ei < recorded.size(); ++ei) {
+      trace_file << (ei == 0 ? "\n" : ",\n") << recorded[ei].dump();
+    }
+    trace_file << "\n]}\n";
+    if(!trace_file) {
+      VD_LOG(error, io) << "Could not write trace to " << path << ".";
+      return;
+    }
+    VD_LOG(info, io) << "Wrote " << recorded.size() << " spans to " << path
+                     << (dropped > 0 ? " (" + to_string(dropped) + " more dropped)." : ".");
+  }
+
+  void span::begin(string_view name) {
+    _active = true;
+    _name = name;
+    _start = chrono::steady_clock::now();
+  }
+
+  void span::end() {
+    auto finish = chrono::steady_clock::now();
+    const string& operation = metrics::current_operation();
+    if(!operation.empty()) {
+      _args["method"] = operation;
+    }
+    int tid = thread_id();
+
+    lock_guard<mutex> lock(trace_mutex);
+    // Spans begun before recording started, or ending after it stopped,
+    // are not part of the trace.
+    if(!recording || _start < trace_start) {
+      return;
+    }
+    if(events.size() >= max_events) {
+      ++dropped_events;
+      return;
+    }
+    json event = {
+      {"name", std::move(_name)},
+      {"ph", "X"},
+      {"ts", chrono::duration<double, micro>(_start - trace_start).count()},
+      {"dur", chrono::duration<double, micro>(finish - _start).count()},
+      {"pid", 1},
+      {"tid", tid}
+    };
+    if(!_args.is_null()) {
+      event["args"] = std::move(_args);
+    }
+    events.push_back(std::move(event));
+  }
+
+}
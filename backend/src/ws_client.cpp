@@ -1,18 +1,84 @@
 #include <simple-websocket-server/client_ws.hpp>
 #include <ws_client.hpp>
+#include <compression.hpp>
+#include <logging.hpp>
+#include <metrics.hpp>
+#include <tracing.hpp>
 #include <nlohmann/json.hpp>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <boost/asio/post.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/thread_pool.hpp>
 
 using namespace std;
 using json = nlohmann::json;
 using WsClient = SimpleWeb::SocketClient<SimpleWeb::WS>;
+namespace asio = boost::asio;
 
 unique_ptr<WsClient> ws_client;
+optional<size_t> ws_compress_threshold;
 
-void initialize_ws_client(const string& host, int port) {
+// The open connection to the server, for messages that are not replies.
+mutex server_connection_mutex;
+shared_ptr<WsClient::Connection> server_connection;
+
+// Handlers never run on the websocket I/O thread. Writes are serialized
+// through a strand so they apply in arrival order; reads go straight to
+// the pool and only wait for a write that is already running.
+unique_ptr<asio::thread_pool> method_pool;
+unique_ptr<asio::strand<asio::thread_pool::executor_type>> write_strand;
+shared_mutex state_mutex;
+
+// The shared lock a long write handler on this thread holds, for
+// apply_exclusively to trade for the exclusive one.
+static thread_local shared_lock<shared_mutex>* long_write_lock = nullptr;
+
+// Set while startup is still building the state handlers use.
+shared_future<void> methods_ready;
+
+static metrics::histogram method_seconds("vd_method_seconds", "Time spent running websocket method handlers.");
+static metrics::histogram method_queue_seconds("vd_method_queue_seconds", "Time websocket methods waited between arriving and running, including waits for startup and the state lock.");
+static metrics::counter method_failures("vd_method_failures_total", "Websocket method handlers that threw.");
+static metrics::histogram task_queue_seconds("vd_task_queue_seconds", "Time background tasks waited between being posted and running, by the method that posted them.");
+static metrics::counter sent_bytes("vd_ws_sent_bytes_total", "Bytes sent to the server, after compression.");
+
+// Websocket frame opcodes (with FIN bit set) for text and binary messages.
+const unsigned char text_frame = 129;
+const unsigned char binary_frame = 130;
+
+void initialize_ws_client(const string& host, int port, optional<size_t> compress_threshold) {
   string server_address = host + ":" + to_string(port);
   ws_client = make_unique<WsClient>(server_address);
-  cout << "WebSocket client configured to connect to: " << server_address << endl;
+  ws_compress_threshold = compress_threshold;
+  initialize_method_pool();
+  VD_LOG(info, ws) << "WebSocket client configured to connect to: " << server_address;
+  if(compress_threshold) {
+    VD_LOG(info, ws) << "Compressing messages larger than " << *compress_threshold << " bytes.";
+  }
+}
+
+void initialize_method_pool() {
+  method_pool = make_unique<asio::thread_pool>(std::max(2u, std::thread::hardware_concurrency()));
+  write_strand = make_unique<asio::strand<asio::thread_pool::executor_type>>(method_pool->get_executor());
+}
+
+// Sends large messages as zlib-compressed binary frames when compression
+// is enabled, and everything else as plain text frames.
+void send_message(WsClient::Connection& conn, const string& message) {
+  if(ws_compress_threshold && message.size() > *ws_compress_threshold) {
+    string compressed = zlib_compress(message);
+    sent_bytes.add(compressed.size());
+    conn.send(compressed, nullptr, binary_frame);
+  } else {
+    sent_bytes.add(message.size());
+    conn.send(message, nullptr, text_frame);
+  }
 }
 
 enum mtype { method };
@@ -20,41 +86,259 @@ enum mtype { method };
 map<string, mtype> msg_types = { {"method", method} };
 map<string, function<void(json, std::shared_ptr<WsClient::Connection>)>> method_handlers;
 
-void handle_method(std::string method_name, std::function<std::optional<std::string>(json)> handler) {
+// Handlers as registered, for invoke_method.
+map<string, pair<function<optional<string>(json)>, method_access>> registered_methods;
+
+// Everything the handler does, including the tasks it posts and the fits
+// it runs in parallel, is recorded in metrics under its method name.
+static optional<string> call_handler(const string& method_name, const function<optional<string>(json)>& handler,
+                                     const json& json_data, chrono::steady_clock::time_point arrived) {
+  VD_LOG(debug, ws) << "Running handler for " << method_name << ".";
+  metrics::operation_scope operation(method_name);
+  method_queue_seconds.observe(chrono::duration<double>(chrono::steady_clock::now() - arrived).count());
+  metrics::scoped_timer timer(method_seconds);
+  tracing::span span(method_name);
+  try {
+    return handler(json_data);
+  } catch (...) {
+    method_failures.add();
+    throw;
+  }
+}
+
+// A failed method is answered with an error, so that the client stops
+// waiting for its reply.
+static void send_error(WsClient::Connection& conn, const string& method_name, const string& message) {
+  send_message(conn, json{ {"type", "error"}, {"method", method_name}, {"message", message} }.dump());
+}
 
-  const auto handler_wrapper = [handler](json json_data, std::shared_ptr<WsClient::Connection> conn) {
-    cout << "Calling inner handler!" << endl;
-    auto message = handler(json_data);
+void run_handler(const string& method_name, const std::function<std::optional<std::string>(json)>& handler,
+                 const json& json_data, WsClient::Connection& conn, chrono::steady_clock::time_point arrived) {
+  try {
+    auto message = call_handler(method_name, handler, json_data, arrived);
     if(message != nullopt) {
-      conn -> send(message.value());
+      send_message(conn, message.value());
+    }
+  } catch (const std::exception& err) {
+    VD_LOG(error, ws) << "Handler for " << method_name << " failed: " << err.what();
+    send_error(conn, method_name, err.what());
+  } catch (...) {
+    VD_LOG(error, ws) << "Handler for " << method_name << " failed with an unknown error.";
+    send_error(conn, method_name, "Unknown error.");
+  }
+}
+
+void hold_methods_until(shared_future<void> ready) {
+  methods_ready = std::move(ready);
+}
+
+// Blocks until startup has finished. Returns false, having answered the
+// method with an error, if it failed.
+static bool wait_until_ready(const string& method_name, WsClient::Connection& conn) {
+  // Each thread waits on its own copy of the future.
+  shared_future<void> ready = methods_ready;
+  if(!ready.valid()) {
+    return true;
+  }
+  try {
+    ready.get();
+  } catch (const std::exception& err) {
+    VD_LOG(error, ws) << "Dropping " << method_name << ", startup failed: " << err.what();
+    send_error(conn, method_name, "Startup failed: " + string(err.what()));
+    return false;
+  }
+  return true;
+}
+
+void handle_method(std::string method_name, std::function<std::optional<std::string>(json)> handler,
+                   method_access access) {
+
+  const auto handler_wrapper = [method_name, handler, access](json json_data, std::shared_ptr<WsClient::Connection> conn) {
+    auto arrived = chrono::steady_clock::now();
+    if(access == method_access::stateless) {
+      asio::post(*method_pool, [=]() {
+        run_handler(method_name, handler, json_data, *conn, arrived);
+      });
+    } else if(access == method_access::read) {
+      asio::post(*method_pool, [=]() {
+        if(!wait_until_ready(method_name, *conn)) {
+          return;
+        }
+        shared_lock<shared_mutex> lock(state_mutex);
+        run_handler(method_name, handler, json_data, *conn, arrived);
+      });
+    } else if(access == method_access::long_write) {
+      // Running on the write strand, nothing else changes the state until
+      // the handler returns, even while it holds the lock only shared.
+      asio::post(*write_strand, [=]() {
+        if(!wait_until_ready(method_name, *conn)) {
+          return;
+        }
+        shared_lock<shared_mutex> lock(state_mutex);
+        long_write_lock = &lock;
+        run_handler(method_name, handler, json_data, *conn, arrived);
+        long_write_lock = nullptr;
+      });
+    } else {
+      asio::post(*write_strand, [=]() {
+        if(!wait_until_ready(method_name, *conn)) {
+          return;
+        }
+        unique_lock<shared_mutex> lock(state_mutex);
+        run_handler(method_name, handler, json_data, *conn, arrived);
+      });
     }
   };
 
   method_handlers.insert(make_pair(method_name, handler_wrapper));
+  registered_methods.insert(make_pair(method_name, make_pair(handler, access)));
+}
+
+void apply_exclusively(const function<void()>& apply) {
+  shared_lock<shared_mutex>* held = long_write_lock;
+  if(!held) {
+    apply();
+    return;
+  }
+  held->unlock();
+  long_write_lock = nullptr;
+  try {
+    unique_lock<shared_mutex> lock(state_mutex);
+    apply();
+  } catch (...) {
+    held->lock();
+    long_write_lock = held;
+    throw;
+  }
+  held->lock();
+  long_write_lock = held;
+}
+
+bool has_method(const string& method_name) {
+  return registered_methods.count(method_name) > 0;
+}
+
+optional<string> invoke_method(const string& method_name, const json& args) {
+  auto registered = registered_methods.find(method_name);
+  if(registered == registered_methods.end()) {
+    throw out_of_range("No method named " + method_name + ".");
+  }
+  const auto& [handler, access] = registered->second;
+  auto arrived = chrono::steady_clock::now();
+  if(access == method_access::stateless) {
+    return call_handler(method_name, handler, args, arrived);
+  }
+  // If startup failed, its exception is thrown here.
+  if(methods_ready.valid()) {
+    shared_future<void>(methods_ready).get();
+  }
+  if(access == method_access::read) {
+    shared_lock<shared_mutex> lock(state_mutex);
+    return call_handler(method_name, handler, args, arrived);
+  }
+  // Tasks on the write strand may run alongside, so long writes hold the
+  // lock exclusively throughout here.
+  unique_lock<shared_mutex> lock(state_mutex);
+  return call_handler(method_name, handler, args, arrived);
+}
+
+void post_task(std::function<void()> task, std::optional<method_access> access) {
+  auto run_task = [task, operation = metrics::current_operation(), posted = chrono::steady_clock::now()]() {
+    metrics::operation_scope scope(operation);
+    task_queue_seconds.observe(chrono::duration<double>(chrono::steady_clock::now() - posted).count());
+    tracing::span span("task");
+    try {
+      task();
+    } catch (const std::exception& err) {
+      VD_LOG(error, ws) << "Background task failed: " << err.what();
+    } catch (...) {
+      VD_LOG(error, ws) << "Background task failed with an unknown error.";
+    }
+  };
+
+  if(!access || *access == method_access::stateless) {
+    asio::post(*method_pool, run_task);
+  } else if(*access == method_access::read) {
+    asio::post(*method_pool, [run_task]() {
+      shared_lock<shared_mutex> lock(state_mutex);
+      run_task();
+    });
+  } else if(*access == method_access::long_write) {
+    asio::post(*write_strand, [run_task]() {
+      shared_lock<shared_mutex> lock(state_mutex);
+      long_write_lock = &lock;
+      run_task();
+      long_write_lock = nullptr;
+    });
+  } else {
+    asio::post(*write_strand, [run_task]() {
+      unique_lock<shared_mutex> lock(state_mutex);
+      run_task();
+    });
+  }
+}
+
+void wait_for_tasks() {
+  method_pool->join();
+}
+
+void send_to_server(const string& message, bool warn_if_dropped) {
+  shared_ptr<WsClient::Connection> conn;
+  {
+    lock_guard<mutex> lock(server_connection_mutex);
+    conn = server_connection;
+  }
+  if(conn) {
+    send_message(*conn, message);
+  } else if(warn_if_dropped && ws_client) {
+    VD_LOG(warn, ws) << "Not connected to server, dropping message.";
+  }
+}
+
+// The session log method messages are appended to, if recording.
+static mutex record_mutex;
+static ofstream record_file;
+static chrono::steady_clock::time_point record_start;
+
+void record_methods(const string& path, const json& header) {
+  lock_guard<mutex> lock(record_mutex);
+  record_file.open(path, ios::binary | ios::trunc);
+  if(!record_file) {
+    throw runtime_error("Could not open " + path + " to record methods.");
+  }
+  record_file << header.dump() << "\n" << flush;
+  record_start = chrono::steady_clock::now();
+  VD_LOG(info, ws) << "Recording method messages to " << path << ".";
+}
+
+// Lines are flushed as they are written, so that the log survives the
+// backend being killed.
+static void record_method(const string& method_name, const json& args) {
+  lock_guard<mutex> lock(record_mutex);
+  if(!record_file.is_open()) {
+    return;
+  }
+  double t = chrono::duration<double>(chrono::steady_clock::now() - record_start).count();
+  record_file << json{ {"t", t}, {"method", method_name}, {"args", args} }.dump() << "\n" << flush;
 }
 
 void send_tree(string tree_string, WsClient::Connection& conn) {
   string msg_string = "{\"type\":\"tree\",";
   msg_string += ("\"tree\":" + tree_string + "}");
-  conn.send(msg_string);
+  send_message(conn, msg_string);
 }
 
 void start_ws_client() {
   ws_client->on_message = [](std::shared_ptr<WsClient::Connection> connection, std::shared_ptr<WsClient::InMessage> in_message) {
     string msg_str = in_message -> string();
-    cout << msg_str << endl;
+    VD_LOG(trace, ws) << msg_str;
     json msg_json;
     try {
       msg_json = json::parse(msg_str);
     } catch (json::parse_error& err) {
-      cout << "Could not parse the following JSON, dropping message." << endl;
-      cout << "\"\"\"" << endl;
-      cout << msg_str << endl;
-      cout << "\"\"\"" << endl;
-      cout << "More information:" << endl;
-      cout << "-------------------------------" << endl;
-      cout << err.what() << endl;
-      cout << "-------------------------------" << endl;
+      VD_LOG(warn, ws) << "Could not parse the following JSON, dropping message.\n"
+                       << "\"\"\"\n" << msg_str << "\n\"\"\"\n"
+                       << "More information: " << err.what();
       return;
     }
 
@@ -64,12 +348,12 @@ void start_ws_client() {
       msg_type_str = msg_json.at("type");
       msg_type = msg_types.at(msg_type_str);
     } catch (json::out_of_range& err) {
-      cout << "Message type not specified! Dropping message." << endl;
+      VD_LOG(warn, ws) << "Message type not specified! Dropping message.";
       return;
     } catch (json::type_error& err) {
-      cout << "Message is not a valid JSON object! Dropping message." << endl;
+      VD_LOG(warn, ws) << "Message is not a valid JSON object! Dropping message.";
     } catch (std::out_of_range& err) {
-      cout << "Message type " << msg_type_str << " unknown! Dropping message." << endl;
+      VD_LOG(warn, ws) << "Message type " << msg_type_str << " unknown! Dropping message.";
     }
 
     switch (msg_type) {
@@ -77,32 +361,48 @@ void start_ws_client() {
         string method_name = "unknown";
         try {
           method_name = msg_json.at("method");
-          cout << "Getting arguments!" << endl;
           auto method_args = msg_json.at("args");
           auto handler = method_handlers.at(method_name);
-          cout << "Calling handler!" << endl;
+          record_method(method_name, method_args);
+          VD_LOG(debug, ws) << "Dispatching " << method_name << ".";
           handler(method_args, connection);
         } catch (json::out_of_range& err) {
-          cout << "Method request does not specify method or arguments! Dropping message." << endl;
+          VD_LOG(warn, ws) << "Method request does not specify method or arguments! Dropping message.";
         } catch (std::out_of_range& err) {
-          cout << "No handler defined for message of type " << method_name << "! Dropping message." << endl;
+          VD_LOG(warn, ws) << "No handler defined for message of type " << method_name << "! Dropping message.";
         }
         break;
     }
   };
 
   ws_client->on_open = [](std::shared_ptr<WsClient::Connection> connection) {
-    cout << "Connected to server." << endl;
-    connection -> send("{ \"type\": \"id\", \"id\": \"backend\" }");
+    VD_LOG(info, ws) << "Connected to server.";
+    {
+      lock_guard<mutex> lock(server_connection_mutex);
+      server_connection = connection;
+    }
+    json id_msg = { {"type", "id"}, {"id", "backend"} };
+    if(ws_compress_threshold) {
+      id_msg["compression"] = { {"format", "deflate"}, {"threshold", *ws_compress_threshold} };
+    }
+    connection -> send(id_msg.dump());
   };
 
   ws_client->on_close = [](std::shared_ptr<WsClient::Connection> /*connection*/, int status, const string & /*reason*/) {
-    cout << "Server connection closed with status " << status << endl;
+    {
+      lock_guard<mutex> lock(server_connection_mutex);
+      server_connection.reset();
+    }
+    VD_LOG(info, ws) << "Server connection closed with status " << status;
   };
 
   ws_client->on_error = [](std::shared_ptr<WsClient::Connection> /*connection*/, const SimpleWeb::error_code &ec) {
-    cout << "Websocket error " << ec << ": " << ec.message() << endl;
+    VD_LOG(error, ws) << "Websocket error " << ec << ": " << ec.message();
   };
 
   ws_client->start();
-}
\ No newline at end of file
+}
+
+void stop_ws_client() {
+  ws_client->stop();
+}
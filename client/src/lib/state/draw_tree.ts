@@ -52,7 +52,7 @@ export function draw_highlight(
           .style("font-family", "sans-serif")
           .style("box-sizing", "border-box")
           .style("border-width", "0.12rem")
-          .style("border-style", "solid")
+          .style("border-style", (d) => d.stale ? "dashed" : "solid")
           .style("border-radius", "4px")
           .style("padding", "4px")
           .html((d) => {
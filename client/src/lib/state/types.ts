@@ -4,6 +4,8 @@ export type flat_node = {
   name: string,
   parent: string,
   ered: number,
+  stale?: boolean,
+  ered_interval?: [number, number],
   params: string[],
   lwidth? : number,
   vspace?: number,
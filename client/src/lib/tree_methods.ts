@@ -8,4 +8,7 @@ export const extrude_branch = make_method_caller("extrude_branch", ["node_name",
 export const delete_node = make_method_caller("delete_node", ["node_name"]);
 export const merge_nodes = make_method_caller("merge_nodes", ["node_name", "alt_node_name"]);
 export const auto_merge = make_method_caller("auto_merge", []);
-export const reset_tree = make_method_caller("reset_tree", []);
\ No newline at end of file
+export const reset_tree = make_method_caller("reset_tree", []);
+export const batch = make_method_caller("batch", ["ops"]);
+export const reload_samples = make_method_caller("reload_samples", []);
+export const bootstrap = make_method_caller("bootstrap", []);
@@ -5,10 +5,26 @@ import { browser, dev } from "$app/environment";
 let _connected = $state(false);
 let _busy = $state(false);
 
+// The backend connects before it has finished starting up, and reports the
+// state of each startup stage as it changes.
+export type startup_stage = {
+  name : string,
+  state : "waiting" | "running" | "done" | "failed" | "skipped",
+  seconds : number
+};
+let _startup = $state<startup_stage[]>([]);
+
+// The last method the backend failed to run, until the next is called.
+export type method_error = { method : string, message : string };
+let _error = $state<method_error | null>(null);
+
 export const connection = {
   get connected() { return _connected; },
   get busy() { return _busy; },
-  get frozen() { return _busy || !_connected; }
+  get frozen() { return _busy || !_connected; },
+  get startup() { return _startup; },
+  get error() { return _error; },
+  get starting() { return _startup.some((stage) => stage.state !== "done"); }
 };
 
 // Connect to the same host/port that served the page
@@ -20,6 +36,8 @@ type tree_handler_t =
 
 const tree_handlers : tree_handler_t[] = [];
 let save_handler : (succ : boolean) => void = () => {};
+let metrics_handler : (metrics : object) => void = () => {};
+let memory_handler : (memory : object) => void = () => {};
 const queue : string[] = [];
 
 function send_message(msg : string) {
@@ -34,6 +52,27 @@ export function handle_save(handler: (succ : boolean) => void) {
   save_handler = handler;
 }
 
+// Backend timings and counters, keyed by metric name; see metrics.hpp in
+// the backend for their shape.
+export function handle_metrics(handler : (metrics : object) => void) {
+  metrics_handler = handler;
+}
+
+// Unlike other methods, this does not freeze the interface while waiting.
+export function request_metrics() {
+  send_message(JSON.stringify({ type : "method", method : "metrics", args : {} }));
+}
+
+// Bytes held by each of the backend's large structures, and its resident
+// and peak resident set sizes; see memory_report.hpp in the backend.
+export function handle_memory(handler : (memory : object) => void) {
+  memory_handler = handler;
+}
+
+export function request_memory() {
+  send_message(JSON.stringify({ type : "method", method : "memory", args : {} }));
+}
+
 export function handle_message(handler : tree_handler_t) {
   tree_handlers.push(handler);
 }
@@ -47,6 +86,7 @@ export function make_method_caller(method_name : string, arg_keys : string[]) {
       }
     }
     _busy = true;
+    _error = null;
     send_message(JSON.stringify({
       type : "method",
       method : method_name,
@@ -71,38 +111,81 @@ if (browser && ws) {
     _connected = false;
   });
 
+  // Large messages from the backend arrive as zlib-compressed binary
+  // frames, which the server forwards untouched. Inflating them is
+  // asynchronous, so messages are chained to keep them in the order they
+  // arrived.
+  let pending : Promise<void> = Promise.resolve();
   ws.addEventListener("message", (event) => {
     if(event.data === "test_message") {
       ws.send("test_receipt");
       return;
     }
-    try {
-      const pdata = JSON.parse(event.data);
-      console.log("Got message:", pdata);
-      switch(pdata.type) {
-        case "tree":
-          tree_handlers.forEach((h) => h(
-            JSON.parse(pdata.tree),
-            JSON.parse(pdata.globals),
-            JSON.parse(pdata.global_limit),
-            JSON.parse(pdata.groups),
-            pdata.sid ? JSON.parse(pdata.sid) : undefined
-          ));
-          _busy = false;
-          break;
-        case "io":
-          console.log("Got IO message!")
-          const succ = pdata.status;
-          save_handler(succ);
+    if(typeof event.data === "string") {
+      pending = pending.then(() => handle_message_text(event.data, true));
+    } else {
+      pending = pending
+        .then(() => inflate(event.data))
+        .then((text) => handle_message_text(text, false))
+        .catch((err) => {
+          console.error("Could not decompress message: ", err);
           _busy = false;
-          break;
-        default:
-          console.error("Received message of unknown type: ", pdata);
-      }
-    } catch (err) {
-      console.error("Could not convert message to JSON:\n ", event.data);
-      console.error(err);
-      _busy = false;
+        });
     }
   });
 }
+
+async function inflate(data : Blob | ArrayBuffer) : Promise<string> {
+  const blob = (data instanceof Blob) ? data : new Blob([data]);
+  const stream = blob.stream().pipeThrough(new DecompressionStream("deflate"));
+  return await new Response(stream).text();
+}
+
+// The server re-encodes each field of the trees it relays as a JSON
+// string; trees in compressed frames come straight from the backend.
+function handle_message_text(data : string, from_server : boolean) {
+  try {
+    const pdata = JSON.parse(data);
+    console.log("Got message:", pdata);
+    // deno-lint-ignore no-explicit-any
+    const field = (value : any) => from_server ? JSON.parse(value) : value;
+    switch(pdata.type) {
+      case "tree":
+        tree_handlers.forEach((h) => h(
+          field(pdata.tree),
+          field(pdata.globals),
+          field(pdata.global_limit),
+          field(pdata.groups),
+          pdata.sid ? field(pdata.sid) : undefined
+        ));
+        _busy = false;
+        break;
+      case "status":
+        _startup = pdata.stages;
+        break;
+      case "metrics":
+        metrics_handler(pdata.metrics);
+        break;
+      case "memory":
+        memory_handler(pdata.memory);
+        break;
+      case "error":
+        console.error(`Backend failed to run ${pdata.method}: ${pdata.message}`);
+        _error = { method : pdata.method, message : pdata.message };
+        _busy = false;
+        break;
+      case "io":
+        console.log("Got IO message!")
+        const succ = pdata.status;
+        save_handler(succ);
+        _busy = false;
+        break;
+      default:
+        console.error("Received message of unknown type: ", pdata);
+    }
+  } catch (err) {
+    console.error("Could not convert message to JSON:\n ", data);
+    console.error(err);
+    _busy = false;
+  }
+}
@@ -9,14 +9,16 @@ open Fg_parser.Parse_file
 
 (* CLI Processing Stuff *)
 
-let correct_usage_message = "parse-fg-spec <spec_file> -d <data_file>"
+let correct_usage_message = "parse-fg-spec <spec_file> -d <data_file> [-b]"
 
 let spec_file = ref ""
 let data_file = ref ""
+let binary_output = ref false
 let set_file file = spec_file := file
 
 let flag_list = [
   ("-d", Arg.Set_string data_file, "Set the data file name");
+  ("-b", Arg.Set binary_output, "Write the binary format read by the backend");
 ]
 
 let () = Arg.parse flag_list set_file correct_usage_message
@@ -25,6 +27,58 @@ let () = Arg.parse flag_list set_file correct_usage_message
 
 let print_tree = false
 
+(* Binary output: the magic "VDFG" and a version, then records, each a tag
+   character followed by 32-bit little-endian integers. Names are interned:
+   'n' (length, bytes) defines the next name id, and every other record
+   refers to names by id. 'f' is a factor (name, count, parameter names),
+   'r' the root, 'l' a leaf set (count, names) and 'e' ends the output.
+   The backend builds the factor graph as the records arrive. *)
+
+let binary_version = 1
+let out_buffer = Buffer.create 65536
+let flush_out () = print_string (Buffer.contents out_buffer); Buffer.clear out_buffer
+let add_u32 n = Buffer.add_int32_le out_buffer (Int32.of_int n)
+let name_ids : (string, int) Hashtbl.t = Hashtbl.create 4096
+
+let name_id name =
+  match Hashtbl.find_opt name_ids name with
+  | Some id -> id
+  | None ->
+    let id = Hashtbl.length name_ids in
+    Hashtbl.add name_ids name id;
+    Buffer.add_char out_buffer 'n';
+    add_u32 (String.length name);
+    Buffer.add_string out_buffer name;
+    id
+
+let add_names names =
+  let ids = List.map name_id names in
+  add_u32 (List.length ids);
+  List.iter add_u32 ids
+
+let print_binary fg (tree : tree_data) =
+  set_binary_mode_out stdout true;
+  Buffer.add_string out_buffer "VDFG";
+  add_u32 binary_version;
+  List.iter (fun (fname, ps) ->
+    let fid = name_id fname in
+    (* Parameter names are defined before the record that uses them. *)
+    List.iter (fun p -> ignore (name_id p)) ps;
+    Buffer.add_char out_buffer 'f';
+    add_u32 fid;
+    add_names ps;
+    if Buffer.length out_buffer >= 65536 then flush_out ()) fg;
+  let root_id = name_id tree.root in
+  Buffer.add_char out_buffer 'r';
+  add_u32 root_id;
+  List.iter (fun l_names ->
+    List.iter (fun n -> ignore (name_id n)) l_names;
+    Buffer.add_char out_buffer 'l';
+    add_names l_names) tree.leaves;
+  Buffer.add_char out_buffer 'e';
+  flush_out ();
+  flush stdout
+
 let print_err err_msg (err_st, err_en) code_text =
   let code_str = String.sub code_text err_st.pos_cnum (err_en.pos_cnum - err_st.pos_cnum) in
   let total_err = 
@@ -45,11 +99,17 @@ let () =
       check_model tree;
       let data_env = parse_data tree.data_block data_json in
       let fg = eval_model data_env tree.data_block tree.params_block tree.model_block in
+      if !binary_output then
+        (* Both are evaluated before anything is written, so errors are
+           never mixed into the binary output. *)
+        print_binary fg (eval_tree data_env tree.params_block tree.tree_block)
+      else begin
         ignore (List.map (fun (dname, ps) -> print_endline ((String.concat "\n" (dname :: ps)) ^ "\n-")) fg);
-      print_endline("--");
-      let tree = eval_tree data_env tree.params_block tree.tree_block in
-        let () = print_endline tree.root in
-          ignore (List.map (fun l_names -> print_endline (String.concat ", " l_names)) tree.leaves);
+        print_endline("--");
+        let tree = eval_tree data_env tree.params_block tree.tree_block in
+          let () = print_endline tree.root in
+            ignore (List.map (fun l_names -> print_endline (String.concat ", " l_names)) tree.leaves);
+      end
     end with
       | TypeError (msg, loc) -> print_err msg loc text
       | RuntimeError (msg, loc) -> print_err msg loc text
@@ -23,9 +23,12 @@ type Clients = {
   frontend : undefined | WebSocketWithData 
 }
 
+// Compressed frames from the backend are binary, and forwarded as they are.
+type ws_message = string | Blob | ArrayBuffer;
+
 type Queues = { 
-  backend : string[],
-  frontend : string[]
+  backend : ws_message[],
+  frontend : ws_message[]
 }
 
 function add_data_to_ws (ws : WebSocket) : asserts ws is WebSocketWithData {
@@ -43,7 +46,8 @@ const queues : Queues = {
 };
 
 const args = parseArgs(Deno.args, {
-  string: ["M", "D", "S", "N", "A", "port"],
+  string: ["M", "D", "S", "N", "A", "port", "compress_threshold", "log", "journal", "metrics_file", "trace", "memory_limit", "record"],
+  boolean: ["no_sample_cache", "no_parser_cache", "single_precision", "out_of_core"],
   default: {
     port: "8765"
   }
@@ -88,6 +92,39 @@ try {
       "-N", args.N,
       "-P", PORT.toString()
     ];
+  if (args.compress_threshold != null) {
+    passed_args.push("--compress_threshold", args.compress_threshold);
+  }
+  if (args.log != null) {
+    passed_args.push("--log", args.log);
+  }
+  if (args.journal != null) {
+    passed_args.push("--journal", args.journal);
+  }
+  if (args.metrics_file != null) {
+    passed_args.push("--metrics_file", args.metrics_file);
+  }
+  if (args.trace != null) {
+    passed_args.push("--trace", args.trace);
+  }
+  if (args.memory_limit != null) {
+    passed_args.push("--memory_limit", args.memory_limit);
+  }
+  if (args.record != null) {
+    passed_args.push("--record", args.record);
+  }
+  if (args.no_sample_cache) {
+    passed_args.push("--no_sample_cache");
+  }
+  if (args.no_parser_cache) {
+    passed_args.push("--no_parser_cache");
+  }
+  if (args.single_precision) {
+    passed_args.push("--single_precision");
+  }
+  if (args.out_of_core) {
+    passed_args.push("--out_of_core");
+  }
   const command = new Deno.Command(backend_path,
     {
       args: passed_args as string[],
@@ -158,34 +195,55 @@ function handle_http_request(req : Request) {
   }
 }
 
+// The backend sends large messages as zlib-compressed binary frames when
+// started with --compress_threshold. They are forwarded to the frontend
+// still compressed, and inflated there, so that large trees are never sent
+// uncompressed. The frontend handles the backend's messages itself then.
 function create_message_handler(socket : WebSocketWithData) {
   // deno-lint-ignore no-explicit-any
   return (event : MessageEvent<any>) => {
-    if (event.data === "ping") {
-      socket.send("pong");
+    if (typeof event.data === "string") {
+      handle_message_text(socket, event.data);
+    } else if (socket.data.id === "backend") {
+      try_send("frontend", event.data);
     } else {
-      try {
-        const pdata = JSON.parse(event.data);
-        switch(pdata.type) {
-          case "id":
-            attach_id(socket, pdata.id);
-            break;
-          case "method":
-            console.log("Requesting method from backend...")
-            try_send("backend", event.data);
-            break;
-          case "tree":
-            handle_tree(pdata);
-            break;
-          case "io":
-            try_send("frontend", JSON.stringify(pdata));
-            break;
-          default:
-            console.log("Received message! ", pdata);
-        }
-      } catch (_err) {
-        console.error("Could not convert message to JSON:\n ", event.data);
+      console.error("Ignoring binary message from a client other than the backend.");
+    }
+  }
+}
+
+function handle_message_text(socket : WebSocketWithData, data : string) {
+  if (data === "ping") {
+    socket.send("pong");
+  } else {
+    try {
+      const pdata = JSON.parse(data);
+      switch(pdata.type) {
+        case "id":
+          attach_id(socket, pdata.id);
+          if (pdata.compression != null) {
+            console.log(`Backend compresses messages over ${pdata.compression.threshold} bytes (${pdata.compression.format}).`);
+          }
+          break;
+        case "method":
+          console.log("Requesting method from backend...")
+          try_send("backend", data);
+          break;
+        case "tree":
+          handle_tree(pdata);
+          break;
+        case "io":
+        case "error":
+        case "status":
+        case "metrics":
+        case "memory":
+          try_send("frontend", JSON.stringify(pdata));
+          break;
+        default:
+          console.log("Received message! ", pdata);
       }
+    } catch (_err) {
+      console.error("Could not convert message to JSON:\n ", data);
     }
   }
 }
@@ -255,7 +313,7 @@ async function open_browser() {
   }
 }
 
-function try_send(client_name : "frontend" | "backend", message : string) {
+function try_send(client_name : "frontend" | "backend", message : ws_message) {
   if(clients[client_name] == null) {
     queues[client_name].push(message);
   } else {